@@ -11,27 +11,91 @@
  * with configurable idle behavior. The module also supports flexible assignment of logical bits (as
  * provided by the user) to physical GPIO pins.
  *
- * The main data structure is the s_data array which holds the value/ticks pairs in a PIO-ready
- * format (physical bit positions, ticks). The public API uses value/duration pairs with logical bit
- * positions and duration in seconds. Data mapping and conversion is mostly handled in apg_data.c.
+ * The main data structure is the pattern memory which holds the value/ticks pairs. The uploaded
+ * pattern (e->data) is kept in logical bit order; the public API uses value/duration pairs with logical
+ * bit positions and duration in seconds. Data conversion is mostly handled in apg_data.c.
+ *
+ * Besides the points, each bank holds a loop table: every loop descriptor plays a group of
+ * consecutive points repeat times. A plain pattern is a single descriptor with repeat 1, repeated
+ * groups (clock bursts, long holds) cost one descriptor instead of a copy per repetition.
+ *
+ * Pattern memory is double buffered: uploads go to e->data while the active bank keeps playing.
+ * Committing maps e->data to physical bit positions into the spare bank (PIO-ready format) and swaps
+ * a single pointer (e->active_bank), which the DMA picks up at the next pattern wrap, so the new
+ * pattern starts without gap or glitch. Mapping changes only mark the banks stale, they are
+ * committed again when the outputs or the APG get enabled (see apg_materialize).
  *
  * The main PIO program (apg) reads value/ticks pairs and outputs the value on the pins for the
- * specified duration. It is fed the s_data array via the data DMA channel. A control DMA channel is
- * used to restart the data DMA channel continuously for continuous mode. In burst mode, the burst
- * PIO program (apg_burst) is used to generated "control blocks" for the control DMA channel, with
- * n-times the main data and a final idle value.
+ * specified duration. It is fed the active bank via the data DMA channel. Patterns in the packed
+ * format (16 bit value and ticks in one word, GPIO 0..15) and the sampled format (one value per sample
+ * period, set by the SM clock divider) are played by further entry points of the same program,
+ * selected with their wrap at the trigger (see apg_sm_select). The loops are executed by
+ * the sequencer PIO program (apg_seq), which turns each loop descriptor into repeat "control blocks"
+ * (trans_count, read_addr). A control DMA channel restarts the data DMA channel with them.
+ * The sequencer itself is fed the loop table by the sequencer DMA channel:
+ * - In continuous mode, it chains to a reload DMA channel when done, which points a loader DMA
+ *   channel at e->active_bank. The loader then restarts the sequencer DMA from the bank's loop table.
+ * - In burst mode, the sequencer DMA wraps around the loop table n times (read ring), then chains
+ *   to the reload DMA channel, which appends a final idle value. A DURATION burst is planned the same
+ *   way, with the loops and points up to its end appended before the idle value (apg_duration_plan).
+ * - With the segment sequencer (see apg_set_segment), the loop table is compiled from the segments at
+ *   the commit. A sequence linking back continues at that segment (e->active_bank->seq) instead of the
+ *   start of the table (->entry). Descriptors flagged APG_LOOP_WAIT stall the sequencer until a trigger
+ *   arrives while running, which sets the PIO IRQ flag APG_SEQ_TRIGGER_IRQ.
+ * - In gapless mode (continuous, single-loop patterns), the data DMA reads a power-of-two pattern
+ *   from a read ring with an endless transfer count. Otherwise the sequencer repeats the loop, which
+ *   saves the loop table reload but still restarts the data DMA at every wrap, so it is not gapless.
+ *   Either way a commit restarts the pattern.
+ *
+ * In streaming mode the data DMA reads a ring buffer instead (read ring), which is filled with
+ * records from the network. It is fed in chunks by apg_stream_service() on core1: while a chunk
+ * plays, the next one is armed by pointing the data DMA's chain at the control DMA, which loads a
+ * full control block (ctrl, read_addr, write_addr, trans_count) and thereby also disarms the chain.
+ * The built-in generators (apg_gen.c) take the place of the network there: apg_stream_service() tops
+ * the ring up from the generator, which is rewound to its seed whenever the engine stops. With
+ * streaming off, they write one period of their sequence as the pattern instead.
+ *
+ * The marker output (apg_set_marker) is one more bit of the physical output word, set at the commit in the
+ * first point played and in flagged points, so it changes with the same `out` instruction as the data.
  *
+ * With the trigger sources EXT and INT, a trigger does not start the engines: they are armed instead, i.e.
+ * prepared as for a start, but with the main SM in the apg_trig program, which waits for the trigger GPIO
+ * (EXT) or the IRQ flag set by the timer SM (apg_timer, INT) and then jumps to the entry point of the
+ * format. The trigger delay is counted down in between, so the start latency is a fixed number of clock
+ * cycles, and apg_trigger_service() on core1 re-arms an engine once its burst has finished.
+ *
+ * All of the above exists once per engine (apg_engine_t, APG_ENGINES set at build time). Engine n runs
+ * on PIO block n, so the idle bit can be read back per engine and its `out pins, 32` does not touch
+ * the pins of the other engines. A trigger starts all enabled engines with a single PIO CTRL write
+ * (see apg_trigger_start), the trigger and burst settings are shared.
+ *
+ * PWM is started in software (BUS, IMM, and the software dispatch of EXT and INT) with the store right
+ * before that write: on the RP2350 they are two consecutive str instructions, addresses and values already
+ * in registers. The core issues the PIO1 CTRL write on the AHB once the PWM EN write has passed the APB
+ * bridge, so PWM starts counting 1 system clock cycle before the SMs are enabled, and the SMs output their
+ * first value in the cycle after (every format starts with `out pins`). At the default bus priorities a DMA
+ * transfer to a PIO block that wins the arbitration first (the data DMA filling a TX FIFO, the loop DMA
+ * reading the sequencer's RX FIFO) delays the CTRL write by one cycle each, so the skew is 1 to 3 cycles;
+ * traffic at the APB bridge delays both writes alike. These figures follow from the bus timing of the
+ * datasheet, they have not been measured. Engines armed in PIO (EXT, INT) start by themselves, PWM a few
+ * microseconds later from the software dispatch: PWM and the APG are not synchronized with these sources.
  */
 
+#include <math.h>
 #include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
 
+#include "hardware/clocks.h"
 #include "hardware/dma.h"
 #include "hardware/pio.h"
+#include "hardware/pwm.h"
 #include "pico/sync.h"
 
 #include "apg.h"
 #include "apg.pio.h"
 #include "apg_internal.h"
+#include "common/core1_mailbox.h"
 #include "common/output.h"
 #include "common/trigger.h"
 
@@ -61,374 +125,1873 @@
 #define CS_EXIT() critical_section_exit(&s_apg_crit_sec)
 
 /* Public APG module configuration and state */
-bool g_apg_is_enabled; /* SOUR:APG:STATE */
-SOURCE_APG_IDLE_MODE_IDLE_MODE_t g_apg_idle_mode;
-uint32_t g_apg_idle_value;
-size_t g_apg_data_count;
+apg_config_t g_apg_config[APG_ENGINES];
 
 /* internal variables */
 static critical_section_t s_apg_crit_sec;
-apg_item_t s_data[APG_MAX_DATA_POINTS];
-uint8_t s_phys_for_logical[APG_MAX_BITS]; /* Logical bit -> physical GPIO/PIO bit (bijective) */
-uint8_t s_logical_for_phys[APG_MAX_BITS]; /* Inverse mapping */
-uint32_t s_active_mask;                   /* Physical bits enabled for output */
-static apg_item_t s_idle_point;
-static alarm_id_t s_burst_duration_alarm = -1;
-static volatile int32_t s_remaining_cycles;
-static PIO s_pio = pio0;
-static int s_sm = -1;
-static int s_burst_sm = -1;
-static int s_prog_offset = -1;
-static int s_burst_prog_offset = -1;
-static int s_dma_chan = -1;
-static int s_dma_ctrl_chan = -1;
-dma_channel_config s_dma_ctrl_burst_cfg;
-dma_channel_config s_dma_ctrl_cont_cfg;
-static bool s_initialized = false;
-static uint32_t s_data_ptr = 0;
+apg_engine_t s_engines[APG_ENGINES];
+/* INT timer periods (apg_int_timer_update) and those missed by the engines (apg_int_missed) */
+static uint64_t s_int_start_us;
+static uint64_t s_int_cycles;
+static uint32_t s_int_khz;
+static volatile uint32_t s_int_missed;
+/* Per engine memory; in a bank, the spare point keeps the end of bank 0 apart from the start of bank 1 (see apg_shadow_ready) */
+static uint32_t s_data_mem[APG_ENGINES][APG_MAX_DATA_WORDS];
+static uint32_t s_data_bank[APG_ENGINES][2][APG_MAX_DATA_WORDS + 2];
+alignas(APG_MAX_LOOPS * sizeof(apg_loop_t)) static apg_loop_t s_loop_bank[APG_ENGINES][2][APG_MAX_LOOPS];
+alignas(1u << APG_STREAM_RING_BITS) static apg_item_t s_stream_ring[APG_ENGINES][APG_STREAM_RING_POINTS];
 
 /* Static assertions to ensure assumptions about DMA data structures are valid. */
 static_assert(sizeof(apg_item_t) == 8, "apg_item_t must be 8 bytes");
 static_assert(alignof(apg_item_t) == 4, "apg_item_t not 4-byte aligned");
+static_assert(sizeof(apg_ctrl_block_t) == 8, "apg_ctrl_block_t must match two DMA registers");
+static_assert(sizeof(apg_loop_t) == 16, "apg_loop_t must be 4 words (apg_seq program, DMA read ring)");
+static_assert((APG_MAX_LOOPS & (APG_MAX_LOOPS - 1)) == 0, "APG_MAX_LOOPS must be a power of two");
+static_assert(sizeof(s_stream_ring[0]) == (1u << APG_STREAM_RING_BITS), "stream ring size must match the DMA ring");
+static_assert(APG_ENGINES >= 1 && APG_ENGINES <= NUM_PIOS, "APG engines need one PIO block each");
 
-static __force_inline bool apg_is_idle(void) {
+static void apg_engine_abort(apg_engine_t *e);
+static void apg_engine_start(apg_engine_t *e);
+static void apg_duration_plan(const apg_engine_t *e, const apg_bank_t *bank, apg_dur_plan_t *plan);
+
+static __force_inline bool apg_is_idle(const apg_engine_t *e) {
     /* To distinguish between IDLE and RUNNING state, we use one bit of the PIO output value
      * which is set only in the idle point (APG_IDLE_GPIO). This way we can check if we are
      * currently idle by reading the PIO output value, without needing to track state in software.
      * The data is limitied to 24 bit and configurable GPIOs are limited to 0..22 on SCPI level,
      * so APG_IDLE_GPIO=29 is always available and doesn't conflict with user mappings.
      */
-    return s_pio->dbg_padout & (1u << APG_IDLE_GPIO); /* Check if idle bit is set in PIO output value */
+    return e->pio->dbg_padout & (1u << APG_IDLE_GPIO); /* Check if idle bit is set in PIO output value */
+}
+
+/* Whether the sequencer is waiting for a trigger before a descriptor (APG_LOOP_WAIT), e.g. before the first one */
+static __force_inline bool apg_seq_waiting(const apg_engine_t *e) {
+    return (e->pio->ctrl & (1u << (PIO_CTRL_SM_ENABLE_LSB + (uint)e->seq_sm))) != 0 &&
+           pio_sm_get_pc(e->pio, (uint)e->seq_sm) == (uint)e->seq_prog_offset + apg_seq_offset_trigger_wait;
+}
+
+/* Whether the engine is started by a hardware trigger (apg_trig): EXT, or INT with its timer SM running */
+static __force_inline bool apg_hw_trigger(const apg_engine_t *e) {
+    return g_trigger_config.source == TRG_SOURCE_EXT || (g_trigger_config.source == TRG_SOURCE_INT && e->timer_sm >= 0);
+}
+
+/* Physical value of a bank point */
+static __force_inline uint32_t apg_bank_value(const apg_bank_t *bank, size_t idx) {
+    switch (bank->format) {
+    case FORMAT_PACKED:
+        return bank->data[idx] & APG_PACKED_MAX_VALUE;
+    case FORMAT_SAMPLED:
+        return bank->data[idx];
+    default:
+        return bank->data[idx * 2u];
+    }
+}
+
+/* log2 of the pattern size in bytes if it can be played from a DMA read ring, 0 otherwise */
+static __force_inline uint apg_ring_bits(size_t words) {
+#ifdef APG_DMA_ENDLESS_COUNT
+    const size_t bytes = words * sizeof(uint32_t);
+    if (words == 0 || (bytes & (bytes - 1u)) != 0 || bytes > (1u << APG_RING_MAX_BITS)) {
+        return 0;
+    }
+    return (uint)__builtin_ctz(bytes);
+#else
+    (void)words;
+    return 0; /* no endless DMA transfers */
+#endif
+}
+
+/* Entry point of the main SM program for the pattern format */
+static __force_inline uint apg_sm_entry(SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    switch (format) {
+    case FORMAT_PACKED:
+        return apg_offset_packed;
+    case FORMAT_SAMPLED:
+        return apg_offset_sample;
+    default:
+        return apg_offset_wide;
+    }
+}
+
+/*
+ * Load a 32-bit value into X or Y of an SM without going through its TX FIFO (which the DMA may be filling):
+ * shifted into the ISR 5 bits at a time with `set x` / `in x`, then moved. X is used as scratch, so load
+ * Y first. The SM must be disabled and its ISR shift to the right (default).
+ */
+static void __not_in_flash_func(apg_sm_load)(PIO pio, uint sm, enum pio_src_dest dest, uint32_t value) {
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_isr, pio_null));
+    for (uint shift = 0; shift < 32u; shift += 5u) {
+        const uint bits = (32u - shift < 5u) ? 32u - shift : 5u; /* the first bits end up lowest */
+        pio_sm_exec(pio, sm, pio_encode_set(pio_x, (value >> shift) & 0x1Fu));
+        pio_sm_exec(pio, sm, pio_encode_in(pio_x, bits));
+    }
+    pio_sm_exec(pio, sm, pio_encode_mov(dest, pio_isr));
+}
+
+/*
+ * Select the entry point, wrap and clock divider of the main SM program for the pattern format.
+ * The SM must be disabled. Wide points can still be played in packed mode after an escape word.
+ */
+static __force_inline void apg_sm_select(apg_engine_t *e, SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    const uint entry = apg_sm_entry(format);
+    uint wrap_target = apg_wrap_target;
+    uint wrap = apg_wrap;
+    uint32_t div = APG_SAMPLE_DIV_MIN;
+
+    switch (format) {
+    case FORMAT_PACKED:
+        wrap_target = entry;
+        wrap = apg_offset_packed_countdown;
+        break;
+    case FORMAT_SAMPLED:
+        wrap_target = wrap = entry;
+        div = e->cfg->sample_div;
+        break;
+    default:
+        break;
+    }
+
+    pio_sm_set_wrap(e->pio, (uint)e->sm, (uint)e->prog_offset + wrap_target, (uint)e->prog_offset + wrap);
+    pio_sm_set_clkdiv_int_frac8(e->pio, (uint)e->sm, div >> 8, (uint8_t)(div & 0xFFu));
+    pio_sm_clkdiv_restart(e->pio, (uint)e->sm); /* first sample period starts with the SM */
+    pio_sm_exec(e->pio, (uint)e->sm, pio_encode_jmp((uint)e->prog_offset + entry));
+    e->sm_format = format;
+}
+
+/* Safely abort all APG DMA channels (See RP2040-E13 / RP2350-E5) */
+static __force_inline void apg_dma_abort(const apg_engine_t *e) {
+    const int chans[] = {e->dma_chan, e->dma_ctrl_chan, e->dma_seq_chan, e->dma_reload_chan, e->dma_loader_chan};
+    for (size_t i = 0; i < count_of(chans); i++) {
+        hw_clear_bits(&dma_hw->ch[chans[i]].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    }
+    for (size_t i = 0; i < count_of(chans); i++) {
+        dma_channel_abort((uint)chans[i]);
+    }
+    for (size_t i = 0; i < count_of(chans); i++) {
+        hw_set_bits(&dma_hw->ch[chans[i]].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    }
 }
 
-void apg_update_idle(void) {
-    /* if there is no pattern data, use s_idle_value */
-    /* s_idle_value has logical mapping, s_idle_point and s_data have physical*/
-    uint32_t word = apg_map_logical_to_phys(g_apg_idle_value);
+static void apg_engine_update_idle(apg_engine_t *e) {
+    /* if there is no pattern data, use the idle value */
+    /* the idle value has logical mapping, e->idle_point and the pattern banks have physical*/
+    uint32_t word = apg_map_logical_to_phys(e, e->cfg->idle_value);
+    const apg_bank_t *active = e->active_bank;
 
-    if (g_apg_data_count > 0) {
-        switch (g_apg_idle_mode) {
+    if (active->points > 0) {
+        switch (e->cfg->idle_mode) {
         case IDLE_MODE_FIRST:
-            word = s_data[0].value;
+            word = apg_bank_value(active, 0);
             break;
         case IDLE_MODE_LAST:
-            word = s_data[g_apg_data_count - 1].value;
+            word = apg_bank_value(active, active->points - 1);
             break;
         }
     }
+    word &= ~apg_marker_mask(e->cfg); /* the marker stays low while idle */
 
     //CS_ENTER();
 
-    s_idle_point.value = word | (1u << APG_IDLE_GPIO); /* Ensure idle bit is set in idle point */
+    e->idle_point.value = word | (1u << APG_IDLE_GPIO); /* Ensure idle bit is set in idle point */
+    e->idle_packed[0] = word & APG_PACKED_MAX_VALUE;     /* Escape word (ticks 0), outputs the idle value already */
+    e->idle_packed[1] = e->idle_point.value;
 
     /* If currently idle, we need to update the PIO with the new idle point. */
     /* Otherwise it wil get picked up at the end of the current cycle. */
-    if (apg_is_idle()) {
-        pio_sm_put(s_pio, (uint)s_sm, s_idle_point.value);
-        pio_sm_put(s_pio, (uint)s_sm, s_idle_point.ticks);
+    if (e->trig_armed) {
+        /* The FIFO holds the start of the pattern: arm again behind the new idle point (and on the new bank) */
+        /* An armed stream keeps its records, the new idle point is output after them */
+        if (!e->stream_running) {
+            apg_engine_abort(e);
+        }
+    } else if (apg_is_idle(e)) {
+        if (e->sm_format == FORMAT_PACKED) {
+            pio_sm_put(e->pio, (uint)e->sm, e->idle_packed[0]);
+        }
+        pio_sm_put(e->pio, (uint)e->sm, e->idle_point.value);
+        if (e->sm_format != FORMAT_SAMPLED) {
+            pio_sm_put(e->pio, (uint)e->sm, e->idle_point.ticks);
+        }
     }
 
     //CS_EXIT();
 }
 
-static void apg_hw_setup(void) {
+/* Hardware steps of the setters, handed to core1 like every start and stop of the engines (see core1_call) */
+static int apg_engine_abort_core1(void *arg) {
+    apg_engine_abort(arg);
+    return 0;
+}
+
+static int apg_engine_update_idle_core1(void *arg) {
+    apg_engine_update_idle(arg);
+    return 0;
+}
+
+static void apg_hw_setup(apg_engine_t *e) {
     /* part of module init, no locking needed */
 
     /* Lazy-claim SM/PIO program/DMA channel once. */
-    if (s_sm < 0) {
-        s_sm = pio_claim_unused_sm(s_pio, true);
+    if (e->sm < 0) {
+        e->sm = pio_claim_unused_sm(e->pio, true);
     }
-    if (s_burst_sm < 0) {
-        s_burst_sm = pio_claim_unused_sm(s_pio, true);
+    if (e->seq_sm < 0) {
+        e->seq_sm = pio_claim_unused_sm(e->pio, true);
     }
-    if (s_prog_offset < 0) {
-        if (!pio_can_add_program(s_pio, &apg_program)) {
+    if (e->prog_offset < 0) {
+        if (!pio_can_add_program(e->pio, &apg_program)) {
             return;
         }
-        s_prog_offset = pio_add_program(s_pio, &apg_program);
+        e->prog_offset = pio_add_program(e->pio, &apg_program);
     }
-    if (s_burst_prog_offset < 0) {
-        if (!pio_can_add_program(s_pio, &apg_burst_program)) {
+    if (e->seq_prog_offset < 0) {
+        if (!pio_can_add_program(e->pio, &apg_seq_program)) {
             return;
         }
-        s_burst_prog_offset = pio_add_program(s_pio, &apg_burst_program);
+        e->seq_prog_offset = pio_add_program(e->pio, &apg_seq_program);
     }
 
-    if (s_sm >= 0 && s_prog_offset >= 0) {
-        pio_sm_config c = apg_program_get_default_config((uint)s_prog_offset);
-        pio_sm_init(s_pio, (uint)s_sm, (uint)s_prog_offset, &c);
+    if (e->sm >= 0 && e->prog_offset >= 0) {
+        pio_sm_config c = apg_program_get_default_config((uint)e->prog_offset);
+        pio_sm_init(e->pio, (uint)e->sm, (uint)e->prog_offset, &c);
     }
 
-    if (s_burst_sm >= 0 && s_burst_prog_offset >= 0) {
-        pio_sm_config c = apg_burst_program_get_default_config((uint)s_burst_prog_offset);
-        pio_sm_init(s_pio, (uint)s_burst_sm, (uint)s_burst_prog_offset, &c);
+    if (e->seq_sm >= 0 && e->seq_prog_offset >= 0) {
+        pio_sm_config c = apg_seq_program_get_default_config((uint)e->seq_prog_offset);
+        pio_sm_init(e->pio, (uint)e->seq_sm, (uint)e->seq_prog_offset, &c);
     }
 
-    if (s_dma_chan < 0) {
-        s_dma_chan = dma_claim_unused_channel(true);
+    if (e->dma_chan < 0) {
+        e->dma_chan = dma_claim_unused_channel(true);
     }
 
-    if (s_dma_ctrl_chan < 0) {
-        s_dma_ctrl_chan = dma_claim_unused_channel(true);
+    if (e->dma_ctrl_chan < 0) {
+        e->dma_ctrl_chan = dma_claim_unused_channel(true);
     }
 
-    if (s_dma_chan >= 0 && s_dma_ctrl_chan >= 0 && s_sm >= 0 && s_burst_sm >= 0) {
+    if (e->dma_seq_chan < 0) {
+        e->dma_seq_chan = dma_claim_unused_channel(true);
+    }
+
+    if (e->dma_reload_chan < 0) {
+        e->dma_reload_chan = dma_claim_unused_channel(true);
+    }
+
+    if (e->dma_loader_chan < 0) {
+        e->dma_loader_chan = dma_claim_unused_channel(true);
+    }
+
+    if (e->dma_chan >= 0 && e->dma_ctrl_chan >= 0 && e->dma_seq_chan >= 0 && e->dma_reload_chan >= 0 && e->dma_loader_chan >= 0 && e->sm >= 0 && e->seq_sm >= 0) {
         /* data DMA streams packed {value,ticks} words into the TX FIFO. Chains to control DMA when done. */
-        dma_channel_config cfg = dma_channel_get_default_config((uint)s_dma_chan);
-        channel_config_set_high_priority(&cfg, true);
-        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
-        channel_config_set_read_increment(&cfg, true);
-        channel_config_set_write_increment(&cfg, false);
-        channel_config_set_dreq(&cfg, pio_get_dreq(s_pio, (uint)s_sm, true));
-        channel_config_set_chain_to(&cfg, (uint)s_dma_ctrl_chan);
-        dma_channel_configure((uint)s_dma_chan, &cfg,
-                              &s_pio->txf[s_sm],
+        e->dma_data_cfg = dma_channel_get_default_config((uint)e->dma_chan);
+        channel_config_set_high_priority(&e->dma_data_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_data_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_data_cfg, true);
+        channel_config_set_write_increment(&e->dma_data_cfg, false);
+        channel_config_set_dreq(&e->dma_data_cfg, pio_get_dreq(e->pio, (uint)e->sm, true));
+        channel_config_set_chain_to(&e->dma_data_cfg, (uint)e->dma_ctrl_chan);
+        dma_channel_configure((uint)e->dma_chan, &e->dma_data_cfg,
+                              &e->pio->txf[e->sm],
                               NULL,
                               0,
                               false);
 
-        /* In burst mode: control DMA reads (trans_count, read_addr) sequence from burst SM and writes to data DMA with trigger. */
-        s_dma_ctrl_burst_cfg = dma_channel_get_default_config((uint)s_dma_ctrl_chan);
-        channel_config_set_high_priority(&s_dma_ctrl_burst_cfg, true);
-        channel_config_set_transfer_data_size(&s_dma_ctrl_burst_cfg, DMA_SIZE_32);
-        channel_config_set_read_increment(&s_dma_ctrl_burst_cfg, false);
-        channel_config_set_write_increment(&s_dma_ctrl_burst_cfg, true);
-        channel_config_set_ring(&s_dma_ctrl_burst_cfg, true, 3);                                      // Wrap around after writing 2^3 (=8) bytes (transfer count + read addr (trigger))
-        channel_config_set_dreq(&s_dma_ctrl_burst_cfg, pio_get_dreq(s_pio, (uint)s_burst_sm, false)); // DREQ on burst sm RX FIFO
+        /* In streaming mode: data DMA wraps around the stream ring, no chaining until armed (chain to self = off) */
+        e->dma_data_stream_cfg = e->dma_data_cfg;
+        channel_config_set_ring(&e->dma_data_stream_cfg, false, APG_STREAM_RING_BITS);
+        channel_config_set_chain_to(&e->dma_data_stream_cfg, (uint)e->dma_chan);
+
+        /* In streaming mode: control DMA copies e->stream_cb to the data DMA al1 registers (last one triggers) */
+        e->dma_ctrl_stream_cfg = dma_channel_get_default_config((uint)e->dma_ctrl_chan);
+        channel_config_set_high_priority(&e->dma_ctrl_stream_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_ctrl_stream_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_ctrl_stream_cfg, true);
+        channel_config_set_write_increment(&e->dma_ctrl_stream_cfg, true);
+        channel_config_set_ring(&e->dma_ctrl_stream_cfg, true, 4); // Wrap around after writing 2^4 (=16) bytes (ctrl, read addr, write addr, transfer count (trigger))
+
+        /* control DMA reads (trans_count, read_addr) sequence from sequencer SM and writes to data DMA with trigger. */
+        e->dma_ctrl_seq_cfg = dma_channel_get_default_config((uint)e->dma_ctrl_chan);
+        channel_config_set_high_priority(&e->dma_ctrl_seq_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_ctrl_seq_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_ctrl_seq_cfg, false);
+        channel_config_set_write_increment(&e->dma_ctrl_seq_cfg, true);
+        channel_config_set_ring(&e->dma_ctrl_seq_cfg, true, 3);                                    // Wrap around after writing 2^3 (=8) bytes (transfer count + read addr (trigger))
+        channel_config_set_dreq(&e->dma_ctrl_seq_cfg, pio_get_dreq(e->pio, (uint)e->seq_sm, false)); // DREQ on sequencer sm RX FIFO
+
+        /* sequencer DMA streams the loop table into the sequencer SM. Chains to reload DMA when done. */
+        e->dma_seq_cfg = dma_channel_get_default_config((uint)e->dma_seq_chan);
+        channel_config_set_high_priority(&e->dma_seq_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_seq_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_seq_cfg, true);
+        channel_config_set_write_increment(&e->dma_seq_cfg, false);
+        channel_config_set_dreq(&e->dma_seq_cfg, pio_get_dreq(e->pio, (uint)e->seq_sm, true)); // DREQ on sequencer sm TX FIFO
+        channel_config_set_chain_to(&e->dma_seq_cfg, (uint)e->dma_reload_chan);
+
+        /* In continuos mode: reload DMA writes e->active_bank to the loader DMA read_addr with trigger */
+        e->dma_reload_cont_cfg = dma_channel_get_default_config((uint)e->dma_reload_chan);
+        channel_config_set_high_priority(&e->dma_reload_cont_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_reload_cont_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_reload_cont_cfg, false);
+        channel_config_set_write_increment(&e->dma_reload_cont_cfg, false);
+
+        /* In burst mode: reload DMA feeds the idle loop into the sequencer SM */
+        e->dma_reload_tail_cfg = dma_channel_get_default_config((uint)e->dma_reload_chan);
+        channel_config_set_high_priority(&e->dma_reload_tail_cfg, true);
+        channel_config_set_transfer_data_size(&e->dma_reload_tail_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&e->dma_reload_tail_cfg, true);
+        channel_config_set_write_increment(&e->dma_reload_tail_cfg, false);
+        channel_config_set_dreq(&e->dma_reload_tail_cfg, pio_get_dreq(e->pio, (uint)e->seq_sm, true)); // DREQ on sequencer sm TX FIFO
+
+        /* loader DMA copies the bank's loop table block (trans_count, read_addr) to the sequencer DMA with trigger */
+        dma_channel_config loader_cfg = dma_channel_get_default_config((uint)e->dma_loader_chan);
+        channel_config_set_high_priority(&loader_cfg, true);
+        channel_config_set_transfer_data_size(&loader_cfg, DMA_SIZE_32);
+        channel_config_set_read_increment(&loader_cfg, true);
+        channel_config_set_write_increment(&loader_cfg, true);
+        channel_config_set_ring(&loader_cfg, true, 3); // Wrap around after writing 2^3 (=8) bytes (transfer count + read addr (trigger))
+        dma_channel_configure((uint)e->dma_loader_chan, &loader_cfg,
+                              &dma_channel_hw_addr((uint)e->dma_seq_chan)->al3_transfer_count,
+                              NULL,
+                              2,
+                              false);
+    }
+}
 
-        /* In continuos mode: control DMA only writes read_addr to data DMA with trigger */
-        s_dma_ctrl_cont_cfg = dma_channel_get_default_config((uint)s_dma_ctrl_chan);
-        channel_config_set_high_priority(&s_dma_ctrl_cont_cfg, true);
-        channel_config_set_transfer_data_size(&s_dma_ctrl_cont_cfg, DMA_SIZE_32);
-        channel_config_set_read_increment(&s_dma_ctrl_cont_cfg, false);
-        channel_config_set_write_increment(&s_dma_ctrl_cont_cfg, false);
+/* Settings, running state and hardware of the engines, on core1 (see apg_init_module) */
+static int apg_init_engines_core1(void *arg) {
+    (void)arg;
+    CS_ENTER();
+
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+
+        /* Engine n runs on PIO block n: the idle bit is read back per block and the SM drives all 32 pins */
+        if (e->cfg == NULL) {
+            memset(e, 0, sizeof(*e));
+            e->pio = pio_get_instance(n);
+            e->sm = e->seq_sm = -1;
+            e->prog_offset = e->seq_prog_offset = -1;
+            e->dma_chan = e->dma_ctrl_chan = e->dma_seq_chan = e->dma_reload_chan = e->dma_loader_chan = -1;
+            e->trig_prog_offset = -1;
+            e->timer_sm = e->timer_prog_offset = -1;
+        } else {
+            /*
+             * Reset (*RST): the banks up to the hardware (from e->pio on), which is kept, apg_hw_setup() claims
+             * it only once; the upload side is cleared by apg_init_module() after this
+             */
+            memset(&e->bank, 0, offsetof(apg_engine_t, pio) - offsetof(apg_engine_t, bank));
+        }
+        e->cfg = &g_apg_config[n];
+        e->index = n;
+        e->burst_duration_alarm = -1;
+        e->int_period = -1;
+        e->data = s_data_mem[n];
+        e->stream_ring = s_stream_ring[n];
+
+        e->cfg->is_enabled = false;
+        e->cfg->idle_mode = IDLE_MODE_VALUE;
+        e->cfg->idle_value = 0;
+        e->cfg->data_format = FORMAT_WIDE;
+        e->cfg->sample_div = APG_SAMPLE_DIV_MIN;
+        e->cfg->stream_enabled = false;
+        e->cfg->gapless = false;
+        e->cfg->sequence_enabled = false;
+        e->cfg->gen = (apg_gen_config_t){.type = GEN_TYPE_NONE, .width = 8u, .seed = 0};
+        e->cfg->marker_gpio = -1;
+        e->cfg->marker_flag = -1;
+
+        e->idle_point.value = (1u << APG_IDLE_GPIO);
+        e->idle_point.ticks = 0;
+        e->idle_loop = (apg_loop_t){.repeat = 1, .count = 2u, .data = &e->idle_point.value}; // value+tick for idle point
+        e->idle_packed[0] = 0;
+        e->idle_packed[1] = e->idle_point.value;
+        e->idle_packed[2] = e->idle_point.ticks;
+        e->idle_packed_loop = (apg_loop_t){.repeat = 1, .count = 3u, .data = e->idle_packed}; // escape + idle point
+        e->idle_sample_loop = (apg_loop_t){.repeat = 1, .count = 1u, .data = &e->idle_point.value}; // idle value, held
+
+        /* Bank 0 active (empty), bank 1 spare; their loop tables are cleared by apg_init_module() */
+        for (size_t i = 0; i < 2; i++) {
+            e->bank[i] = (apg_bank_t){.seq = {0, s_loop_bank[n][i]}, .entry = {0, s_loop_bank[n][i]}, .mem = s_data_bank[n][i], .data = s_data_bank[n][i], .loops = s_loop_bank[n][i]};
+        }
+        e->active_bank = &e->bank[0];
+
+        apg_hw_setup(e);
+        apg_engine_abort(e); // Ensure we are in a clean idle state (PIO SM reset and enabled, DMA stopped, idle point output)
+
+        if (e->dma_chan >= 0 && e->dma_ctrl_chan >= 0 && e->dma_seq_chan >= 0 && e->dma_reload_chan >= 0 && e->dma_loader_chan >= 0 &&
+            e->sm >= 0 && e->seq_sm >= 0 && e->prog_offset >= 0 && e->seq_prog_offset >= 0)
+            e->initialized = true;
     }
+
+    CS_EXIT();
+    return 0;
 }
 
+/*
+ * The engines are disabled, stopped and brought up on core1 first. Their upload side (pattern, loop tables,
+ * bit mapping and its lookup tables) and the bank loop tables are cleared here afterwards, without the lock:
+ * with the engines disabled nothing on core1 reads them, and *RST does not hold up the core1 main loop for it.
+ */
 void apg_init_module(void) {
     PWM_IRQ_DEBUG_INIT();
 
     if (!critical_section_is_initialized(&s_apg_crit_sec)) {
         critical_section_init(&s_apg_crit_sec);
     }
-    CS_ENTER();
+    (void)core1_call(apg_init_engines_core1, NULL);
+
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
 
-    s_initialized = false;
+        memset(s_loop_bank[n], 0, sizeof(s_loop_bank[n]));
+        memset(&e->loops, 0, offsetof(apg_engine_t, bank) - offsetof(apg_engine_t, loops));
+        apg_data_init(e);
+    }
+}
+
+void apg_update_idle(unsigned int engine) {
+    (void)core1_call(apg_engine_update_idle_core1, &s_engines[engine]);
+}
+
+/**
+ * Check if a new pattern can be committed.
+ * After a commit, the previously active bank stays in use until the DMA has picked up the new one at
+ * the next pattern wrap (continuous) or the running burst has finished. Once that happened, the old
+ * bank becomes the spare bank again, which the next commit fills.
+ */
+static bool apg_engine_shadow_ready(apg_engine_t *e) {
+    if (!e->swap_pending) {
+        return true;
+    }
 
-    g_apg_is_enabled = false;
-    g_apg_idle_mode = IDLE_MODE_VALUE;
-    g_apg_idle_value = 0;
-    g_apg_data_count = 0;
-    s_active_mask = 0;
-    for (size_t i = 0; i < APG_MAX_BITS; i++) {
-        s_phys_for_logical[i] = (uint8_t)i;
-        s_logical_for_phys[i] = (uint8_t)i;
+    const apg_bank_t *active = e->active_bank;
+    /* While streaming, the DMA does not read the pattern banks at all */
+    if (e->initialized && !e->stream_running && !(apg_is_idle(e) && !dma_channel_is_busy((uint)e->dma_chan))) {
+        /* Still running: the swap is done once the data DMA reads from the new bank */
+        /* (loops are played in order, so by then the sequencer is done with the old loop table too) */
+        const uintptr_t read_addr = dma_hw->ch[e->dma_chan].read_addr;
+        const uintptr_t start = (uintptr_t)active->data;
+        const uintptr_t end = start + active->points * apg_point_words(active->format) * sizeof(uint32_t);
+        if (read_addr < start || read_addr > end) {
+            return false;
+        }
     }
 
-    s_idle_point.value = (1u << APG_IDLE_GPIO);
-    s_idle_point.ticks = 0;
+    /* The old bank is no longer referenced by e->active_bank, so no new run can pick it up */
+    e->swap_pending = false;
+    return true;
+}
 
-    s_data_ptr = (uint32_t)&s_data[0];
+bool apg_shadow_ready(unsigned int engine) {
+    return apg_engine_shadow_ready(&s_engines[engine]);
+}
 
-    apg_hw_setup();
-    apg_abort(); // Ensure we are in a clean idle state (PIO SM reset and enabled, DMA stopped, idle point output)
+/* Check if a loop other than the first one plays the point at p */
+static bool apg_point_replayed(const apg_loop_t *loops, size_t loop_count, const uint32_t *p) {
+    for (size_t i = 1; i < loop_count; i++) {
+        if (p >= loops[i].data && p < loops[i].data + loops[i].count) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (s_dma_chan >= 0 && s_dma_ctrl_chan >= 0 && s_sm >= 0 && s_burst_sm >= 0 && s_prog_offset >= 0 && s_burst_prog_offset >= 0)
-        s_initialized = true;
+/* Descriptors apg_mark_start() adds to a loop table: 0 if the first point is marked in place */
+static size_t apg_mark_descriptors(const apg_loop_t *loops, size_t loop_count) {
+    if (loops[0].repeat <= 1u && !apg_point_replayed(loops, loop_count, loops[0].data)) {
+        return 0;
+    }
+    return (loops[0].repeat > 1u) ? 2u : 1u;
+}
 
+/* Whether the start of the active pattern can be marked (apg_set_marker): marked already or room in its loop table */
+bool apg_marker_fits(const apg_engine_t *e) {
+    const apg_bank_t *bank = e->active_bank;
+    if (bank->loop_count == 0 || bank->loops[0].data == bank->mark) {
+        return true;
+    }
+    return bank->loop_count + apg_mark_descriptors(bank->loops, bank->loop_count) <= APG_MAX_LOOPS;
+}
+
+/**
+ * Set the marker bit in the first point played, so the marker is output with it at the start and at every wrap only.
+ * The point is marked in place if nothing else plays it (single loop patterns keep their DMA ring). Otherwise
+ * its first pass is split off into up to 2 more descriptors, starting with a marked copy of the point in bank->mark.
+ * Returns false, with nothing changed, if the loop table has no room for them.
+ */
+static bool apg_mark_start(const apg_engine_t *e, apg_bank_t *bank, uint32_t *data, apg_loop_t *loops, size_t *loop_count, size_t *wrap) {
+    const uint32_t marker = apg_marker_mask(e->cfg);
+    const uint32_t words = apg_point_words(bank->format);
+    const apg_loop_t first = loops[0];
+    const size_t added = apg_mark_descriptors(loops, *loop_count);
+
+    if (added == 0) {
+        data[first.data - data] |= marker; /* value word of the point (packed: marker < 16 in the low half word) */
+        return true;
+    }
+    if (*loop_count + added > APG_MAX_LOOPS) {
+        return false;
+    }
+    memmove(&loops[1 + added], &loops[1], (*loop_count - 1u) * sizeof(apg_loop_t));
+    memcpy(bank->mark, first.data, words * sizeof(uint32_t));
+    bank->mark[0] |= marker;
+    loops[0] = (apg_loop_t){.flags = first.flags, .repeat = 1u, .count = words, .data = bank->mark};
+    loops[1] = (apg_loop_t){.repeat = 1u, .count = first.count - words, .data = first.data + words}; /* count 0 is skipped */
+    if (added == 2u) {
+        loops[2] = (apg_loop_t){.repeat = first.repeat - 1u, .count = first.count, .data = first.data};
+    }
+    *loop_count += added;
+    if (*wrap > 0) {
+        *wrap += added;
+    }
+    return true;
+}
+
+/*
+ * Place words of point data in the bank memory. Single-loop patterns of a power-of-two size are aligned to it,
+ * so they can be played from a DMA read ring (the spare words at the end of the bank are kept free, see apg_shadow_ready).
+ */
+static uint32_t *apg_bank_place(apg_bank_t *bank, size_t words, size_t loop_count) {
+    uint32_t *data = bank->mem;
+    const uint ring_bits = apg_ring_bits(words);
+    if (loop_count == 1 && ring_bits > 0) {
+        const uintptr_t ring_mask = (1u << ring_bits) - 1u;
+        uint32_t *aligned = (uint32_t *)(((uintptr_t)bank->mem + ring_mask) & ~ring_mask);
+        if (aligned + words <= bank->mem + APG_MAX_DATA_WORDS) {
+            data = aligned;
+        }
+    }
+    bank->data = data;
+    return data;
+}
+
+/*
+ * Make the filled spare bank (points, format and data set, loop_count descriptors in its loop table, the wrap
+ * at loops[wrap]) active, built with the current mapping, and restart right away if requested.
+ */
+typedef struct {
+    apg_engine_t *e;
+    apg_bank_t *bank;
+    bool restart;
+} apg_bank_switch_args_t;
+
+/* The switch of apg_bank_activate, on core1: the new bank goes live and the engine is restarted on it if needed */
+static int apg_bank_switch_core1(void *arg) {
+    const apg_bank_switch_args_t *args = arg;
+    apg_engine_t *e = args->e;
+    apg_bank_t *bank = args->bank;
+
+    CS_ENTER();
+    e->active_bank = bank; /* single word write, picked up by the reload DMA */
+    e->swap_pending = true;
     CS_EXIT();
+
+    apg_engine_update_idle(e);
+
+    if (!e->cfg->stream_enabled && !apg_is_idle(e) && (bank->points == 0 || args->restart)) {
+        /* Nothing to play, or nothing visible to glitch: restart on the new bank instead of waiting for the wrap */
+        apg_engine_abort(e);
+        apg_engine_start(e);
+    }
+
+    apg_engine_shadow_ready(e); /* completes right away if idle */
+    return 0;
+}
+
+static void apg_bank_activate(apg_engine_t *e, apg_bank_t *bank, size_t loop_count, size_t wrap, bool restart) {
+    apg_loop_t *loops = (apg_loop_t *)bank->loops;
+
+    if (bank->loop_count > loop_count) {
+        /* Keep the loop table zero beyond the used descriptors (padding in NCYCLES mode) */
+        memset(&loops[loop_count], 0, (bank->loop_count - loop_count) * sizeof(apg_loop_t));
+    }
+
+    /* The SM program is selected at the trigger, so a format change cannot be picked up at the wrap */
+    /* A gapless loop never returns to the loop table of the active bank, so it has to restart as well */
+    if (bank->format != e->active_bank->format || e->gapless_running) {
+        restart = true;
+    }
+
+    bank->loop_count = loop_count;
+    memcpy(bank->logical_for_phys, e->logical_for_phys, sizeof(bank->logical_for_phys));
+    bank->marker = apg_marker_mask(e->cfg);
+    bank->marker_flag = e->cfg->marker_flag;
+    /* Continuous mode starts with the whole table and continues at the segment a sequence links back to */
+    bank->entry = (apg_ctrl_block_t){(uint32_t)(loop_count * (sizeof(apg_loop_t) / sizeof(uint32_t))), loops};
+    bank->seq = (apg_ctrl_block_t){(uint32_t)((loop_count - wrap) * (sizeof(apg_loop_t) / sizeof(uint32_t))), &loops[wrap]};
+    e->map_dirty = false;
+    apg_duration_plan(e, bank, &bank->dur); /* not played yet, so no lock */
+
+    apg_bank_switch_args_t args = {e, bank, restart};
+    (void)core1_call(apg_bank_switch_core1, &args);
+}
+
+/**
+ * Map e->data to physical bit positions into the spare bank, make it active and restart right away if requested.
+ * Returns -1 if the segment sequence cannot be compiled or the loop table has no room to mark the start (see
+ * apg_mark_start), the active bank is kept then.
+ */
+static int apg_commit(apg_engine_t *e, bool restart) {
+    apg_bank_t *bank = apg_spare_bank(e);
+    apg_loop_t *loops = (apg_loop_t *)bank->loops;
+    const SOURCE_APGN_DATA_FORMAT_FORMAT_t format = e->cfg->data_format;
+
+    /* Loop table with e->data pointers, rebased below */
+    size_t loop_count = e->loop_count;
+    size_t wrap = 0;
+    if (e->cfg->sequence_enabled) {
+        const int n = apg_compile_sequence(e, loops, &wrap);
+        if (n < 0) {
+            /* Keep the loop table zero beyond the used descriptors (see apg_bank_activate) */
+            memset(&loops[bank->loop_count], 0, (APG_MAX_LOOPS - bank->loop_count) * sizeof(apg_loop_t));
+            return -1;
+        }
+        loop_count = (size_t)n;
+    } else {
+        memcpy(loops, e->loops, loop_count * sizeof(apg_loop_t));
+    }
+
+    uint32_t *data = apg_bank_place(bank, e->cfg->data_count * apg_point_words(format), loop_count);
+    bank->points = e->cfg->data_count;
+    bank->format = format;
+
+    switch (format) {
+    case FORMAT_PACKED:
+        /* Only GPIO 0..15 can be mapped in packed format, the ticks stay in the high half word */
+        for (size_t i = 0; i < e->cfg->data_count; i++) {
+            const uint32_t word = e->data[i];
+            data[i] = (apg_map_marked(e, word & APG_PACKED_MAX_VALUE) & APG_PACKED_MAX_VALUE) |
+                      (word & ~APG_PACKED_MAX_VALUE);
+        }
+        break;
+    case FORMAT_SAMPLED:
+        for (size_t i = 0; i < e->cfg->data_count; i++) {
+            data[i] = apg_map_marked(e, e->data[i]);
+        }
+        break;
+    default:
+        for (size_t i = 0; i < e->cfg->data_count * 2u; i += 2u) {
+            data[i] = apg_map_marked(e, e->data[i]);
+            data[i + 1] = e->data[i + 1];
+        }
+        break;
+    }
+    for (size_t i = 0; i < loop_count; i++) {
+        loops[i].data = data + (loops[i].data - e->data); // rebase to the bank points
+    }
+    if (apg_marker_mask(e->cfg) != 0 && loop_count > 0 && !apg_mark_start(e, bank, data, loops, &loop_count, &wrap)) {
+        /* No room to mark the start, like a sequence that does not fit: keep the active bank */
+        memset(&loops[bank->loop_count], 0, (APG_MAX_LOOPS - bank->loop_count) * sizeof(apg_loop_t));
+        return -1;
+    }
+
+    apg_bank_activate(e, bank, loop_count, wrap, restart);
+    return 0;
+}
+
+/*
+ * Bring the active bank up to the current bit mapping and marker: its points are moved from the mapping it
+ * was built with to the current one (apg_remap_marked) into the spare bank, which is made active and restarted.
+ * Unlike a commit, e->data is not read, so an upload staged for the next commit stays staged.
+ */
+static void apg_remap(apg_engine_t *e) {
+    const apg_bank_t *old = e->active_bank;
+    apg_bank_t *bank = apg_spare_bank(e);
+    apg_loop_t *loops = (apg_loop_t *)bank->loops;
+    const size_t words = old->points * apg_point_words(old->format);
+    size_t loop_count = old->loop_count;
+    size_t wrap = (size_t)((const apg_loop_t *)old->seq.addr - old->loops);
+
+    uint32_t *data = apg_bank_place(bank, words, loop_count);
+    bank->points = old->points;
+    bank->format = old->format;
+
+    apg_update_remap_lut(e, old);
+    switch (old->format) {
+    case FORMAT_PACKED:
+        for (size_t i = 0; i < words; i++) {
+            const uint32_t word = old->data[i];
+            data[i] = (apg_remap_marked(e, old, word & APG_PACKED_MAX_VALUE) & APG_PACKED_MAX_VALUE) |
+                      (word & ~APG_PACKED_MAX_VALUE);
+        }
+        break;
+    case FORMAT_SAMPLED:
+        for (size_t i = 0; i < words; i++) {
+            data[i] = apg_remap_marked(e, old, old->data[i]);
+        }
+        break;
+    default:
+        for (size_t i = 0; i < words; i += 2u) {
+            data[i] = apg_remap_marked(e, old, old->data[i]);
+            data[i + 1] = old->data[i + 1];
+        }
+        break;
+    }
+
+    /* Same loop table, rebased; a marked copy of the first point is moved along and marked with the new marker */
+    const bool copied = loop_count > 0 && old->loops[0].data == old->mark;
+    memcpy(loops, old->loops, loop_count * sizeof(apg_loop_t));
+    for (size_t i = 0; i < loop_count; i++) {
+        loops[i].data = (loops[i].data == old->mark) ? bank->mark : data + (loops[i].data - old->data);
+    }
+    if (copied) {
+        bank->mark[0] = apg_remap_marked(e, old, old->mark[0]) | apg_marker_mask(e->cfg);
+        bank->mark[1] = old->mark[1];
+    } else if (apg_marker_mask(e->cfg) != 0 && loop_count > 0) {
+        (void)apg_mark_start(e, bank, data, loops, &loop_count, &wrap); /* fits, checked by apg_set_marker */
+    }
+
+    apg_bank_activate(e, bank, loop_count, wrap, true);
+}
+
+/**
+ * Make the uploaded pattern the active one.
+ * While running, the DMA switches banks at the next pattern wrap without gap. In burst mode the new
+ * pattern is used from the next trigger on. Must only be called if apg_shadow_ready() returned true.
+ * Returns -1 if the segment sequence cannot be compiled (see apg_set_segment) or its start cannot be marked.
+ */
+int apg_commit_data(unsigned int engine) {
+    return apg_commit(&s_engines[engine], !g_output_state.enabled);
+}
+
+/*
+ * Bring the active bank up to date with the bit mapping before the pattern becomes visible (outputs or APG
+ * enabled). An upload not committed yet is left alone; it is mapped when it is committed.
+ */
+static void apg_materialize(apg_engine_t *e) {
+    if (e->map_dirty && e->cfg->stream_enabled && e->cfg->gen.type != GEN_TYPE_NONE) {
+        (void)core1_call(apg_engine_abort_core1, e); /* drop generated records mapped the old way */
+    }
+    if (e->map_dirty && apg_engine_shadow_ready(e)) {
+        apg_remap(e);
+    }
+}
+
+void apg_state_recalled(unsigned int engine) {
+    apg_engine_t *e = &s_engines[engine];
+
+    apg_update_map_luts(e);
+    e->map_dirty = false;
+    if (apg_engine_shadow_ready(e)) {
+        (void)apg_commit(e, true); /* the sequence compiled when it was saved */
+    }
+}
+
+int apg_clock_check(uint32_t old_hz, uint32_t new_hz) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        if (apg_rescale_ticks(n, old_hz, new_hz, false) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void apg_clock_changed(uint32_t old_hz, uint32_t new_hz) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+
+        (void)apg_rescale_ticks(n, old_hz, new_hz, true); /* checked with apg_clock_check */
+        if (apg_engine_shadow_ready(e)) {
+            (void)apg_commit(e, true);
+        }
+    }
 }
 
-void apg_set_state(bool state) {
-    g_apg_is_enabled = state;
-    apg_abort(); // Ensure we are in a clean idle state (PIO SM reset and enabled, DMA stopped, idle point output)
+typedef struct {
+    unsigned int engine;
+    bool state;
+} apg_set_state_args_t;
+
+static int apg_set_state_core1(void *arg) {
+    const apg_set_state_args_t *args = arg;
+    apg_engine_t *e = &s_engines[args->engine];
+
+    e->cfg->is_enabled = args->state;
+    apg_engine_abort(e); // Ensure we are in a clean idle state (PIO SM reset and enabled, DMA stopped, idle point output)
     apg_outputs_update();
+    return 0;
+}
+
+/*
+ * The pattern is brought up to the bit mapping here (it walks all points, so not on core1, and the engine is
+ * not playing it yet); only the enable, abort and restart are handed to core1, with the trigger that restarts it.
+ */
+void apg_set_state(unsigned int engine, bool state) {
+    if (state) {
+        apg_materialize(&s_engines[engine]);
+    }
+    apg_set_state_args_t args = {engine, state};
+    (void)core1_call(apg_set_state_core1, &args);
+}
+
+void apg_set_gapless(unsigned int engine, bool state) {
+    apg_engine_t *e = &s_engines[engine];
+
+    e->cfg->gapless = state;
+    (void)core1_call(apg_engine_abort_core1, e); // Restart with the new loop mode
+}
+
+/* Start a data DMA transfer of the next points from the ring (DMA stopped) */
+static __force_inline void apg_stream_start_transfer(apg_engine_t *e, uint32_t points) {
+    dma_channel_configure((uint)e->dma_chan, &e->dma_data_stream_cfg,
+                          &e->pio->txf[e->sm],
+                          &e->stream_ring[e->stream_cur_end % APG_STREAM_RING_POINTS],
+                          points * 2u, // value+ticks data pairs
+                          true);
+    e->stream_cur_end += points;
+}
+
+/* Queue the next points behind the running transfer, loaded by the control DMA when it completes */
+static __force_inline void apg_stream_arm(apg_engine_t *e, uint32_t points) {
+    e->stream_cb[0] = channel_config_get_ctrl_value(&e->dma_data_stream_cfg); // chain to self, so it disarms again
+    e->stream_cb[1] = (uint32_t)&e->stream_ring[e->stream_cur_end % APG_STREAM_RING_POINTS];
+    e->stream_cb[2] = (uint32_t)&e->pio->txf[e->sm];
+    e->stream_cb[3] = points * 2u; // value+ticks data pairs
+    dma_hw->ch[e->dma_ctrl_chan].read_addr = (uint32_t)e->stream_cb;
+    e->stream_next_end = e->stream_cur_end + points;
+    e->stream_armed = true;
+    hw_write_masked(&dma_hw->ch[e->dma_chan].al1_ctrl,
+                    (uint)e->dma_ctrl_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+                    DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+}
+
+static __force_inline uint apg_stream_chain_to(const apg_engine_t *e) {
+    return (dma_hw->ch[e->dma_chan].al1_ctrl & DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS) >> DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB;
+}
+
+/* Keep the data DMA fed from the ring. Must be called with the critical section held. */
+static void __not_in_flash_func(apg_stream_poll)(apg_engine_t *e) {
+    bool busy = dma_channel_is_busy((uint)e->dma_chan);
+    const bool ctrl_busy = dma_channel_is_busy((uint)e->dma_ctrl_chan);
+    const uint chain_to = apg_stream_chain_to(e); /* read after the busy flags, see below */
+
+    if (e->stream_armed) {
+        if (chain_to == (uint)e->dma_chan) {
+            /* The control DMA has loaded the armed chunk (and reset the chain) */
+            e->stream_cur_end = e->stream_next_end;
+            e->stream_armed = false;
+        } else if (!busy && !ctrl_busy && !dma_channel_is_busy((uint)e->dma_chan)) {
+            /* The chunk in flight completed before the chain was armed: disarm and restart below */
+            hw_write_masked(&dma_hw->ch[e->dma_chan].al1_ctrl,
+                            (uint)e->dma_chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+                            DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+            e->stream_armed = false;
+        } else {
+            busy = true;
+        }
+    }
+
+    const uint32_t avail = e->stream_wr - (e->stream_armed ? e->stream_next_end : e->stream_cur_end);
+    const uint32_t points = (avail < APG_STREAM_CHUNK_POINTS) ? avail : APG_STREAM_CHUNK_POINTS;
+
+    if (!busy) {
+        e->stream_rd = e->stream_cur_end;
+        if (points > 0) {
+            /* Ring ran empty while playing (output held the last value), count as underrun */
+            if (e->stream_played) {
+                e->stream_underruns++;
+            }
+            apg_stream_start_transfer(e, points);
+            e->stream_played = true;
+        }
+    } else {
+        /* Everything before the words still to transfer has been read. If the armed chunk was loaded since
+         * the check above, the remaining count belongs to it and this just reports less free space. */
+        const uint32_t remaining = dma_hw->ch[e->dma_chan].transfer_count & DMA_CH0_TRANS_COUNT_COUNT_BITS;
+        e->stream_rd = e->stream_cur_end - remaining / 2u;
+        if (!e->stream_armed && points > 0) {
+            apg_stream_arm(e, points);
+        }
+    }
+}
+
+/*
+ * Switch DMA to streaming and queue whatever is in the ring. Must be called with the critical section held.
+ * The main SM is left disabled, the caller enables it (holds the idle output until the first record arrives).
+ */
+static void __not_in_flash_func(apg_stream_start)(apg_engine_t *e) {
+    pio_sm_set_enabled(e->pio, (uint)e->sm, false);
+    apg_dma_abort(e);
+
+    dma_channel_configure((uint)e->dma_ctrl_chan, &e->dma_ctrl_stream_cfg,
+                          &dma_channel_hw_addr((uint)e->dma_chan)->al1_ctrl,
+                          e->stream_cb,
+                          4,
+                          false);
+
+    e->stream_cur_end = e->stream_rd;
+    e->stream_armed = false;
+    e->stream_played = false;
+    e->stream_running = true;
+    apg_stream_poll(e);
+}
+
+static __force_inline bool apg_stream_generated(const apg_engine_t *e) {
+    return e->cfg->stream_enabled && e->cfg->gen.type != GEN_TYPE_NONE;
+}
+
+/**
+ * Poll streaming mode of all engines, called from the core1 main loop.
+ * A generated stream is topped up also while it waits for the trigger, so it starts with a full ring.
+ */
+void __not_in_flash_func(apg_stream_service)(void) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        if (!e->stream_running && !apg_stream_generated(e)) {
+            continue;
+        }
+
+        CS_ENTER();
+        if (apg_stream_generated(e)) {
+            apg_gen_fill_stream(e, APG_GEN_FILL_POINTS);
+        }
+        if (e->stream_running) {
+            apg_stream_poll(e);
+        }
+        CS_EXIT();
+    }
+}
+
+void apg_stream_set_state(unsigned int engine, bool state) {
+    apg_engine_t *e = &s_engines[engine];
+
+    e->cfg->stream_enabled = state;
+    e->cfg->gen.type = GEN_TYPE_NONE; /* neither a generated pattern nor a generated stream is continued in the other mode */
+    e->stream_underruns = 0;
+    (void)core1_call(apg_engine_abort_core1, e); // Ensure we are in a clean idle state (PIO SM reset and enabled, DMA stopped, idle point output)
+}
+
+int apg_set_generator(unsigned int engine, const apg_gen_config_t *gen) {
+    apg_engine_t *e = &s_engines[engine];
+
+    if (e->cfg->stream_enabled) {
+        if (gen->type != GEN_TYPE_NONE && e->cfg->sample_div < apg_gen_stream_min_div(gen)) {
+            return -1; /* core1 would not keep up with the sample rate, see apg_gen_stream_min_div */
+        }
+        CS_ENTER();
+        e->cfg->gen = *gen;
+        CS_EXIT();
+        (void)core1_call(apg_engine_abort_core1, e); /* drop the records generated so far, start over at the seed */
+        return 0;
+    }
+
+    if (gen->type != GEN_TYPE_NONE && apg_write_generated(e, gen) != 0) {
+        return -1;
+    }
+    e->cfg->gen = *gen;
+    return 0;
+}
+
+size_t apg_stream_free(unsigned int engine) {
+    const apg_engine_t *e = &s_engines[engine];
+    return APG_STREAM_RING_POINTS - (e->stream_wr - e->stream_rd);
+}
+
+uint32_t apg_stream_underruns(unsigned int engine) {
+    return s_engines[engine].stream_underruns;
+}
+
+/* DMA read ring size (log2 bytes) covering the loop table, padded to a power of two */
+static __force_inline uint apg_loop_ring_bits(size_t loop_count) {
+    uint bits = 4u; // one descriptor, 16 bytes
+    while ((1u << bits) < loop_count * sizeof(apg_loop_t)) {
+        bits++;
+    }
+    return bits;
+}
+
+/* Whether a gapless single loop is played from a DMA read ring (see apg_engine_prepare_run) */
+static __force_inline bool apg_ring_playable(const apg_engine_t *e, const apg_bank_t *active) {
+#ifdef APG_DMA_ENDLESS_COUNT
+    const apg_loop_t *loop = &active->loops[0];
+    const uint ring_bits = apg_ring_bits(loop->count);
+    return e->cfg->gapless && g_trigger_config.burst_type != BURST_MODE_NCYCLES && active->loop_count == 1 &&
+           ring_bits > 0 && ((uintptr_t)loop->data & ((1u << ring_bits) - 1u)) == 0;
+#else
+    (void)e;
+    (void)active;
+    return false;
+#endif
+}
+
+static __force_inline uint64_t apg_sat_mul(uint64_t a, uint64_t b) {
+    uint64_t r;
+    return __builtin_mul_overflow(a, b, &r) ? UINT64_MAX : r;
+}
+
+/* Play time of a point: SM cycles (wide, packed) or samples */
+static __force_inline uint64_t apg_point_units(const uint32_t *point, SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    switch (format) {
+    case FORMAT_PACKED:
+        return (point[0] >> APG_PACKED_TICKS_SHIFT) + APG_TICK_OVERHEAD;
+    case FORMAT_SAMPLED:
+        return 1u;
+    default:
+        return (uint64_t)point[1] + APG_TICK_OVERHEAD;
+    }
+}
+
+/* Play time of one pass of a loop */
+static uint64_t __not_in_flash_func(apg_loop_units)(const apg_loop_t *loop, SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    const size_t words = apg_point_words(format);
+    uint64_t units = 0;
+    for (size_t i = 0; i + words <= loop->count; i += words) {
+        units += apg_point_units(&loop->data[i], format);
+    }
+    return units;
+}
+
+/* Length of a DURATION burst in the play time units of a bank format: SM cycles, or samples */
+static __force_inline uint64_t apg_duration_units(const apg_engine_t *e, SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    const uint64_t cycles = g_trigger_config.burst_duration_cycles;
+    return (format == FORMAT_SAMPLED) ? (cycles * 256u + e->cfg->sample_div / 2u) / e->cfg->sample_div : cycles;
+}
+
+/**
+ * Plan a DURATION burst that ends in hardware: the sequencer plays whole passes of the loop table and the
+ * loops up to the end of the burst, then the tail (plan->tail): the repeats of the loop the end falls
+ * into, the points of its last pass and the point the end falls into, shortened; then the idle point.
+ * The burst thus ends on the exact SM cycle (sampled format: sample), except when that is within the first
+ * APG_TICK_OVERHEAD (packed: + 1) cycles of a point, which is then left out.
+ * It walks all points, so it is made at the commit and when the burst length changes (apg_duration_update),
+ * without the lock; a start only copies it (apg_engine_prepare_run). plan->exact is false for sequences
+ * (waits, links) and passes the sequencer DMA cannot count; the burst duration alarm ends the burst then.
+ */
+static void apg_duration_plan(const apg_engine_t *e, const apg_bank_t *bank, apg_dur_plan_t *plan) {
+    const uint64_t units = apg_duration_units(e, bank->format);
+    memset(plan, 0, sizeof(*plan)); /* skipped descriptors */
+    plan->units = units;
+    if (units == 0 || e->cfg->sequence_enabled || bank->loop_count == 0) {
+        return;
+    }
+
+    uint64_t pass = 0;
+    for (size_t i = 0; i < bank->loop_count; i++) {
+        const uint64_t whole = apg_sat_mul(apg_loop_units(&bank->loops[i], bank->format), bank->loops[i].repeat);
+        pass = (whole > UINT64_MAX - pass) ? UINT64_MAX : pass + whole;
+    }
+    if (pass == 0) {
+        return;
+    }
+    const uint64_t passes = units / pass;
+    uint64_t rest = units % pass;
+
+    /* Loops played whole after the passes */
+    size_t k = 0;
+    uint64_t len = 0;
+    for (; k < bank->loop_count; k++) {
+        len = apg_loop_units(&bank->loops[k], bank->format);
+        const uint64_t whole = apg_sat_mul(len, bank->loops[k].repeat);
+        if (rest < whole) {
+            break;
+        }
+        rest -= whole;
+    }
+
+    uint64_t repeat = 0;
+    if (k < bank->loop_count) {
+        /* The loop the end falls into: whole repeats, then points, then the shortened point */
+        const apg_loop_t *loop = &bank->loops[k];
+        const size_t words = apg_point_words(bank->format);
+        repeat = rest / len;
+        rest -= repeat * len;
+        uint32_t count = 0;
+        while (rest >= apg_point_units(&loop->data[count], bank->format)) {
+            rest -= apg_point_units(&loop->data[count], bank->format);
+            count += words;
+        }
+        plan->tail[0] = (apg_loop_t){.repeat = (uint32_t)repeat, .count = loop->count, .data = loop->data};
+        plan->tail[1] = (apg_loop_t){.repeat = 1u, .count = count, .data = loop->data};
+
+        const uint32_t *point = &loop->data[count];
+        if (bank->format == FORMAT_WIDE && rest >= APG_TICK_OVERHEAD) {
+            plan->point[0] = point[0];
+            plan->point[1] = (uint32_t)rest - APG_TICK_OVERHEAD;
+            plan->tail[2] = (apg_loop_t){.repeat = 1u, .count = 2u};
+        } else if (bank->format == FORMAT_PACKED && rest > APG_TICK_OVERHEAD) {
+            plan->point[0] = (point[0] & APG_PACKED_MAX_VALUE) | (((uint32_t)rest - APG_TICK_OVERHEAD) << APG_PACKED_TICKS_SHIFT);
+            plan->tail[2] = (apg_loop_t){.repeat = 1u, .count = 1u};
+        }
+    }
+
+    if (bank->loop_count == 1) {
+        /* The sequencer repeats the loop (burst_loop), the tail only adds the last pass */
+        repeat = apg_sat_mul(passes, bank->loops[0].repeat) + repeat;
+        if (repeat > UINT32_MAX) {
+            return;
+        }
+        plan->repeat = (uint32_t)repeat;
+        plan->tail[0].repeat = 0;
+        plan->words = sizeof(apg_loop_t) / sizeof(uint32_t);
+    } else {
+        /* The sequencer DMA wraps around the padded loop table (as in NCYCLES mode), then reads the first k loops */
+        const uint64_t table_words = (1u << apg_loop_ring_bits(bank->loop_count)) / sizeof(uint32_t);
+        const uint64_t words = apg_sat_mul(passes, table_words) + k * (sizeof(apg_loop_t) / sizeof(uint32_t));
+        if (words > DMA_CH0_TRANS_COUNT_COUNT_BITS) {
+            return;
+        }
+        plan->words = (uint32_t)words;
+    }
+    plan->exact = true;
+}
+
+/**
+ * Plan the DURATION bursts of the active banks again for the current burst length and sample rate
+ * (trigger_update_config, apg_set_sample_rate). The plan is made without the lock, from points that do
+ * not change while the bank is active, and stored under it unless a commit replaced the bank meanwhile.
+ */
+void apg_duration_update(void) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        if (!e->initialized) {
+            continue;
+        }
+
+        apg_bank_t *bank = e->active_bank;
+        apg_dur_plan_t plan;
+        apg_duration_plan(e, bank, &plan);
+
+        CS_ENTER();
+        if (e->active_bank == bank) {
+            bank->dur = plan;
+        }
+        CS_EXIT();
+    }
 }
 
 static int64_t __not_in_flash_func(burst_duration_alarm_cb)(alarm_id_t id, void *user_data) {
     (void)id;
-    (void)user_data;
-    s_burst_duration_alarm = -1;
-    apg_abort();
+    apg_engine_t *e = user_data;
+    e->burst_duration_alarm = -1;
+    apg_engine_abort(e);
     return 0; /* one-shot */
 }
 
 /**
- * Note: may be called before module is fully initialized
+ * Set up DMA and the sequencer of an engine for a new run, leaving its main SM disabled.
+ * Returns true if the main SM has to be enabled to start the run.
+ * Must be called with the critical section held. Note: may be called before module is fully initialized
  */
-__attribute__((flatten))
-void __not_in_flash_func(apg_trigger_start)(void) {
-    if (!s_initialized || !g_apg_is_enabled || g_apg_data_count == 0) {
-        return;
+static bool __not_in_flash_func(apg_engine_prepare_run)(apg_engine_t *e) {
+    if (!e->initialized || !e->cfg->is_enabled) {
+        return false;
+    }
+    if (!e->cfg->stream_enabled && e->active_bank->points == 0) {
+        return false;
     }
 
-    // no retriggering until the current cycle is done
-    if (!apg_is_idle()) {
-        return;
+    /*
+     * No retriggering until the current cycle is done, but it releases a sequence segment waiting for a trigger.
+     * A wait before the first descriptor shows the idle point, so the sequencer itself is checked as well.
+     * An engine started by a hardware trigger sees the software dispatch of that trigger as well (EXT: the
+     * same edge, a few microseconds later; INT: the next software timer tick), which releases nothing.
+     */
+    if (!apg_is_idle(e) || apg_seq_waiting(e)) {
+        if (e->cfg->sequence_enabled && !e->trig_dispatch) {
+            e->pio->irq_force = 1u << APG_SEQ_TRIGGER_IRQ;
+        }
+        e->trig_dispatch = false;
+        return false;
     }
 
-    CS_ENTER();
+    /* Read the active bank under the lock, so a concurrent commit cannot recycle it (see apg_shadow_ready) */
+    const apg_bank_t *active = e->active_bank;
+
+    if (e->cfg->stream_enabled) {
+        /* Streaming ignores the burst settings, it plays until the ring runs empty */
+        if (e->stream_running) {
+            return false;
+        }
+        apg_stream_start(e);
+        return true;
+    }
 
-    // Prepare burst duration alarm if needed.
-    if (g_trigger_config.burst_type == BURST_MODE_DURATION) {
-        if (s_burst_duration_alarm != -1) {
+    /* A DURATION burst is ended by the sequencer where possible (not from a DMA read ring), else by the alarm */
+    const bool duration = g_trigger_config.burst_type == BURST_MODE_DURATION;
+    const bool exact = duration && !apg_ring_playable(e, active) && active->dur.exact && active->dur.units == apg_duration_units(e, active->format);
+    e->burst_exact = exact;
+
+    // Prepare burst duration alarm if needed (when armed: added when the trigger arrives, see apg_trigger_service)
+    if (duration && !exact && !apg_hw_trigger(e)) {
+        if (e->burst_duration_alarm != -1) {
             /* already running with a burst duration, ignore retrigger */
-            return;
-        } else if (s_burst_duration_alarm != -1) {
-            /* shouldn't happen that we have an active burst duration alarm when not running, but cancel just in case */
-            alarm_pool_cancel_alarm(g_trigger_config.alarm_pool, s_burst_duration_alarm);
+            return false;
         }
-        s_burst_duration_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.burst_duration_sec * 1e6f, burst_duration_alarm_cb, NULL, false);
+        e->burst_duration_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.burst_duration_us, burst_duration_alarm_cb, e, false);
     }
 
-    pio_sm_set_enabled(s_pio, (uint)s_sm, false);
-    // safely abort DMAs (See RP2040-E13 / RP2350-E5)
-    hw_clear_bits(&dma_hw->ch[s_dma_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    hw_clear_bits(&dma_hw->ch[s_dma_ctrl_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    dma_channel_abort((uint)s_dma_chan);
-    dma_channel_abort((uint)s_dma_ctrl_chan);
-    hw_set_bits(&dma_hw->ch[s_dma_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    hw_set_bits(&dma_hw->ch[s_dma_ctrl_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    pio_sm_set_enabled(e->pio, (uint)e->sm, false);
+    apg_dma_abort(e);
+
+    const bool gapless = !exact && e->cfg->gapless && g_trigger_config.burst_type != BURST_MODE_NCYCLES && active->loop_count == 1;
+    e->gapless_running = gapless;
+#ifdef APG_DMA_ENDLESS_COUNT
+    if (gapless) {
+        const apg_loop_t *loop = &active->loops[0];
+        const uint ring_bits = apg_ring_bits(loop->count);
+        if (apg_ring_playable(e, active)) {
+            /* The data DMA reads the pattern from a read ring forever, the wrap costs nothing at all */
+            dma_channel_config ring_cfg = e->dma_data_cfg;
+            channel_config_set_ring(&ring_cfg, false, ring_bits);
+            channel_config_set_chain_to(&ring_cfg, (uint)e->dma_chan); // no chaining
+            pio_sm_set_enabled(e->pio, (uint)e->seq_sm, false);
+            dma_channel_configure((uint)e->dma_chan, &ring_cfg,
+                                  &e->pio->txf[e->sm],
+                                  loop->data,
+                                  APG_DMA_ENDLESS_COUNT,
+                                  true); // waits for the main SM
+            apg_sm_select(e, active->format);
+            return true;
+        }
+    }
+#endif
+
+    dma_channel_set_config((uint)e->dma_chan, &e->dma_data_cfg, false); // streaming may have changed it
+
+    /* Restart the sequencer SM */
+    pio_sm_set_enabled(e->pio, (uint)e->seq_sm, false);
+    pio_sm_restart(e->pio, (uint)e->seq_sm);
+    pio_sm_clear_fifos(e->pio, (uint)e->seq_sm);
+    pio_sm_exec(e->pio, (uint)e->seq_sm, pio_encode_jmp((uint)e->seq_prog_offset));
+    e->pio->irq = 1u << APG_SEQ_TRIGGER_IRQ; /* the starting trigger does not release a wait */
+    pio_sm_set_enabled(e->pio, (uint)e->seq_sm, true);
+
+    /* configure ctrl DMA */
+    /* Reads (trans_count, read_addr) sequence from sequencer SM and writes to data DMA with trigger. */
+    dma_channel_configure((uint)e->dma_ctrl_chan, &e->dma_ctrl_seq_cfg,
+                          &dma_channel_hw_addr((uint)e->dma_chan)->al3_transfer_count,
+                          &e->pio->rxf[e->seq_sm],
+                          2,
+                          true); // waits for the sequencer
+
+    dma_channel_config seq_cfg = e->dma_seq_cfg;
+    const void *loops = active->entry.addr;
+    uint32_t words = active->entry.count;
 
     if (g_trigger_config.burst_type == BURST_MODE_NCYCLES) {
-        /* NCYCLES mode, prepare PIO burst SM*/
-        pio_sm_set_enabled(s_pio, (uint)s_burst_sm, false);
-        pio_sm_restart(s_pio, (uint)s_burst_sm);
-        pio_sm_clear_fifos(s_pio, (uint)s_burst_sm);
-        pio_sm_exec(s_pio, (uint)s_burst_sm, pio_encode_jmp((uint)s_burst_prog_offset));
-
-        // Enable burst SM
-        pio_sm_set_enabled(s_pio, (uint)s_burst_sm, true);
-        // Load N cycle count into burst SM
-        pio_sm_put(s_pio, (uint)s_burst_sm, g_trigger_config.burst_ncycles - 1); // -1, because SM uses "do.. while (x--)" loop
-        // Load data transfer count
-        pio_sm_put(s_pio, (uint)s_burst_sm, g_apg_data_count * 2u); // value+ticks data pairs
-        // Load data read address
-        pio_sm_put(s_pio, (uint)s_burst_sm, (uint32_t)&s_data[0]);
-        // Load idle point transfer count
-        pio_sm_put(s_pio, (uint)s_burst_sm, 2u); // value+tick for idle point
-        // Load idle point read address
-        pio_sm_put(s_pio, (uint)s_burst_sm, (uint32_t)&s_idle_point);
-
-        /* configure ctrl DMA for burst */
-        /* Reads (trans_count, read_addr) sequence from burst SM and writes to data DMA with trigger. */
-        dma_channel_configure((uint)s_dma_ctrl_chan, &s_dma_ctrl_burst_cfg,
-                              &dma_channel_hw_addr((uint)s_dma_chan)->al3_transfer_count,
-                              &s_pio->rxf[s_burst_sm],
-                              2,
-                              true); // let's go!
+        const uint32_t ncycles = g_trigger_config.burst_ncycles;
+        if (active->loop_count == 1 && active->loops[0].repeat <= UINT32_MAX / ncycles) {
+            /* Single loop: the sequencer repeats it n-times */
+            e->burst_loop = active->loops[0];
+            e->burst_loop.repeat *= ncycles;
+            loops = &e->burst_loop;
+        } else {
+            /* Wrap around the loop table n-times; the table is padded to a power of two with skipped descriptors */
+            const uint ring_bits = apg_loop_ring_bits(active->loop_count);
+            const uint32_t table_words = (1u << ring_bits) / sizeof(uint32_t);
+            const uint32_t max_cycles = DMA_CH0_TRANS_COUNT_COUNT_BITS / table_words;
+            channel_config_set_ring(&seq_cfg, false, ring_bits);
+            words = table_words * (ncycles < max_cycles ? ncycles : max_cycles);
+        }
 
+        /* reload DMA appends the idle loop when done */
+        dma_channel_configure((uint)e->dma_reload_chan, &e->dma_reload_tail_cfg,
+                              &e->pio->txf[e->seq_sm],
+                              (active->format == FORMAT_PACKED)    ? &e->idle_packed_loop
+                              : (active->format == FORMAT_SAMPLED) ? &e->idle_sample_loop
+                                                                   : &e->idle_loop,
+                              sizeof(apg_loop_t) / sizeof(uint32_t),
+                              false);
+    } else if (exact) {
+        /* DURATION: whole passes and loops (as in NCYCLES mode), then the reload DMA appends the planned tail */
+        memcpy(e->dur_tail, active->dur.tail, sizeof(active->dur.tail));
+        memcpy(e->dur_point, active->dur.point, sizeof(e->dur_point));
+        e->dur_tail[2].data = e->dur_point;
+        e->dur_tail[3] = (active->format == FORMAT_PACKED)    ? e->idle_packed_loop
+                         : (active->format == FORMAT_SAMPLED) ? e->idle_sample_loop
+                                                              : e->idle_loop;
+        if (active->loop_count == 1) {
+            e->burst_loop = active->loops[0];
+            e->burst_loop.repeat = active->dur.repeat; /* 0 is skipped */
+            loops = &e->burst_loop;
+            words = sizeof(apg_loop_t) / sizeof(uint32_t);
+        } else if (active->dur.words > 0) {
+            channel_config_set_ring(&seq_cfg, false, apg_loop_ring_bits(active->loop_count));
+            words = active->dur.words;
+        } else {
+            /* Ends within the first loop: the tail alone, no reload */
+            loops = e->dur_tail;
+            words = count_of(e->dur_tail) * (sizeof(apg_loop_t) / sizeof(uint32_t));
+            channel_config_set_chain_to(&seq_cfg, (uint)e->dma_seq_chan);
+        }
+        dma_channel_configure((uint)e->dma_reload_chan, &e->dma_reload_tail_cfg,
+                              &e->pio->txf[e->seq_sm],
+                              e->dur_tail,
+                              count_of(e->dur_tail) * (sizeof(apg_loop_t) / sizeof(uint32_t)),
+                              false);
     } else {
-        /* Set trans_count, as only read_addr gets refreshed by control DMA */
-        dma_channel_set_transfer_count((uint)s_dma_chan, g_apg_data_count * 2u, false); // value+duration pairs
-        /* Configure control DMA for continuous mode /*
-        /* Only writes read_addr to data DMA with trigger */
-        dma_channel_configure((uint)s_dma_ctrl_chan, &s_dma_ctrl_cont_cfg,
-                              &dma_channel_hw_addr((uint)s_dma_chan)->al3_read_addr_trig,
-                              &s_data_ptr,
+        if (gapless) {
+            /* The sequencer repeats the pattern instead of the loop table being reloaded at every wrap */
+            e->burst_loop = active->loops[0];
+            e->burst_loop.repeat = UINT32_MAX;
+            loops = &e->burst_loop;
+            words = sizeof(apg_loop_t) / sizeof(uint32_t);
+        }
+
+        /* reload DMA restarts from the (possibly swapped) active bank when done, through the loader DMA */
+        dma_channel_configure((uint)e->dma_reload_chan, &e->dma_reload_cont_cfg,
+                              &dma_channel_hw_addr((uint)e->dma_loader_chan)->al3_read_addr_trig,
+                              &e->active_bank,
                               1,
-                              true); // let's go!
+                              false);
+    }
+
+    /* Feed the loop table into the sequencer SM */
+    dma_channel_configure((uint)e->dma_seq_chan, &seq_cfg,
+                          &e->pio->txf[e->seq_sm],
+                          loops,
+                          words,
+                          true); // let's go!
+
+    /* The data DMA waits for the main SM, which the caller enables */
+    apg_sm_select(e, active->format);
+    return true;
+}
+
+/* Load the apg_trig program into the engine's PIO block, unless done already. Returns false if there is no room. */
+static bool apg_trig_load(apg_engine_t *e) {
+    if (e->trig_prog_offset >= 0) {
+        return true;
+    }
+    if ((g_trigger_config.source == TRG_SOURCE_EXT && g_trigger_config.ext_gpio < 0) || !pio_can_add_program(e->pio, &apg_trig_program)) {
+        return false;
     }
+    e->trig_prog_offset = pio_add_program(e->pio, &apg_trig_program);
+    return true;
+}
 
-    // Enable main SM
-    pio_sm_set_enabled(s_pio, (uint)s_sm, true);
+/* INT timer periods that have ended since the timers were started */
+static __force_inline int64_t apg_int_period_now(void) {
+    return (int64_t)(((time_us_64() - s_int_start_us) * s_int_khz) / (s_int_cycles * 1000u));
+}
 
+/*
+ * Point the disabled main SM at the apg_trig program, patched for the trigger (GPIO and condition, or the
+ * timer IRQ flag) and to continue at the entry point of the selected format. Enabling the SM arms it.
+ * The trigger delay is counted down in X and Y in between: X + Y * (2^32 + 1) cycles, as each pass of
+ * the inner loop leaves X wrapped around to 2^32 - 1.
+ */
+static void __not_in_flash_func(apg_trig_arm)(apg_engine_t *e) {
+    const uint offset = (uint)e->trig_prog_offset;
+    io_rw_32 *instr = &e->pio->instr_mem[offset];
+    uint i = 0;
+
+    if (g_trigger_config.source == TRG_SOURCE_INT) {
+        instr[i++] = pio_encode_wait_irq(true, false, APG_INT_TRIGGER_IRQ); /* clears the flag */
+        /*
+         * A period that ended during the last burst (or before the re-arm) does not count: the flag tells if one
+         * did, the timer how many since the one that started the burst (on the microsecond timer, at least one)
+         */
+        const int64_t period = apg_int_period_now();
+        if (e->int_period >= 0 && (e->pio->irq & (1u << APG_INT_TRIGGER_IRQ)) != 0) {
+            const int64_t missed = period - e->int_period - 1;
+            s_int_missed += (missed > 1) ? (uint32_t)missed : 1u;
+        }
+        e->pio->irq = 1u << APG_INT_TRIGGER_IRQ;
+        e->int_period = period;
+    } else {
+        const uint gpio = (uint)g_trigger_config.ext_gpio;
+        const bool active_high = g_trigger_config.ext_condition == EXT_CONDITION_RISING || g_trigger_config.ext_condition == EXT_CONDITION_HIGH;
+        const bool edge = g_trigger_config.ext_condition == EXT_CONDITION_RISING || g_trigger_config.ext_condition == EXT_CONDITION_FALLING;
+        instr[i++] = pio_encode_wait_gpio(edge ? !active_high : active_high, gpio);
+        instr[i++] = pio_encode_wait_gpio(active_high, gpio);
+    }
+    const uint delay = offset + i;
+    instr[i++] = pio_encode_jmp_x_dec(delay);
+    instr[i++] = pio_encode_jmp_y_dec(delay);
+    instr[i++] = pio_encode_jmp((uint)e->prog_offset + apg_sm_entry(e->sm_format));
+    while (i < apg_trig_program.length) {
+        instr[i++] = pio_encode_jmp((uint)e->prog_offset + apg_sm_entry(e->sm_format)); /* unused (INT) */
+    }
+
+    const uint64_t cycles = g_trigger_config.delay_cycles;
+    const uint64_t outer = cycles / ((uint64_t)UINT32_MAX + 2u);
+    const uint64_t inner = cycles - outer * ((uint64_t)UINT32_MAX + 2u); /* up to 2^32, loaded one cycle short */
+    apg_sm_load(e->pio, (uint)e->sm, pio_y, (uint32_t)outer);
+    apg_sm_load(e->pio, (uint)e->sm, pio_x, (inner > UINT32_MAX) ? UINT32_MAX : (uint32_t)inner);
+    pio_sm_exec(e->pio, (uint)e->sm, pio_encode_jmp(offset));
+    e->trig_armed = true;
+    e->trig_dispatch = true;
+}
+
+/* Whether the armed main SM still waits for the trigger itself (not counting down the delay or running) */
+static __force_inline bool apg_trig_waiting(const apg_engine_t *e) {
+    const uint waits = (g_trigger_config.source == TRG_SOURCE_INT) ? 1u : 2u; /* see apg_trig_arm */
+    const uint pc = pio_sm_get_pc(e->pio, (uint)e->sm);
+    return pc >= (uint)e->trig_prog_offset && pc < (uint)e->trig_prog_offset + waits;
+}
+
+/*
+ * Prepare an engine for a new run (apg_engine_prepare_run); with a hardware trigger, armed to start by
+ * itself. Returns true if the main SM has to be enabled. Must be called with the critical section held.
+ */
+static bool __not_in_flash_func(apg_engine_prepare)(apg_engine_t *e) {
+    const bool hw = apg_hw_trigger(e);
+
+    if (e->trig_armed) {
+        if (!apg_trig_waiting(e)) {
+            e->trig_dispatch = false; /* dispatch of the trigger it has just started on */
+        }
+        return false;
+    }
+    if (hw && e->initialized && !apg_trig_load(e)) {
+        return false;
+    }
+    if (!apg_engine_prepare_run(e)) {
+        return false;
+    }
+    if (hw) {
+        apg_trig_arm(e);
+    }
+    return true;
+}
+
+/* Enable SMs of several PIO blocks (mask per block) in the same cycle, their clock dividers restarted */
+static __force_inline void apg_enable_in_sync(const uint32_t masks[NUM_PIOS]) {
+#if PICO_PIO_VERSION > 0
+    /* Enable the SMs of the previous (pio0) and next (pio2) PIO block through pio1 */
+    pio_enable_sm_multi_mask_in_sync(pio1, masks[0], masks[1], (NUM_PIOS > 2) ? masks[NUM_PIOS - 1] : 0);
+#else
+    for (uint i = 0; i < NUM_PIOS; i++) {
+        if (masks[i]) {
+            pio_enable_sm_mask_in_sync(pio_get_instance(i), masks[i]);
+        }
+    }
+#endif
+}
+
+#if PICO_PIO_VERSION > 0
+/* The PIO1 CTRL bits pio_enable_sm_multi_mask_in_sync() sets, for apg_trigger_start to write itself */
+static __force_inline uint32_t apg_sync_ctrl_bits(const uint32_t masks[NUM_PIOS]) {
+    const uint32_t next = (NUM_PIOS > 2) ? masks[NUM_PIOS - 1] : 0;
+    return ((masks[1] << PIO_CTRL_SM_ENABLE_LSB) & PIO_CTRL_SM_ENABLE_BITS) |
+           ((masks[1] << PIO_CTRL_CLKDIV_RESTART_LSB) & PIO_CTRL_CLKDIV_RESTART_BITS) |
+           ((masks[0] << PIO_CTRL_PREV_PIO_MASK_LSB) & PIO_CTRL_PREV_PIO_MASK_BITS) |
+           ((next << PIO_CTRL_NEXT_PIO_MASK_LSB) & PIO_CTRL_NEXT_PIO_MASK_BITS) |
+           PIO_CTRL_NEXTPREV_SM_ENABLE_BITS | PIO_CTRL_NEXTPREV_CLKDIV_RESTART_BITS;
+}
+#endif
+
+/* Start a single engine, e.g. after a restart on a new pattern. */
+static void __not_in_flash_func(apg_engine_start)(apg_engine_t *e) {
+    CS_ENTER();
+    if (apg_engine_prepare(e)) {
+        pio_sm_set_enabled(e->pio, (uint)e->sm, true);
+    }
     CS_EXIT();
 }
 
 /**
- * Abort APG generation immediately and switch to idle state.
- * Stops DMA, resets PIO sm and sets idle state output.
+ * Start all enabled engines that are idle, and the PWM slices in pwm_slices (0 for none, see pwm_trigger_arm).
+ * The engines are prepared first (DMA running, SM at its entry point). Their main SMs are then enabled (and
+ * their clock dividers restarted) with one register write, so the engines start on the same system clock
+ * cycle. The PWM slices are enabled by the store right before it, with interrupts still off: the same two
+ * instructions every time, so PWM leads the APG by 1 to 3 cycles (see the top of this file). Returns true
+ * if an engine was started.
+ * Note: may be called before module is fully initialized
  */
 __attribute__((flatten))
-void __not_in_flash_func(apg_abort)(void) {
-    if (!s_initialized) {
-        return;
+bool __not_in_flash_func(apg_trigger_start)(uint32_t pwm_slices) {
+    uint32_t masks[NUM_PIOS] = {0};
+    bool start = false;
+
+    CS_ENTER();
+
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        if (apg_engine_prepare(e)) {
+            masks[pio_get_index(e->pio)] |= 1u << e->sm;
+            start = true;
+        } else if (g_trigger_config.source == TRG_SOURCE_INT && e->initialized && e->cfg->is_enabled && !apg_hw_trigger(e)) {
+            s_int_missed++; /* on the software timer and still playing its burst */
+        }
     }
 
-    PWM_IRQ_DEBUG_SET(1);
+#if PICO_PIO_VERSION > 0
+    if (pwm_slices != 0 && start) {
+        /* pwm_set_mask_enabled() and apg_enable_in_sync() as two consecutive stores, whatever the compiler schedules */
+        const uint32_t ctrl = apg_sync_ctrl_bits(masks);
+        __asm volatile("str %0, [%1]\n\tstr %2, [%3]"
+                       :
+                       : "r"(pwm_slices), "r"(&pwm_hw->en), "r"(ctrl), "r"(hw_set_alias(&pio1->ctrl))
+                       : "memory");
+        CS_EXIT();
+        return true;
+    }
+#endif
+    if (pwm_slices != 0) {
+        pwm_set_mask_enabled(pwm_slices);
+    }
+    if (start) {
+        apg_enable_in_sync(masks);
+    }
+
+    CS_EXIT();
+    return start;
+}
+
+/**
+ * Internal trigger in hardware: while the trigger source is INT, a spare SM of each engine's PIO block runs
+ * the apg_timer program, which sets APG_INT_TRIGGER_IRQ every interval counted in system clock cycles, and
+ * the armed main SMs wait for it. The timers are restarted together whenever the interval changes, so the
+ * engines see the same ticks. An engine without a free SM or program space is left to the software timer
+ * (trigger.c). Called by trigger_update_config().
+ */
+void apg_int_timer_update(void) {
+    uint32_t masks[NUM_PIOS] = {0};
+    bool start = false;
+
+    /*
+     * Period in system clock cycles (the double keeps the picoseconds times the clock exact to far below a cycle).
+     * The SM clock divider takes what does not fit 32 bits: such a period is counted in units of div cycles,
+     * rounded to the nearest, so it is off by up to div/2 cycles (one cycle over the whole range at 150 MHz).
+     */
+    const uint64_t cycles = (uint64_t)llround((double)g_trigger_config.interval_ps * (double)clock_get_hz(clk_sys) / 1e12);
+    const uint64_t max_units = (uint64_t)UINT32_MAX + APG_TIMER_OVERHEAD;
+    const uint64_t div = cycles / max_units + 1u;
+    const uint64_t units = (cycles + div / 2u) / div; /* cycles < div * max_units, so at most max_units */
+    const uint32_t count = (uint32_t)(units - APG_TIMER_OVERHEAD);
+
+    CS_ENTER();
+
+    s_int_missed = 0;
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        if (!e->initialized) {
+            continue;
+        }
+
+        e->int_period = -1;
+        if (e->timer_sm >= 0) {
+            pio_sm_set_enabled(e->pio, (uint)e->timer_sm, false);
+        }
+        if (g_trigger_config.source != TRG_SOURCE_INT) {
+            if (e->timer_sm >= 0) {
+                pio_remove_program(e->pio, &apg_timer_program, (uint)e->timer_prog_offset);
+                pio_sm_unclaim(e->pio, (uint)e->timer_sm);
+                e->timer_sm = e->timer_prog_offset = -1;
+            }
+            continue;
+        }
+
+        if (e->timer_sm < 0) {
+            const int sm = pio_claim_unused_sm(e->pio, false);
+            if (sm < 0) {
+                continue;
+            }
+            if (!pio_can_add_program(e->pio, &apg_timer_program)) {
+                pio_sm_unclaim(e->pio, (uint)sm);
+                continue;
+            }
+            e->timer_prog_offset = pio_add_program(e->pio, &apg_timer_program);
+            e->timer_sm = sm;
+        }
+
+        pio_sm_config c = apg_timer_program_get_default_config((uint)e->timer_prog_offset);
+        sm_config_set_clkdiv_int_frac8(&c, (uint32_t)div, 0);
+        pio_sm_init(e->pio, (uint)e->timer_sm, (uint)e->timer_prog_offset, &c);
+        apg_sm_load(e->pio, (uint)e->timer_sm, pio_y, count);
+        e->pio->irq = 1u << APG_INT_TRIGGER_IRQ;
+        masks[pio_get_index(e->pio)] |= 1u << e->timer_sm;
+        start = true;
+    }
+
+    if (start) {
+        apg_enable_in_sync(masks);
+        s_int_start_us = time_us_64();
+        s_int_cycles = units * div; /* as counted */
+        s_int_khz = clock_get_hz(clk_sys) / 1000u;
+    }
+
+    CS_EXIT();
+}
+
+/* INT periods the enabled engines did not start on since the timers were started (see apg_trig_arm) */
+uint32_t apg_int_missed(void) {
+    return s_int_missed;
+}
+
+/* Whether an enabled engine has no hardware timer and is started by the software INT timer (trigger.c) */
+bool apg_int_software(void) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        const apg_engine_t *e = &s_engines[n];
+        if (e->initialized && e->cfg->is_enabled && e->timer_sm < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Follow the engines armed for a hardware trigger, called from the core1 main loop.
+ * An engine whose main SM has left the apg_trig program was triggered: its burst duration starts now, and
+ * the start goes into the trigger statistics with its fixed latency (see apg.pio), once for the engines
+ * found started in the same pass (they start in the same cycle).
+ * One that is idle again after its burst (or was disarmed by an idle point update) is armed again.
+ * With the trigger source IMM, a DURATION burst ended by the sequencer is started again the same way.
+ */
+void __not_in_flash_func(apg_trigger_service)(void) {
+    bool started = false;
+
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        const bool hw = e->trig_prog_offset >= 0 && apg_hw_trigger(e);
+        const bool imm = g_trigger_config.source == TRG_SOURCE_IMM && e->burst_exact;
+        if (!e->initialized || !e->cfg->is_enabled || !(hw || imm)) {
+            continue;
+        }
+
+        CS_ENTER();
+        if (e->trig_armed) {
+            const uint pc = pio_sm_get_pc(e->pio, (uint)e->sm);
+            if (pc < (uint)e->trig_prog_offset || pc >= (uint)e->trig_prog_offset + apg_trig_program.length) {
+                e->trig_armed = false;
+                started = true;
+                if (g_trigger_config.burst_type == BURST_MODE_DURATION && !e->cfg->stream_enabled && !e->burst_exact && e->burst_duration_alarm == -1) {
+                    e->burst_duration_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.burst_duration_us, burst_duration_alarm_cb, e, false);
+                }
+            }
+        } else if (!e->stream_running && apg_is_idle(e) && !apg_seq_waiting(e) && !dma_channel_is_busy((uint)e->dma_chan) &&
+                   !dma_channel_is_busy((uint)e->dma_reload_chan) && apg_engine_prepare(e)) {
+            pio_sm_set_enabled(e->pio, (uint)e->sm, true);
+        }
+        CS_EXIT();
+    }
+
+    if (started && g_trigger_config.source != TRG_SOURCE_IMM) {
+        const uint32_t cycles = (g_trigger_config.source == TRG_SOURCE_EXT) ? APG_TRIG_EXT_LATENCY : APG_TRIG_INT_LATENCY;
+        const uint32_t hz = clock_get_hz(clk_sys);
+        trigger_stats_record_fixed(g_trigger_config.source, (uint32_t)(((uint64_t)cycles * 1000000u + hz / 2u) / hz));
+    }
+}
+
+/**
+ * Trigger delay changed: arm the engines that are still waiting for the trigger again, with the new delay
+ * in X and Y. Their DMA and data are left as they are. An engine counting down the delay or playing its
+ * burst keeps the old one; it takes the new delay with its next arm (apg_trigger_service).
+ * Runs on core1 with apg_trigger_service, so no arm of the main loop interleaves and the main SM is stopped
+ * only for the few cycles the re-arm takes; an EXT edge in them is missed, an INT tick counted as missed.
+ */
+static int apg_trigger_rearm_core1(void *arg) {
+    (void)arg;
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+
+        CS_ENTER();
+        if (e->initialized && e->trig_armed && apg_hw_trigger(e)) {
+            pio_sm_set_enabled(e->pio, (uint)e->sm, false);
+            if (apg_trig_waiting(e)) {
+                apg_trig_arm(e);
+            }
+            pio_sm_set_enabled(e->pio, (uint)e->sm, true);
+        }
+        CS_EXIT();
+    }
+    return 0;
+}
+
+void apg_trigger_rearm(void) {
+    (void)core1_call(apg_trigger_rearm_core1, NULL);
+}
+
+/* Stop an engine and output its idle point. */
+static void __not_in_flash_func(apg_engine_stop)(apg_engine_t *e) {
+    if (!e->initialized) {
+        return;
+    }
 
     CS_ENTER();
 
     /* Cancel burst duration alarm if active */
-    if (s_burst_duration_alarm != -1) {
-        alarm_pool_cancel_alarm(g_trigger_config.alarm_pool, s_burst_duration_alarm);
-        s_burst_duration_alarm = -1;
+    if (e->burst_duration_alarm != -1) {
+        alarm_pool_cancel_alarm(g_trigger_config.alarm_pool, e->burst_duration_alarm);
+        e->burst_duration_alarm = -1;
     }
 
     /* stop PIO state machines */
-    pio_sm_set_enabled(s_pio, (uint)s_sm, false);
-    pio_sm_set_enabled(s_pio, (uint)s_burst_sm, false);
+    pio_sm_set_enabled(e->pio, (uint)e->sm, false);
+    pio_sm_set_enabled(e->pio, (uint)e->seq_sm, false);
+    e->trig_armed = false;
+    e->trig_dispatch = false;
+    e->int_period = -1;
+    e->burst_exact = false;
+    if (e->trig_prog_offset >= 0 && !apg_hw_trigger(e)) {
+        pio_remove_program(e->pio, &apg_trig_program, (uint)e->trig_prog_offset);
+        e->trig_prog_offset = -1;
+    }
+
+    apg_dma_abort(e);
 
-    // safely abort DMAs (See RP2040-E13 / RP2350-E5)
-    hw_clear_bits(&dma_hw->ch[s_dma_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    hw_clear_bits(&dma_hw->ch[s_dma_ctrl_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    dma_channel_abort((uint)s_dma_chan);
-    dma_channel_abort((uint)s_dma_ctrl_chan);
-    hw_set_bits(&dma_hw->ch[s_dma_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
-    hw_set_bits(&dma_hw->ch[s_dma_ctrl_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    e->gapless_running = false;
+
+    /* Stop streaming and drop queued records */
+    e->stream_running = false;
+    e->stream_armed = false;
+    e->stream_cur_end = e->stream_wr;
+    e->stream_rd = e->stream_cur_end;
+    apg_gen_begin(&e->cfg->gen, &e->gen); /* a generated stream starts over at the seed */
 
     /* Reset state machines */
-    pio_sm_clear_fifos(s_pio, (uint)s_sm);
-    pio_sm_restart(s_pio, (uint)s_sm);
-    pio_sm_clear_fifos(s_pio, (uint)s_burst_sm);
-    pio_sm_restart(s_pio, (uint)s_burst_sm);
-    // Execute jumping to the start of the program to ensure we are at `out pins`
-    pio_sm_exec(s_pio, (uint)s_sm, pio_encode_jmp((uint)s_prog_offset));
-    pio_sm_set_enabled(s_pio, (uint)s_sm, true);
+    pio_sm_clear_fifos(e->pio, (uint)e->sm);
+    pio_sm_restart(e->pio, (uint)e->sm);
+    pio_sm_clear_fifos(e->pio, (uint)e->seq_sm);
+    pio_sm_restart(e->pio, (uint)e->seq_sm);
+    // Jump to the wide entry point to ensure we are at `out pins`
+    apg_sm_select(e, FORMAT_WIDE);
+    pio_sm_set_enabled(e->pio, (uint)e->sm, true);
     // Push the idle value and a duration of 0 (so it output once and then stalls)
-    pio_sm_put(s_pio, (uint)s_sm, s_idle_point.value); // Idle point value
-    pio_sm_put(s_pio, (uint)s_sm, s_idle_point.ticks); // idle point ticks
+    pio_sm_put(e->pio, (uint)e->sm, e->idle_point.value); // Idle point value
+    pio_sm_put(e->pio, (uint)e->sm, e->idle_point.ticks); // idle point ticks
 
     CS_EXIT();
+}
+
+/* Abort a single engine, retrigger it if Immediate mode, arm it again for a hardware trigger */
+static void __not_in_flash_func(apg_engine_abort)(apg_engine_t *e) {
+    apg_engine_stop(e);
+
+    if (e->initialized && e->cfg->is_enabled && (g_trigger_config.source == TRG_SOURCE_IMM || apg_hw_trigger(e))) {
+        apg_engine_start(e);
+    }
+}
+
+/**
+ * Abort APG generation of all engines immediately and switch to idle state.
+ * Stops DMA, resets PIO sm and sets idle state output.
+ */
+__attribute__((flatten))
+void __not_in_flash_func(apg_abort)(void) {
+    PWM_IRQ_DEBUG_SET(1);
 
-    /* retrigger if Immediate mode */
-    if (g_apg_is_enabled && g_trigger_config.source == TRG_SOURCE_IMM) {
-        apg_trigger_start();
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_stop(&s_engines[n]);
+    }
+
+    /* retrigger if Immediate mode, arm again for a hardware trigger */
+    if (g_trigger_config.source == TRG_SOURCE_IMM) {
+        apg_trigger_start(0);
+    } else {
+        for (unsigned int n = 0; n < APG_ENGINES; n++) {
+            if (apg_hw_trigger(&s_engines[n])) {
+                apg_engine_start(&s_engines[n]);
+            }
+        }
     }
 
     PWM_IRQ_DEBUG_SET(0);
 }
 
+/* Bring the patterns that become visible with the outputs up to the bit mapping, before apg_outputs_update() on core1 */
+void apg_outputs_prepare(void) {
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        if (e->initialized && e->cfg->is_enabled && g_output_state.enabled) {
+            apg_materialize(e);
+        }
+    }
+}
+
 void apg_outputs_update(void) {
-    bool enabled = g_apg_is_enabled && g_output_state.enabled;
+    for (unsigned int n = 0; n < APG_ENGINES; n++) {
+        apg_engine_t *e = &s_engines[n];
+        bool enabled = e->cfg->is_enabled && g_output_state.enabled;
+        const uint32_t mask = e->active_mask | apg_marker_mask(e->cfg);
+
+        /* Set pin direction for configured apg pins (the pattern was brought up to the mapping by apg_outputs_prepare) */
+        if (enabled) {
+            pio_sm_set_enabled(e->pio, (uint)e->sm, false);
+            pio_sm_set_pindirs_with_mask(e->pio, (uint)e->sm, mask, mask); // Set active bits and the marker to output
+            pio_sm_set_enabled(e->pio, (uint)e->sm, true);
+        }
+
+        for (uint gpio = 0; gpio < APG_MAX_BITS; gpio++) {
+            if (mask & (1u << gpio)) {
+                if (enabled) {
+                    pio_gpio_init(e->pio, gpio);
+                } else {
+                    output_detach(gpio);
+                }
+            }
+        }
+    }
+}
 
-    // CS_ENTER();
+typedef struct {
+    apg_engine_t *e;
+    uint32_t div;
+} apg_sample_div_args_t;
 
-    /* Set pin direction for configured apg pins */
-    if (enabled) {
-        pio_sm_set_enabled(s_pio, (uint)s_sm, false);
-        pio_sm_set_pindirs_with_mask(s_pio, (uint)s_sm, s_active_mask, s_active_mask); // Set active bits to output
-        pio_sm_set_enabled(s_pio, (uint)s_sm, true);
+static int apg_set_sample_div_core1(void *arg) {
+    const apg_sample_div_args_t *args = arg;
+    apg_engine_t *e = args->e;
+
+    CS_ENTER();
+    e->cfg->sample_div = args->div;
+    if (e->sm_format == FORMAT_SAMPLED) {
+        /* Playing: takes effect with the next sample */
+        pio_sm_set_clkdiv_int_frac8(e->pio, (uint)e->sm, e->cfg->sample_div >> 8, (uint8_t)(e->cfg->sample_div & 0xFFu));
     }
+    CS_EXIT();
+    return 0;
+}
 
-    for (uint gpio = 0; gpio < APG_MAX_BITS; gpio++) {
-        if (s_active_mask & (1u << gpio)) {
-            if (enabled) {
-                pio_gpio_init(s_pio, gpio);
-            } else {
-                output_detach(gpio);
-            }
-        }
+/* Set the sample rate of the sampled format; returns -1 if the SM clock divider cannot reach it */
+int apg_set_sample_rate(unsigned int engine, float rate_hz) {
+    apg_engine_t *e = &s_engines[engine];
+    const float div = roundf((float)clock_get_hz(clk_sys) * 256.0f / rate_hz);
+    if (!(div >= (float)APG_SAMPLE_DIV_MIN && div <= (float)APG_SAMPLE_DIV_MAX)) {
+        return -1;
     }
+    if (e->cfg->stream_enabled && e->cfg->gen.type != GEN_TYPE_NONE && div < (float)apg_gen_stream_min_div(&e->cfg->gen)) {
+        return -1; /* faster than core1 generates the records */
+    }
+
+    apg_sample_div_args_t args = {e, (uint32_t)div};
+    (void)core1_call(apg_set_sample_div_core1, &args);
+    apg_duration_update(); /* sampled bursts are planned in samples */
+    return 0;
+}
 
-    // CS_EXIT();
+/* Actual sample rate (the divider has 1/256 resolution) */
+float apg_get_sample_rate(unsigned int engine) {
+    return (float)clock_get_hz(clk_sys) * 256.0f / (float)g_apg_config[engine].sample_div;
 }
 
-bool apg_gpio_in_use(int bit, int gpio) {
+uint32_t apg_gpio_mask(unsigned int engine) {
+    return s_engines[engine].active_mask | apg_marker_mask(&g_apg_config[engine]);
+}
+
+/**
+ * Check if a GPIO is driven by any APG engine.
+ * If engine/bit >= 0, usage by that same logical bit of that engine is ignored (for remapping).
+ */
+bool apg_gpio_in_use(int engine, int bit, int gpio) {
     if (gpio < 0) {
         return false;
     }
 
-    // If the GPIO isn't active at all, it's not in use
-    if ((s_active_mask & (1u << gpio)) == 0) {
-        return false;
-    }
+    for (int n = 0; n < (int)APG_ENGINES; n++) {
+        const apg_engine_t *e = &s_engines[n];
 
-    // GPIO is in use
-    // If bit < 0, report any usage
-    if (bit < 0)
-        return true;
-    // If bit >= 0, ignore usage by that same logical bit (for remapping)
-    return s_logical_for_phys[gpio] != (uint8_t)bit;
+        // The marker is no logical bit, any usage is reported
+        if (e->cfg->marker_gpio == gpio) {
+            return true;
+        }
+
+        // If the GPIO isn't active at all, it's not in use by this engine
+        if ((e->active_mask & (1u << gpio)) == 0) {
+            continue;
+        }
+
+        // GPIO is in use
+        // If bit < 0 or another engine drives it, report any usage
+        if (bit < 0 || n != engine) {
+            return true;
+        }
+        // Otherwise ignore usage by that same logical bit
+        if (e->logical_for_phys[gpio] != (uint8_t)bit) {
+            return true;
+        }
+    }
+    return false;
 }
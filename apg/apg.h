@@ -12,43 +12,200 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "common/state_store.h"
 #include "scpi_server/scpi_enums_gen.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifndef APG_ENGINES
+#define APG_ENGINES 1u /* Set by the build (APG_ENGINES cache variable); one PIO block per engine */
+#endif
+
+#define APG_PS_PER_SEC 1000000000000ull
+
 typedef struct {
     uint32_t value;
-    double duration_sec;
+    uint64_t duration_ps; /* Duration in picoseconds, converted to ticks exactly (integer math only) */
 } apg_value_duration_t;
 
-extern bool g_apg_is_enabled; /* SOUR:APG:STATE */
-extern SOURCE_APG_IDLE_MODE_IDLE_MODE_t g_apg_idle_mode;
-extern uint32_t g_apg_idle_value;
-extern size_t g_apg_data_count;
+/* Readback position in the uploaded pattern, see apg_read_next() */
+typedef struct {
+    unsigned int engine;
+    size_t point;
+    size_t loop;
+    size_t loop_end; /* Index after the last point of the current loop */
+} apg_read_iter_t;
+
+/* Binary block record: packed little-endian {uint32 value, uint32 ticks}, ticks in system clock cycles */
+#define APG_BLOCK_RECORD_SIZE 8u
+/* Loop record: {APG_BLOCK_LOOP_FLAG | points, repeat}, plays the following points repeat times */
+#define APG_BLOCK_LOOP_FLAG 0x80000000u
+/* Packed format record: little-endian {uint16 value, uint16 ticks}; ticks 0 opens a loop over value points,
+ * with the uint32 repeat count in the following 4 bytes */
+#define APG_BLOCK_PACKED_RECORD_SIZE 4u
+#define APG_PACKED_GPIO_MASK 0x0000FFFFu /* GPIOs driven in packed format */
+/* Sampled format record: little-endian uint32 value; APG_BLOCK_LOOP_FLAG | samples opens a loop over the
+ * following samples, with the uint32 repeat count in the following 4 bytes */
+#define APG_BLOCK_SAMPLE_RECORD_SIZE 4u
+
+/* Built-in pattern generator (SOUR:APG:GENerate), see apg_gen.c */
+typedef struct {
+    SOURCE_APGN_GENERATE_TYPE_GEN_TYPE_t type; /* GEN_TYPE_NONE: uploaded pattern or stream records */
+    uint32_t width;                            /* Bits per word, 1..APG_GEN_MAX_WIDTH */
+    uint32_t seed;
+} apg_gen_config_t;
+#define APG_GEN_MAX_WIDTH 24u
+
+/* Settings and state of one engine (SOUR:APG<n>) */
+typedef struct {
+    bool is_enabled; /* SOUR:APG:STATE */
+    SOURCE_APGN_IDLE_MODE_IDLE_MODE_t idle_mode;
+    uint32_t idle_value;
+    size_t data_count;                          /* Points in the uploaded pattern */
+    SOURCE_APGN_DATA_FORMAT_FORMAT_t data_format; /* SOUR:APG:DATA:FORMat */
+    uint32_t sample_div;                        /* SOUR:APG:DATA:SRATe as SM clock divider (16.8 fixed point) */
+    bool stream_enabled;                        /* SOUR:APG:STReam:STATe */
+    bool gapless;                               /* SOUR:APG:GAPLess */
+    bool sequence_enabled;                      /* SOUR:APG:SEQuence:STATe */
+    apg_gen_config_t gen;                       /* SOUR:APG:GENerate */
+    int marker_gpio;                            /* SOUR:APG:MARKer:GPIO, -1: none */
+    int marker_flag;                            /* SOUR:APG:MARKer:FLAG, logical bit, -1: none */
+} apg_config_t;
+
+/* Sequence segment (SOUR:APG:SEQuence:SEGMent<k>): plays points of the uploaded pattern */
+#define APG_MAX_SEGMENTS 32u
+typedef struct {
+    uint32_t start;  /* First point */
+    uint32_t points; /* 0: segment not defined */
+    uint32_t repeat;
+    uint32_t next;   /* Segment played next (1-based), 0: end of the sequence */
+    bool wait;       /* Wait for a trigger before the segment */
+} apg_segment_t;
+
+/* Loopback probe result: periods between rising edges of a GPIO in system clock cycles */
+#define APG_PROBE_MAX_PERIODS 1024u
+typedef struct {
+    uint32_t periods; /* Periods measured */
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+} apg_probe_result_t;
+
+/*
+ * Engine n (0-based, SOUR:APG<n + 1>) runs on PIO block n with its own pattern, bit mapping and idle settings.
+ * All functions taking an engine expect engine < APG_ENGINES; burst and trigger settings are shared.
+ */
+extern apg_config_t g_apg_config[APG_ENGINES];
 
 void apg_init_module(void);
 
-int apg_write_data(apg_value_duration_t *pairs, size_t count, bool append);
-int apg_read_data(apg_value_duration_t **pairs, size_t *out_count);
+/* Saved state (*SAV and *RCL): settings, upload side (pattern, loops, segments, mapping) of an engine */
+#define APG_STATE_REGIONS 3u
+size_t apg_state_regions(unsigned int engine, state_region_t *regions);
+void apg_state_recalled(unsigned int engine); /* Rebuild and commit after the regions were copied back */
 
-void apg_set_mapping(unsigned int logical_bit, int gpio);
-void apg_get_mapping(unsigned int logical_bit, int *gpio);
-uint32_t apg_map_logical_to_phys(uint32_t logical_word);
+/**
+ * System clock change (see sysclock.c): apg_clock_check() returns -1 if an uploaded pattern cannot be
+ * re-derived for the new clock, apg_clock_changed() re-derives and commits the patterns after the change.
+ */
+int apg_clock_check(uint32_t old_hz, uint32_t new_hz);
+void apg_clock_changed(uint32_t old_hz, uint32_t new_hz);
+
+size_t apg_data_capacity(unsigned int engine); /* Pattern memory in points (of the current format) */
+void apg_set_format(unsigned int engine, SOURCE_APGN_DATA_FORMAT_FORMAT_t format);
+int apg_set_sample_rate(unsigned int engine, float rate_hz); /* -1: out of range, or too fast for a generated stream */
+float apg_get_sample_rate(unsigned int engine);
+int apg_write_data(unsigned int engine, apg_value_duration_t *pairs, size_t count, bool append);
+int apg_write_block(unsigned int engine, const uint8_t *data, size_t len, bool append);
+void apg_read_begin(unsigned int engine, apg_read_iter_t *it);
+bool apg_read_next(apg_read_iter_t *it, apg_value_duration_t *pair);
 
-void apg_set_state(bool state);
-void apg_update_idle(void);
-void apg_trigger_start(void);
-void apg_abort(void);
+void apg_set_mapping(unsigned int engine, unsigned int logical_bit, int gpio);
+void apg_get_mapping(unsigned int engine, unsigned int logical_bit, int *gpio);
+
+/**
+ * Marker output: a GPIO driven high with the first point played (at the start and at every wrap) and with
+ * the points that have the flag bit set, by the same `out` as the point itself. Applied to the committed
+ * pattern when it becomes visible, like a mapping change (see apg_materialize).
+ * Returns -1 if the committed pattern has no room in its loop table to mark the start.
+ */
+int apg_set_marker(unsigned int engine, int gpio, int flag_bit);
+
+void apg_set_state(unsigned int engine, bool state);
+void apg_set_gapless(unsigned int engine, bool state);
+void apg_update_idle(unsigned int engine);
+bool apg_trigger_start(uint32_t pwm_slices); /* All enabled engines in the same clock cycle, the PWM slices with the store before */
+void apg_trigger_service(void); /* Trigger source EXT or INT: follow and re-arm the engines (core1 main loop) */
+void apg_int_timer_update(void); /* Trigger source INT: (re)start or stop the hardware timers */
+uint32_t apg_int_missed(void);   /* Trigger source INT: periods the engines missed, busy with a burst */
+bool apg_int_software(void);     /* Trigger source INT: an engine is left to the software timer */
+void apg_duration_update(void);  /* Burst duration changed: plan the DURATION bursts again */
+void apg_trigger_rearm(void);    /* Trigger delay changed: arm the engines waiting for the trigger again */
+void apg_abort(void);         /* All engines */
+void apg_outputs_prepare(void); /* Before apg_outputs_update, on core0: walks the patterns */
 void apg_outputs_update(void);
 
+/**
+ * Pattern uploads go to a shadow bank while the committed bank keeps playing.
+ * apg_commit_data() hands the shadow bank over; the switch happens at the next pattern wrap.
+ * apg_shadow_ready() returns false until that switch has happened and the shadow bank may be written again.
+ */
+bool apg_shadow_ready(unsigned int engine);
+int apg_commit_data(unsigned int engine);
+
+/**
+ * Undo an upload whose commit failed (the segment sequence does not compile with it): apg_upload_save()
+ * keeps the uploaded pattern, in the spare bank (so only while apg_shadow_ready() is true), and
+ * apg_upload_restore() brings it back after apg_commit_data() returned -1.
+ */
+void apg_upload_save(unsigned int engine);
+void apg_upload_restore(unsigned int engine);
+
+/**
+ * Segment sequencer (cfg->sequence_enabled): instead of the pattern as uploaded, play a list of its
+ * point ranges, each repeat times, in the order of their next links, starting at segment 1 (segments
+ * are 1-based). Segments and the state take effect with the next commit; apg_commit_data() returns -1
+ * if segment 1 is not defined or the sequence does not fit the loop table (APG_MAX_LOOPS descriptors).
+ */
+void apg_set_segment(unsigned int engine, unsigned int segment, const apg_segment_t *seg);
+void apg_get_segment(unsigned int engine, unsigned int segment, apg_segment_t *seg);
+
+/**
+ * Built-in pattern generator: with streaming off, one period of the sequence replaces the uploaded pattern
+ * (and its format, which becomes sampled) like an upload, to be committed as such; with streaming on, core1
+ * feeds the stream ring with it (apg_stream_service), restarting at the seed on every trigger.
+ * Returns -1 if the period does not fit the pattern memory (streaming off) or the sample rate is faster
+ * than core1 generates the records (streaming on).
+ */
+int apg_set_generator(unsigned int engine, const apg_gen_config_t *gen);
+
+/**
+ * Streaming mode: instead of replaying the pattern, a trigger plays records pushed into a ring buffer.
+ * apg_stream_service() must be polled (core1 main loop) to keep the DMA and the generator fed (all engines).
+ * apg_stream_write_block() returns -3 while the generator feeds the ring.
+ */
+void apg_stream_set_state(unsigned int engine, bool state);
+int apg_stream_write_block(unsigned int engine, const uint8_t *data, size_t len);
+size_t apg_stream_free(unsigned int engine);
+uint32_t apg_stream_underruns(unsigned int engine);
+void apg_stream_service(void);
+
+/**
+ * Measure the periods of a GPIO driven by the APG (or anything else) with a spare SM of the engine's PIO
+ * block, e.g. to check the jitter at the pattern wrap. Blocks until the periods are captured or for 5 ms.
+ * Returns 0 on success, -1 if no SM or DMA channel is free, -2 if no full period was seen, -3 if there
+ * is no program space (the apg_trig and apg_timer programs take it while the trigger source is EXT or INT).
+ */
+int apg_probe_periods(unsigned int engine, unsigned int gpio, uint32_t periods, apg_probe_result_t *result);
+
 /**
  * Check if a given GPIO pin is currently assigned to any APG channel.
- * If bit >= 0, usage by that same logical bit is ignored.
+ * If engine and bit are >= 0, usage by that same logical bit of that engine is ignored.
  * If bit < 0, any usage is reported.
  */
-bool apg_gpio_in_use(int bit, int gpio);
+bool apg_gpio_in_use(int engine, int bit, int gpio);
+uint32_t apg_gpio_mask(unsigned int engine); /* GPIOs driven: mapped to a logical bit or the marker */
 
 #ifdef __cplusplus
 }
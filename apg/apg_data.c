@@ -5,189 +5,825 @@
  * See the repository LICENSE file for the full text.
  */
 
-#include <math.h>
-#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "hardware/clocks.h"
+#include "hardware/sync.h"
 
 #include "apg_internal.h"
 #include "apg.h"
 
 
-static double s_tick_error = 0.0;
+/* Carried conversion error in 1e-12 ticks; starts at half a tick so every point edge rounds to nearest */
+#define APG_TICK_ERROR_INIT ((int64_t)(APG_PS_PER_SEC / 2u))
 
-uint32_t apg_map_logical_to_phys(uint32_t logical_word) {
-    uint32_t mapped = 0;
-    uint32_t pending = logical_word;
-    while (pending) {
-        uint32_t logical_bit = __builtin_stdc_trailing_zeros(pending);
-        pending &= pending - 1;
-        mapped |= (1u << s_phys_for_logical[logical_bit]);
+/* Byte-sliced mapping table (e->phys_lut): a word maps to the OR of one entry per byte, whatever the number of set bits */
+static void apg_build_lut(uint32_t lut[4][256], const uint8_t map[APG_MAX_BITS]) {
+    for (uint slice = 0; slice < 4; slice++) {
+        lut[slice][0] = 0;
+        for (uint byte = 1; byte < 256; byte++) {
+            /* Entry without the lowest bit is already known, add the lowest one */
+            const uint lowest = __builtin_ctz(byte);
+            lut[slice][byte] = lut[slice][byte & (byte - 1)] | (1u << map[slice * 8 + lowest]);
+        }
+    }
+}
+
+/* Rebuild the mapping table; must be called whenever e->phys_for_logical changes */
+void apg_update_map_luts(apg_engine_t *e) {
+    apg_build_lut(e->phys_lut, e->phys_for_logical);
+}
+
+static __force_inline uint32_t apg_map_word(const uint32_t lut[4][256], uint32_t word) {
+    return lut[0][word & 0xFFu] | lut[1][(word >> 8) & 0xFFu] | lut[2][(word >> 16) & 0xFFu] | lut[3][word >> 24];
+}
+
+uint32_t apg_map_logical_to_phys(const apg_engine_t *e, uint32_t logical_word) {
+    return apg_map_word(e->phys_lut, logical_word);
+}
+
+/* Map a point value, with the marker driven by the flag bit instead of whatever logical bit sits on its GPIO */
+uint32_t apg_map_marked(const apg_engine_t *e, uint32_t logical_word) {
+    const uint32_t marker = apg_marker_mask(e->cfg);
+    const uint32_t phys = apg_map_word(e->phys_lut, logical_word) & ~marker;
+    if (e->cfg->marker_flag >= 0 && (logical_word & (1u << e->cfg->marker_flag)) != 0) {
+        return phys | marker;
+    }
+    return phys;
+}
+
+/* Physical -> physical table from the mapping of a committed bank to the current one (see apg_remap) */
+static uint32_t s_remap_lut[4][256];
+
+/* Rebuild the table for apg_remap_marked(); called once before the words of a bank are re-mapped */
+void apg_update_remap_lut(const apg_engine_t *e, const apg_bank_t *bank) {
+    uint8_t map[APG_MAX_BITS];
+    for (uint bit = 0; bit < APG_MAX_BITS; bit++) {
+        map[bit] = e->phys_for_logical[bank->logical_for_phys[bit]];
+    }
+    apg_build_lut(s_remap_lut, map);
+}
+
+/*
+ * Move a point value of a committed bank to the current mapping and marker. The old marker GPIO only
+ * carried the flag bit (and the start mark), so the logical bit it covered is lost and comes out low.
+ */
+uint32_t apg_remap_marked(const apg_engine_t *e, const apg_bank_t *bank, uint32_t phys_word) {
+    const uint32_t marker = apg_marker_mask(e->cfg);
+    const uint32_t phys = apg_map_word(s_remap_lut, phys_word & ~bank->marker);
+    const int flag_bit = e->cfg->marker_flag;
+    if (flag_bit < 0) {
+        return phys & ~marker;
+    }
+    const bool flag = (bank->marker != 0 && bank->marker_flag == flag_bit) ? (phys_word & bank->marker) != 0
+                                                                         : (phys & (1u << e->phys_for_logical[flag_bit])) != 0;
+    return (phys & ~marker) | (flag ? marker : 0u);
+}
+
+/* Drop the uploaded pattern, keeping the loop table zero beyond e->loop_count */
+static void apg_clear_data(apg_engine_t *e) {
+    memset(e->loops, 0, e->loop_count * sizeof(apg_loop_t));
+    e->loop_count = 0;
+    e->loop_remaining = 0;
+    e->cfg->data_count = 0;
+    e->tick_error = APG_TICK_ERROR_INIT;
+    e->sample_error = 0;
+}
+
+/* The pattern is no longer the generated one (a generator feeding the stream is not affected) */
+static void apg_pattern_uploaded(apg_engine_t *e) {
+    if (!e->cfg->stream_enabled) {
+        e->cfg->gen.type = GEN_TYPE_NONE;
+    }
+}
+
+/* Reset the upload side of an engine: empty pattern, identity bit mapping with no GPIO enabled */
+void apg_data_init(apg_engine_t *e) {
+    e->active_mask = 0;
+    for (size_t i = 0; i < APG_MAX_BITS; i++) {
+        e->phys_for_logical[i] = (uint8_t)i;
+        e->logical_for_phys[i] = (uint8_t)i;
     }
-    return mapped;
+    apg_update_map_luts(e);
+
+    memset(e->loops, 0, sizeof(e->loops));
+    e->loop_count = 0;
+    e->map_dirty = false;
+    apg_clear_data(e);
+
+    memset(e->segments, 0, sizeof(e->segments));
+}
+
+size_t apg_state_regions(unsigned int engine, state_region_t *regions) {
+    apg_engine_t *e = &s_engines[engine];
+    /* Upload side from the loop table to the bit mapping (see apg_engine_t) */
+    const size_t upload_size = offsetof(apg_engine_t, phys_lut) - offsetof(apg_engine_t, loops);
+    const size_t data_size = e->cfg->data_count * apg_point_words(e->cfg->data_format) * sizeof(uint32_t);
+
+    regions[0] = (state_region_t){e->cfg, sizeof(apg_config_t), sizeof(apg_config_t)};
+    regions[1] = (state_region_t){e->loops, upload_size, upload_size};
+    regions[2] = (state_region_t){e->data, data_size, APG_MAX_DATA_WORDS * sizeof(uint32_t)};
+    return APG_STATE_REGIONS;
+}
+
+/* Upload side kept by apg_upload_save(), besides the points (in the spare bank) */
+static struct {
+    apg_loop_t loops[APG_MAX_LOOPS];
+    size_t loop_count;
+    uint32_t loop_remaining;
+    int64_t tick_error;
+    int64_t sample_error;
+    size_t data_count;
+    SOURCE_APGN_DATA_FORMAT_FORMAT_t format;
+    apg_gen_config_t gen;
+} s_upload_save;
+
+void apg_upload_save(unsigned int engine) {
+    apg_engine_t *e = &s_engines[engine];
+
+    /* The spare bank is only written by the next commit, which fails before it touches the points */
+    memcpy(apg_spare_bank(e)->mem, e->data, e->cfg->data_count * apg_point_words(e->cfg->data_format) * sizeof(uint32_t));
+    memcpy(s_upload_save.loops, e->loops, sizeof(e->loops));
+    s_upload_save.loop_count = e->loop_count;
+    s_upload_save.loop_remaining = e->loop_remaining;
+    s_upload_save.tick_error = e->tick_error;
+    s_upload_save.sample_error = e->sample_error;
+    s_upload_save.data_count = e->cfg->data_count;
+    s_upload_save.format = e->cfg->data_format;
+    s_upload_save.gen = e->cfg->gen;
 }
 
-static uint32_t apg_map_phys_to_logical(uint32_t phys_word) {
-    uint32_t logical = 0;
-    uint32_t pending = phys_word;
-    while (pending) {
-        uint32_t phys_bit = __builtin_stdc_trailing_zeros(pending);
-        pending &= pending - 1;
-        logical |= (1u << s_logical_for_phys[phys_bit]);
+void apg_upload_restore(unsigned int engine) {
+    apg_engine_t *e = &s_engines[engine];
+
+    memcpy(e->data, apg_spare_bank(e)->mem, s_upload_save.data_count * apg_point_words(s_upload_save.format) * sizeof(uint32_t));
+    memcpy(e->loops, s_upload_save.loops, sizeof(e->loops));
+    e->loop_count = s_upload_save.loop_count;
+    e->loop_remaining = s_upload_save.loop_remaining;
+    e->tick_error = s_upload_save.tick_error;
+    e->sample_error = s_upload_save.sample_error;
+    e->cfg->data_count = s_upload_save.data_count;
+    e->cfg->data_format = s_upload_save.format;
+    e->cfg->gen = s_upload_save.gen;
+}
+
+void apg_set_segment(unsigned int engine, unsigned int segment, const apg_segment_t *seg) {
+    s_engines[engine].segments[segment - 1u] = *seg;
+}
+
+void apg_get_segment(unsigned int engine, unsigned int segment, apg_segment_t *seg) {
+    *seg = s_engines[engine].segments[segment - 1u];
+}
+
+/* Append the descriptors playing points [start, end) of the uploaded pattern at loops[n]; returns their number or -1 */
+static int apg_emit_range(const apg_engine_t *e, size_t start, size_t end, apg_loop_t *loops, size_t n) {
+    const size_t words = apg_point_words(e->cfg->data_format);
+    size_t first = 0; /* First point of descriptor i */
+    int count = 0;
+
+    for (size_t i = 0; i < e->loop_count && first < end; i++) {
+        const size_t points = e->loops[i].count / words;
+        const size_t from = (start > first) ? start : first;
+        const size_t to = (end < first + points) ? end : first + points;
+        if (from < to) {
+            /* A range cutting into a loop plays the covered part of its body repeat times */
+            if (n + (size_t)count >= APG_MAX_LOOPS) {
+                return -1;
+            }
+            loops[n + (size_t)count++] = (apg_loop_t){.repeat = e->loops[i].repeat,
+                                                      .count = (uint32_t)((to - from) * words),
+                                                      .data = e->loops[i].data + (from - first) * words};
+        }
+        first += points;
     }
-    return logical;
+    return count;
+}
+
+/**
+ * Compile the segment sequence into a loop table with e->data pointers, following the next links from segment 1.
+ * The sequence ends at a link to 0 or an undefined segment, or at a link back to a segment already played:
+ * *wrap is set to its first descriptor, where continuous mode continues after the end (0 otherwise).
+ * Segment ranges are clipped to the uploaded pattern.
+ * Returns the number of descriptors, or -1 if the sequence is empty or overflows the loop table.
+ */
+int apg_compile_sequence(const apg_engine_t *e, apg_loop_t *loops, size_t *wrap) {
+    const size_t data_count = e->cfg->data_count;
+    size_t first_loop[APG_MAX_SEGMENTS];
+    uint32_t visited = 0;
+    size_t n = 0;
+    uint32_t k = 1;
+
+    *wrap = 0;
+    while (k >= 1 && k <= APG_MAX_SEGMENTS && e->segments[k - 1].points > 0) {
+        const apg_segment_t *seg = &e->segments[k - 1];
+        if (visited & (1u << (k - 1))) {
+            *wrap = first_loop[k - 1];
+            break;
+        }
+        visited |= 1u << (k - 1);
+        first_loop[k - 1] = n;
+
+        const size_t start = (seg->start < data_count) ? seg->start : data_count;
+        const size_t end = (seg->points < data_count - start) ? start + seg->points : data_count;
+        const int count = apg_emit_range(e, start, end, loops, n);
+        if (count < 0) {
+            return -1;
+        }
+
+        size_t emitted = (size_t)count;
+        if (count == 1 && (uint64_t)loops[n].repeat * seg->repeat <= UINT32_MAX) {
+            /* A single descriptor is repeated by the sequencer */
+            loops[n].repeat *= seg->repeat;
+        } else if (count > 0) {
+            /* Otherwise the descriptors are unrolled */
+            if ((uint64_t)count * seg->repeat > APG_MAX_LOOPS - n) {
+                return -1;
+            }
+            for (uint32_t r = 1; r < seg->repeat; r++) {
+                memcpy(&loops[n + emitted], &loops[n], (size_t)count * sizeof(apg_loop_t));
+                emitted += (size_t)count;
+            }
+        }
+        if (count > 0 && seg->wait) {
+            loops[n].flags = APG_LOOP_WAIT; /* Before the first repetition only */
+        }
+        n += emitted;
+        k = seg->next;
+    }
+
+    if (n == 0) {
+        return -1;
+    }
+    if (*wrap >= n) {
+        *wrap = 0; /* nothing to play behind the link back */
+    }
+    return (int)n;
+}
+
+/**
+ * Append a point (logical value, SM ticks) in the pattern format, extending the open loop or plain run.
+ * Packed points must fit APG_PACKED_MAX_VALUE/APG_PACKED_MAX_TICKS, with ticks > 0. Sampled points ignore ticks.
+ * Returns 0 on success, -1 if there is not enough capacity.
+ */
+static int apg_push_point(apg_engine_t *e, uint32_t value, uint32_t ticks) {
+    const size_t words = apg_point_words(e->cfg->data_format);
+    const size_t pos = e->cfg->data_count * words;
+    if (pos + words > APG_MAX_DATA_WORDS) {
+        return -1;
+    }
+
+    /* A loop with repeat 1 is a plain run, which takes further points as well */
+    if (e->loop_count == 0 || (e->loop_remaining == 0 && e->loops[e->loop_count - 1].repeat != 1)) {
+        if (e->loop_count >= APG_MAX_LOOPS) {
+            return -1;
+        }
+        e->loops[e->loop_count++] = (apg_loop_t){.repeat = 1, .data = &e->data[pos]};
+    }
+    if (e->loop_remaining > 0) {
+        e->loop_remaining--;
+    }
+
+    switch (e->cfg->data_format) {
+    case FORMAT_PACKED:
+        e->data[pos] = value | (ticks << APG_PACKED_TICKS_SHIFT);
+        break;
+    case FORMAT_SAMPLED:
+        e->data[pos] = value;
+        break;
+    default:
+        e->data[pos] = value;
+        e->data[pos + 1] = ticks;
+        break;
+    }
+    e->cfg->data_count++;
+    e->loops[e->loop_count - 1].count += (uint32_t)words;
+    return 0;
+}
+
+/**
+ * Open a loop: the next items points are played repeat times.
+ * Returns 0 on success, -1 if there is not enough capacity, -2 if invalid (nested loop, zero items or repeat).
+ */
+static int apg_push_loop(apg_engine_t *e, uint32_t items, uint32_t repeat) {
+    if (items == 0 || repeat == 0 || e->loop_remaining > 0) {
+        return -2;
+    }
+    if (e->loop_count >= APG_MAX_LOOPS) {
+        return -1;
+    }
+    e->loops[e->loop_count++] = (apg_loop_t){.repeat = repeat, .data = &e->data[e->cfg->data_count * apg_point_words(e->cfg->data_format)]};
+    e->loop_remaining = items;
+    return 0;
+}
+
+/* Floor division, also for negative dividends */
+static __force_inline int64_t floor_div(int64_t a, int64_t b) {
+    const int64_t q = a / b;
+    return (a % b < 0) ? q - 1 : q;
+}
+
+/**
+ * Convert a duration to whole ticks, adding the carried error (1e-12 ticks) and leaving the fraction in it.
+ * Split at microseconds so all products fit in 64 bit (durations up to 4000 s at any 32 bit clock_hz, 15 s
+ * at 256 times that): ps * clock_hz = us * clock_hz * 1e6 + ps_rest * clock_hz.
+ */
+static int64_t apg_ps_to_ticks(uint64_t duration_ps, uint64_t clock_hz, int64_t *error) {
+    const uint64_t us_ticks = (duration_ps / 1000000u) * clock_hz; /* in 1e-6 ticks */
+    int64_t ticks = (int64_t)(us_ticks / 1000000u);
+    int64_t frac = (int64_t)(us_ticks % 1000000u) * 1000000 + (int64_t)((duration_ps % 1000000u) * clock_hz) + *error;
+
+    const int64_t carry = floor_div(frac, (int64_t)APG_PS_PER_SEC);
+    ticks += carry;
+    *error = frac - carry * (int64_t)APG_PS_PER_SEC;
+    return ticks;
+}
+
+/*
+ * Sampled format variant of apg_write_data: durations are rounded to whole samples, carrying the error,
+ * points shorter than half a sample are dropped.
+ */
+static int apg_write_samples(apg_engine_t *e, const apg_value_duration_t *pairs, size_t count) {
+    /* Durations in 1/256 system clock cycles, the unit of the sample divider */
+    const uint64_t clock = (uint64_t)clock_get_hz(clk_sys) * 256u;
+    const int64_t div = (int64_t)e->cfg->sample_div;
+
+    for (size_t i = 0; i < count; i++) {
+        const int64_t requested = apg_ps_to_ticks(pairs[i].duration_ps, clock, &e->tick_error) + e->sample_error;
+        const int64_t samples = floor_div(requested + div / 2, div);
+        if (samples > (int64_t)UINT32_MAX) {
+            return -1;
+        }
+
+        int res = 0;
+        if (samples > (int64_t)APG_SAMPLE_MAX_INLINE) {
+            res = apg_push_loop(e, 1u, (uint32_t)samples);
+            if (res == 0) {
+                res = apg_push_point(e, pairs[i].value, 0);
+            }
+        } else {
+            for (int64_t n = 0; n < samples && res == 0; n++) {
+                res = apg_push_point(e, pairs[i].value, 0);
+            }
+        }
+        if (res != 0) {
+            return res;
+        }
+
+        e->sample_error = requested - samples * div;
+    }
+
+    return 0;
 }
 
 /**
  * Write APG data points.
  * If append is false, this replaces all existing points. If true, new points are appended to the end of the existing points.
- * Returns 0 on success, -1 if there is not enough capacity to store the new points.
+ * Durations are converted with exact integer math; the rounding error is carried to the next point, so the
+ * same upload always yields the same ticks and point edges never drift.
+ * Durations too long for a single point (16 bit ticks in packed format) are played as a loop over one point.
+ * In sampled format, durations are rounded to whole samples (see apg_write_samples).
+ * Returns 0 on success, -1 if there is not enough capacity to store the new points, -2 if a long duration
+ * falls into a loop opened by a previous binary block, -3 if a value does not fit the packed format.
  */
-int apg_write_data(apg_value_duration_t *pairs, size_t count, bool append) {
-    size_t dst = append ? g_apg_data_count : 0;
+int apg_write_data(unsigned int engine, apg_value_duration_t *pairs, size_t count, bool append) {
+    apg_engine_t *e = &s_engines[engine];
+    apg_pattern_uploaded(e);
     const uint32_t clock_hz = clock_get_hz(clk_sys); /* system clock */
-    if (!append) s_tick_error = 0.0; // Reset tick error when not appending
+    const bool packed = (e->cfg->data_format == FORMAT_PACKED);
+    const uint32_t max_ticks = packed ? APG_PACKED_MAX_TICKS : UINT32_MAX;
+    const int64_t min_ticks = packed ? 1 : 0; /* packed ticks 0 is the escape to a wide point */
+    if (!append) apg_clear_data(e); // Also resets the tick error
+    if (e->cfg->data_format == FORMAT_SAMPLED) {
+        return apg_write_samples(e, pairs, count);
+    }
 
     for (size_t i = 0; i < count; i++) {
-        const uint32_t mapped_value = apg_map_logical_to_phys(pairs[i].value);
-        double requested_ticks = (pairs[i].duration_sec * (double)clock_hz) + s_tick_error;
+        if (packed && pairs[i].value > APG_PACKED_MAX_VALUE) {
+            return -3;
+        }
 
-        while (requested_ticks > (double)UINT32_MAX) {
-            if (dst >= APG_MAX_DATA_POINTS) {
+        int64_t error = e->tick_error;
+        int64_t requested_ticks = apg_ps_to_ticks(pairs[i].duration_ps, clock_hz, &error);
+
+        if (requested_ticks > (int64_t)max_ticks) {
+            const int64_t point_ticks = (int64_t)max_ticks + APG_TICK_OVERHEAD;
+            const int64_t repeat = (requested_ticks - (int64_t)max_ticks + point_ticks - 1) / point_ticks; // ceil
+            if (repeat > (int64_t)UINT32_MAX) {
                 return -1;
             }
-            s_data[dst].value = mapped_value;
-            s_data[dst].ticks = UINT32_MAX;
-            dst++;
-            requested_ticks -= ((double)UINT32_MAX + 3.0); // Account for the 3 tick overhead per point
+            int res = apg_push_loop(e, 1u, (uint32_t)repeat);
+            if (res == 0) {
+                res = apg_push_point(e, pairs[i].value, max_ticks);
+            }
+            if (res != 0) {
+                return res;
+            }
+            requested_ticks -= repeat * point_ticks;
+        }
+
+        int64_t programmed_ticks = requested_ticks - APG_TICK_OVERHEAD;
+        if (programmed_ticks < min_ticks) {
+            programmed_ticks = min_ticks;
         }
 
-        if (dst >= APG_MAX_DATA_POINTS) {
+        if (apg_push_point(e, pairs[i].value, (uint32_t)programmed_ticks) != 0) {
             return -1;
         }
 
-        double programmed_ticks_f = round(requested_ticks - 3.0);
-        if (programmed_ticks_f < 0.0) {
-            programmed_ticks_f = 0.0;
+        /* Ticks lost to the minimum point length are taken from the next point */
+        e->tick_error = error + (requested_ticks - (programmed_ticks + APG_TICK_OVERHEAD)) * (int64_t)APG_PS_PER_SEC;
+    }
+
+    return 0;
+}
+
+/**
+ * Re-derive the uploaded pattern for a new system clock, keeping the point durations: ticks are rounded to
+ * the new clock with the error carried to the next point, like an upload. A loop keeps its repeat count,
+ * so the rounding error of its body is carried once per repetition. Sampled patterns keep their sample
+ * rate (divider) instead.
+ * With apply false, only checks. Returns -1 if a point or the divider does not fit at the new clock
+ * (upload the pattern again then), 0 otherwise.
+ */
+int apg_rescale_ticks(unsigned int engine, uint32_t old_hz, uint32_t new_hz, bool apply) {
+    apg_engine_t *e = &s_engines[engine];
+
+    if (e->cfg->data_format == FORMAT_SAMPLED) {
+        const uint64_t div = ((uint64_t)e->cfg->sample_div * new_hz + old_hz / 2u) / old_hz;
+        if (div < APG_SAMPLE_DIV_MIN || div > APG_SAMPLE_DIV_MAX) {
+            return -1;
         }
+        if (apply) {
+            e->cfg->sample_div = (uint32_t)div;
+            e->sample_error = e->sample_error * (int64_t)new_hz / (int64_t)old_hz;
+        }
+        return 0;
+    }
 
-        const uint32_t programmed_ticks = (uint32_t)programmed_ticks_f;
-        s_data[dst].value = mapped_value;
-        s_data[dst].ticks = programmed_ticks;
-        dst++;
+    const bool packed = (e->cfg->data_format == FORMAT_PACKED);
+    const size_t words = apg_point_words(e->cfg->data_format);
+    const int64_t max_ticks = packed ? APG_PACKED_MAX_TICKS : UINT32_MAX;
+    const int64_t min_ticks = packed ? 1 : 0; /* packed ticks 0 is the escape to a wide point */
+    const int64_t half = (int64_t)old_hz / 2;
+    int64_t carry = half; /* Carried error in 1/old_hz new ticks, offset by half a tick to round */
+    size_t point = 0;
+
+    for (size_t l = 0; l < e->loop_count; l++) {
+        const apg_loop_t *loop = &e->loops[l];
+        const size_t points = loop->count / words;
+        int64_t error = (loop->repeat > 1u) ? half : carry;
+
+        for (size_t p = point; p < point + points; p++) {
+            uint32_t *word = &e->data[p * words];
+            const uint32_t ticks = packed ? (word[0] >> APG_PACKED_TICKS_SHIFT) : word[1];
+            const int64_t scaled = ((int64_t)ticks + APG_TICK_OVERHEAD) * (int64_t)new_hz + error;
+            int64_t programmed = floor_div(scaled, (int64_t)old_hz) - APG_TICK_OVERHEAD;
+            if (programmed < min_ticks) {
+                programmed = min_ticks; /* taken from the next point */
+            }
+            if (programmed > max_ticks) {
+                return -1;
+            }
+            error = scaled - (programmed + APG_TICK_OVERHEAD) * (int64_t)old_hz;
+
+            if (apply) {
+                if (packed) {
+                    word[0] = (word[0] & APG_PACKED_MAX_VALUE) | ((uint32_t)programmed << APG_PACKED_TICKS_SHIFT);
+                } else {
+                    word[1] = (uint32_t)programmed;
+                }
+            }
+        }
 
-        s_tick_error = requested_ticks - ((double)programmed_ticks + 3.0);
+        if (loop->repeat > 1u) {
+            if (error - half > INT64_MAX / loop->repeat || error - half < INT64_MIN / loop->repeat) {
+                return -1;
+            }
+            carry += (error - half) * (int64_t)loop->repeat;
+        } else {
+            carry = error;
+        }
+        point += points;
     }
 
-    g_apg_data_count = dst;
+    if (apply) {
+        /* Continue appends with the carried error, in 1e-12 ticks */
+        e->tick_error = floor_div(carry * 1000000, (int64_t)old_hz) * 1000000;
+    }
     return 0;
 }
 
+/* Decode one binary block record into an item (logical value, SM ticks). Returns false if it is out of range. */
+static bool apg_decode_record(const uint8_t *record, apg_item_t *item) {
+    uint32_t value;
+    uint32_t ticks;
+    /* Block data is not aligned; memcpy keeps the loads legal (RP2xxx is little-endian) */
+    memcpy(&value, record, sizeof(value));
+    memcpy(&ticks, record + sizeof(value), sizeof(ticks));
 
+    if (value > APG_MAX_VALUE || ticks < APG_TICK_OVERHEAD) {
+        return false;
+    }
+
+    item->value = value;
+    item->ticks = ticks - APG_TICK_OVERHEAD;
+    return true;
+}
 
-static uint32_t remap_word(uint32_t word, const uint8_t old_logical_for_phys[APG_MAX_BITS]) {
-    /* Convert physical word -> logical via old map -> new physical via current map. */
-    uint32_t logical = 0;
-    uint32_t tmp = word;
-    while (tmp) {
-        uint32_t phys = __builtin_stdc_trailing_zeros(tmp);
-        tmp &= tmp - 1;
-        logical |= (1u << old_logical_for_phys[phys]);
+/* Packed format variant of apg_write_block (APG_BLOCK_PACKED_RECORD_SIZE bytes per point) */
+static int apg_write_packed_block(apg_engine_t *e, const uint8_t *data, size_t len) {
+    if (len % APG_BLOCK_PACKED_RECORD_SIZE != 0) {
+        return -2;
     }
 
-    uint32_t mapped = 0;
-    uint32_t ltmp = logical;
-    while (ltmp) {
-        uint32_t logical_bit = __builtin_stdc_trailing_zeros(ltmp);
-        ltmp &= ltmp - 1;
-        mapped |= (1u << s_phys_for_logical[logical_bit]);
+    for (size_t pos = 0; pos < len; pos += APG_BLOCK_PACKED_RECORD_SIZE) {
+        uint32_t record;
+        memcpy(&record, data + pos, sizeof(record));
+        const uint32_t value = record & APG_PACKED_MAX_VALUE;
+        const uint32_t ticks = record >> APG_PACKED_TICKS_SHIFT;
+
+        int res;
+        if (ticks == 0) {
+            /* Loop record, the repeat count follows */
+            uint32_t repeat;
+            pos += APG_BLOCK_PACKED_RECORD_SIZE;
+            if (pos >= len) {
+                return -2;
+            }
+            memcpy(&repeat, data + pos, sizeof(repeat));
+            res = apg_push_loop(e, value, repeat);
+        } else if (ticks <= APG_TICK_OVERHEAD) {
+            return -2; /* packed ticks 0 is the escape */
+        } else {
+            res = apg_push_point(e, value, ticks - APG_TICK_OVERHEAD);
+        }
+        if (res != 0) {
+            return res;
+        }
     }
 
-    return mapped;
+    return 0;
 }
 
-static void apg_remap_data(const uint8_t old_logical_for_phys[APG_MAX_BITS]) {
-    for (size_t i = 0; i < g_apg_data_count; i++) {
-        uint32_t remapped = remap_word(s_data[i].value, old_logical_for_phys);
-        s_data[i].value = remapped;
+/* Sampled format variant of apg_write_block (APG_BLOCK_SAMPLE_RECORD_SIZE bytes per sample) */
+static int apg_write_sample_block(apg_engine_t *e, const uint8_t *data, size_t len) {
+    if (len % APG_BLOCK_SAMPLE_RECORD_SIZE != 0) {
+        return -2;
     }
+
+    for (size_t pos = 0; pos < len; pos += APG_BLOCK_SAMPLE_RECORD_SIZE) {
+        uint32_t value;
+        memcpy(&value, data + pos, sizeof(value));
+
+        int res;
+        if ((value & ~APG_MAX_VALUE) == APG_BLOCK_LOOP_FLAG) {
+            /* Loop record, the repeat count follows */
+            uint32_t repeat;
+            pos += APG_BLOCK_SAMPLE_RECORD_SIZE;
+            if (pos >= len) {
+                return -2;
+            }
+            memcpy(&repeat, data + pos, sizeof(repeat));
+            res = apg_push_loop(e, value & APG_MAX_VALUE, repeat);
+        } else if (value > APG_MAX_VALUE) {
+            return -2;
+        } else {
+            res = apg_push_point(e, value, 0);
+        }
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    return 0;
 }
 
-void apg_set_mapping(unsigned int logical_bit, int gpio) {
-    /* Back up old mapping to remap stored data if we swap. */
-    uint8_t old_logical_for_phys[APG_MAX_BITS];
-    memcpy(old_logical_for_phys, s_logical_for_phys, sizeof(old_logical_for_phys));
+/**
+ * Write APG data points from a binary block (APG_BLOCK_RECORD_SIZE bytes per point, see
+ * APG_BLOCK_PACKED_RECORD_SIZE and APG_BLOCK_SAMPLE_RECORD_SIZE for the other formats).
+ * Each record is a little-endian {value, ticks} pair, with ticks being the total point duration in system
+ * clock cycles. Records are checked and stored directly into e->data in a single pass.
+ * A record with APG_BLOCK_LOOP_FLAG set in value is a loop instead: the next (value & APG_MAX_VALUE)
+ * points are played ticks times.
+ * If append is false, this replaces all existing points. If true, new points are appended to the end of the existing points.
+ * Returns 0 on success, -1 if there is not enough capacity, -2 if the block is malformed or a record is out of range.
+ */
+int apg_write_block(unsigned int engine, const uint8_t *data, size_t len, bool append) {
+    apg_engine_t *e = &s_engines[engine];
+    apg_pattern_uploaded(e);
 
-    const uint8_t current_phys = s_phys_for_logical[logical_bit];
+    if (!append) apg_clear_data(e);
+    if (e->cfg->data_format == FORMAT_PACKED) {
+        return apg_write_packed_block(e, data, len);
+    }
+    if (e->cfg->data_format == FORMAT_SAMPLED) {
+        return apg_write_sample_block(e, data, len);
+    }
+
+    if (len % APG_BLOCK_RECORD_SIZE != 0) {
+        return -2;
+    }
+
+    const size_t count = len / APG_BLOCK_RECORD_SIZE;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *record = data + i * APG_BLOCK_RECORD_SIZE;
+        uint32_t value;
+        uint32_t repeat;
+        memcpy(&value, record, sizeof(value));
+        memcpy(&repeat, record + sizeof(value), sizeof(repeat));
+
+        int res;
+        if ((value & ~APG_MAX_VALUE) == APG_BLOCK_LOOP_FLAG) {
+            res = apg_push_loop(e, value & APG_MAX_VALUE, repeat);
+        } else {
+            apg_item_t item;
+            if (!apg_decode_record(record, &item)) {
+                return -2;
+            }
+            res = apg_push_point(e, item.value, item.ticks);
+        }
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Write one period of a generator sequence as the pattern, in the sampled format (see apg_gen.c).
+ * Returns -1 if the period does not fit the pattern memory, the pattern is kept then.
+ */
+int apg_write_generated(apg_engine_t *e, const apg_gen_config_t *gen) {
+    const uint64_t period = apg_gen_period(gen);
+    if (period == 0 || period > APG_MAX_DATA_WORDS) {
+        return -1;
+    }
+
+    e->cfg->data_format = FORMAT_SAMPLED;
+    apg_clear_data(e);
+    apg_gen_state_t g;
+    apg_gen_begin(gen, &g);
+    for (uint64_t i = 0; i < period; i++) {
+        (void)apg_push_point(e, apg_gen_next(gen, &g), 0); /* a single plain run, fits as checked above */
+    }
+    return 0;
+}
+
+/**
+ * Push records from a binary block (same format as apg_write_block) into the stream ring.
+ * The block is either queued completely or not at all.
+ * Returns 0 on success, -1 if there is not enough free space, -2 if the block is malformed or a record is out of range,
+ * -3 if the generator feeds the ring.
+ */
+int apg_stream_write_block(unsigned int engine, const uint8_t *data, size_t len) {
+    apg_engine_t *e = &s_engines[engine];
+
+    if (e->cfg->gen.type != GEN_TYPE_NONE) {
+        return -3; /* the generator is the producer */
+    }
+    if (len % APG_BLOCK_RECORD_SIZE != 0) {
+        return -2;
+    }
+
+    const size_t count = len / APG_BLOCK_RECORD_SIZE;
+    const uint32_t wr = e->stream_wr;
+    if (count > apg_stream_free(engine)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        apg_item_t *item = &e->stream_ring[(wr + i) % APG_STREAM_RING_POINTS];
+        if (!apg_decode_record(data + i * APG_BLOCK_RECORD_SIZE, item)) {
+            return -2;
+        }
+        item->value = apg_map_marked(e, item->value); /* the DMA plays the ring as is */
+    }
+
+    __dmb(); /* records must be in memory before the DMA may read them */
+    e->stream_wr = wr + (uint32_t)count;
+    return 0;
+}
+
+
+void apg_set_mapping(unsigned int engine, unsigned int logical_bit, int gpio) {
+    apg_engine_t *e = &s_engines[engine];
+    const uint8_t current_phys = e->phys_for_logical[logical_bit];
 
     // If the logical bit was previously mapped to a GPIO, disable that GPIO
     if (gpio == -1) {
-        s_active_mask &= ~(1u << current_phys);
+        e->active_mask &= ~(1u << current_phys);
         return;
     }
 
-    const uint8_t logical_at_target = s_logical_for_phys[gpio];
+    const uint8_t logical_at_target = e->logical_for_phys[gpio];
 
     if ((uint8_t)gpio != current_phys) {
         /* Swap to keep mapping bijective. */
-        s_phys_for_logical[logical_bit] = (uint8_t)gpio;
-        s_phys_for_logical[logical_at_target] = current_phys;
-        s_logical_for_phys[gpio] = (uint8_t)logical_bit;
-        s_logical_for_phys[current_phys] = logical_at_target;
+        e->phys_for_logical[logical_bit] = (uint8_t)gpio;
+        e->phys_for_logical[logical_at_target] = current_phys;
+        e->logical_for_phys[gpio] = (uint8_t)logical_bit;
+        e->logical_for_phys[current_phys] = logical_at_target;
+        apg_update_map_luts(e);
+
+        /* e->data stays logical, the banks are mapped again on the next commit (see apg_materialize) */
+        e->map_dirty = true;
+    }
+
+    e->active_mask |= (1u << gpio);
+}
 
-        apg_remap_data(old_logical_for_phys);
+int apg_set_marker(unsigned int engine, int gpio, int flag_bit) {
+    apg_engine_t *e = &s_engines[engine];
+
+    if (gpio >= 0 && e->cfg->marker_gpio < 0 && !apg_marker_fits(e)) {
+        return -1; /* the loop table of the committed pattern has no room to mark its start */
     }
+    e->cfg->marker_gpio = gpio;
+    e->cfg->marker_flag = flag_bit;
+    e->map_dirty = true; /* the banks are marked at the commit */
+    return 0;
+}
 
-    s_active_mask |= (1u << gpio);
+size_t apg_data_capacity(unsigned int engine) {
+    const apg_engine_t *e = &s_engines[engine];
+    return APG_MAX_DATA_WORDS / apg_point_words(e->cfg->data_format);
 }
 
-void apg_get_mapping(unsigned int logical_bit, int *gpio) {
-    const uint8_t phys = s_phys_for_logical[logical_bit];
-    if (s_active_mask & (1u << phys)) {
+/* Select the pattern format; clears the uploaded pattern */
+void apg_set_format(unsigned int engine, SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    apg_engine_t *e = &s_engines[engine];
+    apg_pattern_uploaded(e);
+    e->cfg->data_format = format;
+    apg_clear_data(e);
+}
+
+void apg_get_mapping(unsigned int engine, unsigned int logical_bit, int *gpio) {
+    const apg_engine_t *e = &s_engines[engine];
+    const uint8_t phys = e->phys_for_logical[logical_bit];
+    if (e->active_mask & (1u << phys)) {
         *gpio = (int)phys;
     } else {
         *gpio = -1;
     }
 }
 
-int apg_read_data(apg_value_duration_t **pairs, size_t *out_count) {
-    if (pairs == NULL || out_count == NULL) {
-        return -1;
+/* Convert ticks to picoseconds (truncated), saturating at UINT64_MAX */
+static uint64_t apg_ticks_to_ps(uint64_t ticks, uint64_t clock_hz) {
+    const uint64_t sec = ticks / clock_hz;
+    if (sec >= UINT64_MAX / APG_PS_PER_SEC) {
+        return UINT64_MAX;
     }
-    if (*pairs != NULL) {
-        return -1;
-    }
-
-    *out_count = 0;
-    const uint32_t clock_hz = clock_get_hz(clk_sys);
-    size_t capacity = 0;
+    const uint64_t rest_us = (ticks % clock_hz) * 1000000u; /* in 1e-6 ticks */
+    return sec * APG_PS_PER_SEC + (rest_us / clock_hz) * 1000000u + ((rest_us % clock_hz) * 1000000u) / clock_hz;
+}
 
-    size_t out_idx = 0;
-    for (size_t i = 0; i < g_apg_data_count; i++) {
-        const uint32_t logical_value = apg_map_phys_to_logical(s_data[i].value);
-        const double duration_sec = ((double)s_data[i].ticks + 3.0) / (double)clock_hz;
+void apg_read_begin(unsigned int engine, apg_read_iter_t *it) {
+    *it = (apg_read_iter_t){.engine = engine};
+}
 
-        if (out_idx > 0 && (*pairs)[out_idx - 1].value == logical_value) {
-            (*pairs)[out_idx - 1].duration_sec += duration_sec;
-            continue;
+/**
+ * Read the next value/duration pair of the uploaded pattern, merging adjacent points with equal values.
+ * Loops over a single point are long holds (duration times repeat), loops over several points are listed once.
+ * Returns false at the end of the pattern.
+ */
+bool apg_read_next(apg_read_iter_t *it, apg_value_duration_t *pair) {
+    const apg_engine_t *e = &s_engines[it->engine];
+    const bool packed = (e->cfg->data_format == FORMAT_PACKED);
+    const bool sampled = (e->cfg->data_format == FORMAT_SAMPLED);
+    const size_t words = apg_point_words(e->cfg->data_format);
+    /* Samples are counted in 1/256 system clock cycles, the unit of the sample divider */
+    const uint64_t clock_hz = (uint64_t)clock_get_hz(clk_sys) * (sampled ? 256u : 1u);
+    bool found = false;
+
+    while (it->point < e->cfg->data_count) {
+        while (it->point >= it->loop_end) {
+            it->loop_end += e->loops[it->loop++].count / words;
         }
-
-        if (out_idx >= capacity) {
-            size_t new_capacity = capacity + 8u;
-            apg_value_duration_t *new_pairs = realloc(*pairs, new_capacity * sizeof(apg_value_duration_t));
-            if (new_pairs == NULL) {
-                return -1;
-            }
-            *pairs = new_pairs;
-            capacity = new_capacity;
+        const uint32_t *point = &e->data[it->point * words];
+        const uint32_t value = packed ? (point[0] & APG_PACKED_MAX_VALUE) : point[0];
+        const uint32_t item_ticks = packed ? (point[0] >> APG_PACKED_TICKS_SHIFT) : sampled ? 0u : point[1];
+        if (found && value != pair->value) {
+            break;
         }
 
-        (*pairs)[out_idx].value = logical_value;
-        (*pairs)[out_idx].duration_sec = duration_sec;
-        out_idx++;
+        const bool hold = (e->loops[it->loop - 1].count == words);
+        const uint64_t repeat = hold ? e->loops[it->loop - 1].repeat : 1u;
+        const uint64_t point_ticks = sampled ? e->cfg->sample_div : (uint64_t)item_ticks + APG_TICK_OVERHEAD;
+        const uint64_t ticks = (point_ticks > UINT64_MAX / repeat) ? UINT64_MAX : repeat * point_ticks;
+        const uint64_t duration_ps = apg_ticks_to_ps(ticks, clock_hz);
+
+        if (!found) {
+            pair->value = value;
+            pair->duration_ps = duration_ps;
+            found = true;
+        } else {
+            pair->duration_ps = (pair->duration_ps > UINT64_MAX - duration_ps) ? UINT64_MAX : pair->duration_ps + duration_ps;
+        }
+        it->point++;
     }
 
-    *out_count = out_idx;
-    return 0;
-}
\ No newline at end of file
+    return found;
+}
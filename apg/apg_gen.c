@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ *
+ * APG built-in pattern generators
+ *
+ * Counters, walking ones and PRBS sequences computed on the instrument instead of being uploaded.
+ * A sequence that fits the pattern memory is written to it once (apg_write_generated) and played like
+ * an uploaded pattern in the sampled format, up to one word per system clock. Longer ones (PRBS15 and
+ * up, wide counters) are fed into the stream ring by core1 (apg_gen_fill_stream), which has nothing
+ * else to do besides keeping the stream DMA fed.
+ *
+ * PRBS<k> are the ITU-T O.150 polynomials as Fibonacci LFSRs with taps at bits k-1 and m-1 of a shift
+ * register, the new bit shifted in at bit 0. As no tap is closer to the input than m bits, m bits are
+ * produced per step; the register keeps the previous bits above bit k-1, so words wider than k bits are
+ * just its low bits.
+ */
+
+#include <stdint.h>
+
+#include "hardware/sync.h"
+
+#include "apg.h"
+#include "apg_internal.h"
+
+/* Register length k and second tap m of a PRBS type, 0 for the other types */
+static __force_inline uint apg_prbs_taps(SOURCE_APGN_GENERATE_TYPE_GEN_TYPE_t type, uint *m) {
+    switch (type) {
+    case GEN_TYPE_PRBS7:
+        *m = 6u;
+        return 7u;
+    case GEN_TYPE_PRBS9:
+        *m = 5u;
+        return 9u;
+    case GEN_TYPE_PRBS15:
+        *m = 14u;
+        return 15u;
+    case GEN_TYPE_PRBS23:
+        *m = 18u;
+        return 23u;
+    case GEN_TYPE_PRBS31:
+        *m = 28u;
+        return 31u;
+    default:
+        *m = 0;
+        return 0;
+    }
+}
+
+/*
+ * Budget of core1 cycles per generated stream record (apg_gen_fill_stream and the rest of its main loop),
+ * plus one more share per PRBS step. Not measured per type; set with margin above the code path, so the
+ * sample rates allowed (apg_gen_stream_min_div) do not run the ring dry.
+ */
+#define APG_GEN_STREAM_CYCLES 96u
+#define APG_GEN_STREAM_STEP_CYCLES 16u
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        const uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Words until the sequence repeats */
+uint64_t apg_gen_period(const apg_gen_config_t *gen) {
+    uint m;
+    const uint k = apg_prbs_taps(gen->type, &m);
+    switch (gen->type) {
+    case GEN_TYPE_COUNTER:
+    case GEN_TYPE_GRAY:
+        return 1ull << gen->width;
+    case GEN_TYPE_WALKING:
+        return gen->width;
+    default:
+        if (k == 0) {
+            return 0;
+        }
+        /* 2^k - 1 bits, <width> per word */
+        return ((1ull << k) - 1u) / gcd(gen->width, (1ull << k) - 1u);
+    }
+}
+
+/* Smallest sample divider (1/256 system clock cycles per record) core1 keeps up with when feeding the stream */
+uint32_t apg_gen_stream_min_div(const apg_gen_config_t *gen) {
+    uint m;
+    const uint k = apg_prbs_taps(gen->type, &m);
+    const uint32_t steps = (k > 0) ? (gen->width + m - 1u) / m : 0u;
+    return (APG_GEN_STREAM_CYCLES + steps * APG_GEN_STREAM_STEP_CYCLES) << 8;
+}
+
+/* Start at the seed */
+void __not_in_flash_func(apg_gen_begin)(const apg_gen_config_t *gen, apg_gen_state_t *g) {
+    const uint32_t mask = (1u << gen->width) - 1u;
+    uint m;
+    const uint k = apg_prbs_taps(gen->type, &m);
+
+    g->frac = 0;
+    if (k > 0) {
+        const uint32_t reg_mask = (1u << k) - 1u;
+        g->bits = ((gen->seed & reg_mask) != 0) ? (gen->seed & reg_mask) : reg_mask; /* all zeros would lock up */
+    } else if (gen->type == GEN_TYPE_WALKING) {
+        g->bits = ((gen->seed & mask) != 0) ? (gen->seed & mask) : 1u;
+    } else {
+        g->bits = gen->seed & mask;
+    }
+}
+
+/* Next word (logical bits 0..width-1) */
+uint32_t __not_in_flash_func(apg_gen_next)(const apg_gen_config_t *gen, apg_gen_state_t *g) {
+    const uint32_t mask = (1u << gen->width) - 1u;
+    uint32_t word = (uint32_t)g->bits & mask;
+
+    switch (gen->type) {
+    case GEN_TYPE_COUNTER:
+        g->bits++;
+        return word;
+    case GEN_TYPE_GRAY:
+        g->bits++;
+        return word ^ (word >> 1);
+    case GEN_TYPE_WALKING:
+        g->bits = ((word << 1) | (word >> (gen->width - 1u))) & mask;
+        return word;
+    default: {
+        uint m;
+        const uint k = apg_prbs_taps(gen->type, &m);
+        uint64_t bits = g->bits;
+        for (uint32_t left = gen->width; left > 0;) {
+            const uint n = (left < m) ? left : m;
+            const uint64_t feedback = ((bits >> (k - n)) ^ (bits >> (m - n))) & ((1ull << n) - 1u);
+            bits = (bits << n) | feedback;
+            left -= n;
+        }
+        g->bits = bits;
+        return (uint32_t)bits & mask;
+    }
+    }
+}
+
+/**
+ * Top up the stream ring with generated records, at most max_points, one per sample period (cfg->sample_div).
+ * Records shorter than the wide program's overhead are played with its minimum duration.
+ * Must be called with the critical section held (the engine stop empties the ring and rewinds the generator).
+ */
+void __not_in_flash_func(apg_gen_fill_stream)(apg_engine_t *e, uint32_t max_points) {
+    const uint32_t wr = e->stream_wr;
+    const uint32_t free = APG_STREAM_RING_POINTS - (wr - e->stream_rd);
+    const uint32_t points = (free < max_points) ? free : max_points;
+
+    for (uint32_t i = 0; i < points; i++) {
+        apg_item_t *item = &e->stream_ring[(wr + i) % APG_STREAM_RING_POINTS];
+        e->gen.frac += e->cfg->sample_div;
+        const uint32_t cycles = e->gen.frac >> 8;
+        e->gen.frac &= 0xFFu;
+        item->ticks = (cycles > APG_TICK_OVERHEAD) ? cycles - APG_TICK_OVERHEAD : 0u;
+        item->value = apg_map_marked(e, apg_gen_next(&e->cfg->gen, &e->gen));
+    }
+
+    __dmb(); /* records must be in memory before the DMA may read them */
+    e->stream_wr = wr + points;
+}
@@ -8,21 +8,225 @@
 #ifndef APG_INTERNAL_H
 #define APG_INTERNAL_H
 
+#include <stdalign.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "pico/time.h"
+
+#include "apg.h"
+
 #define APG_IDLE_GPIO 29 // On RP2040 there are 30 GPIOs, so the two most significant bits in DBG_PADOUT are hardwired to 0
-#define APG_MAX_DATA_POINTS 1024u
+#ifndef APG_MAX_DATA_POINTS
+#define APG_MAX_DATA_POINTS 1024u /* Set by the build (APG_MAX_DATA_POINTS cache variable); 24 bytes of SRAM per point */
+#endif
+#define APG_ENGINE_DATA_POINTS (APG_MAX_DATA_POINTS / APG_ENGINES) /* The pattern memory is split evenly */
+#define APG_MAX_LOOPS 256u /* Loop descriptors per pattern bank, power of two (DMA read ring in NCYCLES mode) */
 #define APG_MAX_BITS 32u
+#define APG_MAX_VALUE 0x00FFFFFFu /* Pattern values are limited to 24 bit */
+#define APG_TICK_OVERHEAD 3u      /* Extra SM cycles per point (out, out, jmp) */
+#define APG_MAX_DATA_WORDS (APG_ENGINE_DATA_POINTS * 2u) /* Pattern memory per engine in words: wide points take 2, others 1 */
+
+/* Packed point: value in the low, ticks (duration - APG_TICK_OVERHEAD, 0 is the escape) in the high half word */
+#define APG_PACKED_MAX_VALUE 0xFFFFu
+#define APG_PACKED_MAX_TICKS 0xFFFFu
+#define APG_PACKED_TICKS_SHIFT 16u
+
+/* Sampled format: SM clock divider in 1/256 (16.8 fixed point, as the PIO CLKDIV register) */
+#define APG_SAMPLE_DIV_MIN 0x100u    /* 1.0: one sample per system clock */
+#define APG_SAMPLE_DIV_MAX 0xFFFFFFu /* 65535 + 255/256 */
+#define APG_SAMPLE_MAX_INLINE 8u     /* Longer ASCII holds are stored as a loop over one sample */
+
+/* Streaming ring buffer; the DMA read ring needs a power of two size with matching alignment */
+#define APG_STREAM_RING_BITS 14u                                                 /* log2 of the ring size in bytes */
+#define APG_STREAM_RING_POINTS ((1u << APG_STREAM_RING_BITS) / 8u)               /* 2048 points */
+#define APG_STREAM_CHUNK_POINTS (APG_STREAM_RING_POINTS / 4u)                    /* Max. points per DMA transfer */
+
+/* Gapless loops: power-of-two patterns up to the largest DMA read ring are read by the data DMA alone */
+#define APG_RING_MAX_BITS 15u /* 32 KiB */
+#ifdef DMA_CH0_TRANS_COUNT_MODE_LSB
+#define APG_DMA_ENDLESS_COUNT (DMA_CH0_TRANS_COUNT_MODE_VALUE_ENDLESS << DMA_CH0_TRANS_COUNT_MODE_LSB) /* RP2350 only */
+#endif
 
 typedef struct {
-    uint32_t value; /* PIO-ready 32-bit output word (physical bit positions) */
+    uint32_t value; /* 32-bit output word: physical bit positions (PIO-ready), logical ones in s_data */
     uint32_t ticks; /* Duration in SM clock ticks */
 } apg_item_t;
 
-extern uint8_t s_phys_for_logical[APG_MAX_BITS];
-extern uint8_t s_logical_for_phys[APG_MAX_BITS];
-extern uint32_t s_active_mask;  
-extern apg_item_t s_data[APG_MAX_DATA_POINTS];
+/* Loop descriptor, executed by the apg_seq PIO program: plays count words from data, repeat times */
+typedef struct {
+    uint32_t flags;       /* APG_LOOP_* */
+    uint32_t repeat;      /* 0: padding, skipped */
+    uint32_t count;       /* Transfer count in 32-bit words (2 per wide point, 1 otherwise), 0: skipped */
+    const uint32_t *data; /* First word of the loop */
+} apg_loop_t;
+
+#define APG_LOOP_WAIT 1u /* Wait for a trigger before the loop (APG_SEQ_TRIGGER_IRQ) */
+
+/* Generator state (see apg_gen.c) */
+typedef struct {
+    uint64_t bits; /* Counter, walking word or PRBS shift register (with history, newest bit in bit 0) */
+    uint32_t frac; /* Streaming: fraction of the sample period carried to the next record, in 1/256 ticks */
+} apg_gen_state_t;
+
+#define APG_GEN_FILL_POINTS 64u /* Generated records per apg_stream_service() call and engine, under the lock */
+
+/* DMA control block, layout matches a channel's al3_transfer_count/al3_read_addr_trig registers */
+typedef struct {
+    uint32_t count;   /* Transfer count in 32-bit words */
+    const void *addr; /* Read address */
+} apg_ctrl_block_t;
+
+/* DURATION burst ended by the sequencer (see apg_duration_plan) */
+typedef struct {
+    uint64_t units;      /* Burst length it was planned for, in SM cycles (sampled format: samples); 0: none */
+    bool exact;          /* false: the burst duration alarm ends the burst */
+    uint32_t words;      /* Loop table words for the sequencer DMA (read ring): whole passes and loops */
+    uint32_t repeat;     /* Single-loop patterns: repeats of the loop instead */
+    apg_loop_t tail[3];  /* Rest of the last loop, points of its last pass, shortened point (read from point) */
+    uint32_t point[2];   /* Shortened last point */
+} apg_dur_plan_t;
+
+/* Committed pattern bank */
+typedef struct {
+    apg_ctrl_block_t seq; /* Loop table for the sequencer DMA from the wrap on; must be first, it is copied by the loader DMA */
+    apg_ctrl_block_t entry; /* Loop table for the sequencer DMA at the start, differs from seq if a sequence links back */
+    uint32_t *mem;        /* Bank memory, APG_MAX_DATA_WORDS + 2 words */
+    const uint32_t *data; /* Points in the bank format: wide ({value, ticks}), packed or sampled (value only); in mem */
+    const apg_loop_t *loops;
+    size_t points;
+    size_t loop_count;
+    SOURCE_APGN_DATA_FORMAT_FORMAT_t format;
+    uint32_t mark[2]; /* Marked copy of the first point if the first loop repeats (see apg_mark_start) */
+    uint8_t logical_for_phys[APG_MAX_BITS]; /* Bit mapping the bank was built with (see apg_remap) */
+    uint32_t marker;                        /* Marker GPIO bit it was built with, 0 for none */
+    int marker_flag;                        /* and the flag bit driving it */
+
+    apg_dur_plan_t dur; /* Planned at the commit and when the burst duration or sample rate changes */
+} apg_bank_t;
+
+/* Physical bit of the marker GPIO (cfg->marker_gpio), 0 without a marker */
+static inline uint32_t apg_marker_mask(const apg_config_t *cfg) {
+    return (cfg->marker_gpio >= 0) ? (1u << cfg->marker_gpio) : 0u;
+}
+
+/* Words per point in the given format */
+static inline size_t apg_point_words(SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    return (format == FORMAT_WIDE) ? 2u : 1u;
+}
+
+/* Pattern generator engine, see apg.c. The upload side (pattern, mapping) is handled in apg_data.c. */
+typedef struct {
+    apg_config_t *cfg; /* Public settings, g_apg_config[index] */
+    uint index;
+
+    /* Uploaded pattern */
+    uint32_t *data;                  /* APG_MAX_DATA_WORDS, format cfg->data_format, logical bit positions */
+    apg_loop_t loops[APG_MAX_LOOPS]; /* Loop table of data */
+    size_t loop_count;
+    uint32_t loop_remaining; /* Items still to add to the loop opened last (0: no open loop, points extend a plain run) */
+    int64_t tick_error;      /* Carried conversion error in 1e-12 ticks */
+    int64_t sample_error;    /* Sampled format: carried rounding error in 1/256 ticks, within +-half a sample */
+
+    /* Segment sequence (cfg->sequence_enabled), compiled into the loop table at the commit */
+    apg_segment_t segments[APG_MAX_SEGMENTS];
+
+    /* Bit mapping */
+    uint8_t phys_for_logical[APG_MAX_BITS]; /* Logical bit -> physical GPIO/PIO bit (bijective) */
+    uint8_t logical_for_phys[APG_MAX_BITS]; /* Inverse mapping */
+    uint32_t active_mask;                   /* Physical bits enabled for output */
+    uint32_t phys_lut[4][256];              /* Logical -> physical, byte-sliced */
+    bool map_dirty; /* Mapping changed since the last commit, the banks hold stale physical values */
+
+    /* Pattern banks */
+    apg_bank_t bank[2];
+    apg_bank_t *volatile active_bank; /* Bank being played */
+    volatile bool swap_pending;       /* Committed bank not yet picked up by the DMA */
+    bool gapless_running;             /* Playing a gapless loop, which does not pick up a committed bank */
+
+    /* Streaming */
+    apg_item_t *stream_ring;
+    volatile uint32_t stream_wr; /* Free-running write position in points (written by the producer only) */
+    volatile uint32_t stream_rd; /* Free-running position up to which the DMA has read the ring */
+    alignas(16) uint32_t stream_cb[4]; /* Control block for the data DMA al1 registers */
+    volatile bool stream_running;
+    bool stream_armed;         /* Next chunk armed (data DMA chains to control DMA) */
+    bool stream_played;        /* Something was played since the trigger */
+    uint32_t stream_cur_end;   /* Ring position after the chunk in flight */
+    uint32_t stream_next_end;  /* Ring position after the armed chunk */
+    volatile uint32_t stream_underruns;
+    apg_gen_state_t gen; /* Generator feeding the ring (cfg->gen), back at the seed whenever the engine stops */
+
+    /* Idle point and burst tails */
+    apg_item_t idle_point;
+    alignas(16) apg_loop_t idle_loop;        /* Plays idle_point once, appended after bursts */
+    uint32_t idle_packed[3];                 /* Escape word + idle_point, for the packed program */
+    alignas(16) apg_loop_t idle_packed_loop; /* Plays idle_packed once, appended after packed bursts */
+    alignas(16) apg_loop_t idle_sample_loop; /* Plays the idle_point value once, appended after sampled bursts */
+    alignas(16) apg_loop_t burst_loop;       /* Single-loop patterns in burst mode: the loop n-times */
+    alignas(16) apg_loop_t dur_tail[4];      /* DURATION burst: the planned tail of the active bank, then idle */
+    uint32_t dur_point[2];                   /* and the shortened point it plays */
+    alarm_id_t burst_duration_alarm;
+    bool burst_exact; /* DURATION burst ended by the sequencer, no alarm */
+    int64_t int_period; /* INT timer period the main SM was last armed in, -1: not armed since the stop */
+
+    /*
+     * Hardware and what it is running, kept across a reset (see apg_init_module); must stay last.
+     * The SMs, main programs and DMA channels are claimed once. The trigger program and the timer SM follow
+     * the trigger source (apg_trig_load, apg_int_timer_update); trig_armed and sm_format describe the main SM.
+     */
+    PIO pio;
+    int sm;
+    int seq_sm;
+    int prog_offset;
+    int seq_prog_offset;
+    int trig_prog_offset; /* apg_trig program, loaded while the trigger source is EXT or INT (in hardware) */
+    bool trig_armed;      /* Main SM waits in apg_trig for the hardware trigger */
+    bool trig_dispatch;   /* The software dispatch of the trigger it starts on is still to come (see apg_engine_prepare_run) */
+    int timer_sm;         /* apg_timer SM and program, claimed while the trigger source is INT */
+    int timer_prog_offset;
+    SOURCE_APGN_DATA_FORMAT_FORMAT_t sm_format; /* Entry point the main SM runs */
+    int dma_chan;
+    int dma_ctrl_chan;
+    int dma_seq_chan;
+    int dma_reload_chan;
+    int dma_loader_chan;
+    dma_channel_config dma_data_cfg;
+    dma_channel_config dma_data_stream_cfg;
+    dma_channel_config dma_ctrl_seq_cfg;
+    dma_channel_config dma_ctrl_stream_cfg;
+    dma_channel_config dma_seq_cfg;
+    dma_channel_config dma_reload_cont_cfg;
+    dma_channel_config dma_reload_tail_cfg;
+    bool initialized;
+} apg_engine_t;
+
+extern apg_engine_t s_engines[APG_ENGINES];
+
+bool apg_marker_fits(const apg_engine_t *e);
+
+/* Bank that is not being played, filled by the next commit */
+static inline apg_bank_t *apg_spare_bank(apg_engine_t *e) {
+    return (e->active_bank == &e->bank[0]) ? &e->bank[1] : &e->bank[0];
+}
+
+void apg_data_init(apg_engine_t *e);
+int apg_compile_sequence(const apg_engine_t *e, apg_loop_t *loops, size_t *wrap);
+int apg_rescale_ticks(unsigned int engine, uint32_t old_hz, uint32_t new_hz, bool apply);
+int apg_write_generated(apg_engine_t *e, const apg_gen_config_t *gen);
+void apg_update_map_luts(apg_engine_t *e);
+uint32_t apg_map_logical_to_phys(const apg_engine_t *e, uint32_t logical_word);
+uint32_t apg_map_marked(const apg_engine_t *e, uint32_t logical_word);
+void apg_update_remap_lut(const apg_engine_t *e, const apg_bank_t *bank);
+uint32_t apg_remap_marked(const apg_engine_t *e, const apg_bank_t *bank, uint32_t phys_word);
+
+uint64_t apg_gen_period(const apg_gen_config_t *gen);
+uint32_t apg_gen_stream_min_div(const apg_gen_config_t *gen);
+void apg_gen_begin(const apg_gen_config_t *gen, apg_gen_state_t *g);
+uint32_t apg_gen_next(const apg_gen_config_t *gen, apg_gen_state_t *g);
+void apg_gen_fill_stream(apg_engine_t *e, uint32_t max_points);
 
 
 #endif /* APG_INTERNAL_H */
\ No newline at end of file
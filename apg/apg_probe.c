@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ *
+ * APG loopback probe
+ *
+ * Measures the periods of a GPIO with a spare SM of an engine's PIO block (apg_probe program), so
+ * the timing on the pins can be checked, e.g. the jitter at the pattern wrap of a clock-like pattern.
+ * The periods are captured by DMA, so none is missed while the CPU waits. The SM, program and DMA
+ * channel are only claimed for the measurement.
+ */
+
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "pico/time.h"
+
+#include "apg.h"
+#include "apg.pio.h"
+#include "apg_internal.h"
+
+#define APG_PROBE_OVERHEAD 4u           /* Cycles per period besides the 2-cycle counts (apg_probe program) */
+#define APG_PROBE_TIMEOUT_US 5000ull /* Longest the SCPI handler (core0, network) is held up */
+
+static uint32_t s_probe_buf[APG_PROBE_MAX_PERIODS + 1u]; /* The first capture is a partial period */
+
+int apg_probe_periods(unsigned int engine, unsigned int gpio, uint32_t periods, apg_probe_result_t *result) {
+    PIO pio = s_engines[engine].pio;
+    const uint32_t captures = ((periods < APG_PROBE_MAX_PERIODS) ? periods : APG_PROBE_MAX_PERIODS) + 1u;
+
+    const int sm = pio_claim_unused_sm(pio, false);
+    if (sm < 0) {
+        return -1;
+    }
+    if (!pio_can_add_program(pio, &apg_probe_program)) {
+        pio_sm_unclaim(pio, (uint)sm);
+        return -3; /* the trigger and timer programs (EXT, INT) leave no room */
+    }
+    const uint offset = (uint)pio_add_program(pio, &apg_probe_program);
+    const int chan = dma_claim_unused_channel(false);
+    if (chan < 0) {
+        pio_remove_program(pio, &apg_probe_program, offset);
+        pio_sm_unclaim(pio, (uint)sm);
+        return -1;
+    }
+
+    pio_sm_config c = apg_probe_program_get_default_config(offset);
+    sm_config_set_jmp_pin(&c, gpio);
+    pio_sm_init(pio, (uint)sm, offset, &c);
+
+    dma_channel_config dma_cfg = dma_channel_get_default_config((uint)chan);
+    channel_config_set_transfer_data_size(&dma_cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_cfg, false);
+    channel_config_set_write_increment(&dma_cfg, true);
+    channel_config_set_dreq(&dma_cfg, pio_get_dreq(pio, (uint)sm, false));
+    dma_channel_configure((uint)chan, &dma_cfg, s_probe_buf, &pio->rxf[sm], captures, true);
+
+    pio_sm_set_enabled(pio, (uint)sm, true);
+    const uint64_t deadline = time_us_64() + APG_PROBE_TIMEOUT_US;
+    while (dma_channel_is_busy((uint)chan) && time_us_64() < deadline) {
+        tight_loop_contents();
+    }
+    pio_sm_set_enabled(pio, (uint)sm, false);
+
+    const uint32_t captured = captures - (dma_hw->ch[chan].transfer_count & DMA_CH0_TRANS_COUNT_COUNT_BITS);
+    dma_channel_abort((uint)chan);
+    dma_channel_unclaim((uint)chan);
+    pio_remove_program(pio, &apg_probe_program, offset);
+    pio_sm_unclaim(pio, (uint)sm);
+
+    if (captured < 2u) {
+        return -2;
+    }
+
+    result->periods = captured - 1u;
+    result->min_cycles = UINT32_MAX;
+    result->max_cycles = 0;
+    for (uint32_t i = 1; i < captured; i++) {
+        const uint32_t cycles = 2u * ~s_probe_buf[i] + APG_PROBE_OVERHEAD;
+        if (cycles < result->min_cycles) {
+            result->min_cycles = cycles;
+        }
+        if (cycles > result->max_cycles) {
+            result->max_cycles = cycles;
+        }
+    }
+    return 0;
+}
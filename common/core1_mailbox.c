@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ *
+ * Core0 to core1 mailbox
+ *
+ * The SCPI handlers run on core0 (mg_mgr_poll), the trigger alarms, PWM wrap IRQ and APG services on
+ * core1. Functions that change the trigger, output and APG hardware hand themselves over to core1 with
+ * core1_call(), so the NVIC enables, the alarm pool timers, the GPIO and PWM state and the APG state
+ * machines and DMA are only changed by the core that runs them, between two passes of its main loop.
+ * The APG setters walk the patterns on core0 and hand over only the step that touches the hardware.
+ *
+ * Two single-producer single-consumer rings in shared memory: commands from core0 to core1 and the
+ * results back in the same order. Each index is written by one core only. The SIO FIFO is not used,
+ * as its IRQ on core1 serves flash_safe_execute (multicore lockout).
+ */
+
+#include <stdint.h>
+
+#include "hardware/sync.h"
+#include "pico/platform.h"
+
+#include "core1_mailbox.h"
+
+#define CORE1_MAILBOX_SLOTS 4u /* core0 waits for each call, so one is in use at a time */
+
+typedef struct {
+    core1_call_fn_t fn;
+    void *arg;
+} core1_cmd_t;
+
+static core1_cmd_t s_cmd[CORE1_MAILBOX_SLOTS];
+static int s_done[CORE1_MAILBOX_SLOTS];
+static volatile uint32_t s_cmd_wr;  /* core0 */
+static volatile uint32_t s_cmd_rd;  /* core1 */
+static volatile uint32_t s_done_wr; /* core1 */
+static volatile uint32_t s_done_rd; /* core0 */
+
+int __not_in_flash_func(core1_call)(core1_call_fn_t fn, void *arg) {
+    if (get_core_num() == 1u) {
+        return fn(arg);
+    }
+
+    const uint32_t wr = s_cmd_wr;
+    while (wr - s_cmd_rd >= CORE1_MAILBOX_SLOTS) {
+        tight_loop_contents();
+    }
+    s_cmd[wr % CORE1_MAILBOX_SLOTS] = (core1_cmd_t){fn, arg};
+    __dmb(); /* the command must be in memory before core1 may read it */
+    s_cmd_wr = wr + 1u;
+
+    const uint32_t rd = s_done_rd;
+    while (s_done_wr == rd) {
+        tight_loop_contents();
+    }
+    __dmb();
+    const int result = s_done[rd % CORE1_MAILBOX_SLOTS];
+    s_done_rd = rd + 1u;
+    return result;
+}
+
+void __not_in_flash_func(core1_mailbox_service)(void) {
+    while (s_cmd_rd != s_cmd_wr) {
+        const uint32_t rd = s_cmd_rd;
+        __dmb();
+        const core1_cmd_t cmd = s_cmd[rd % CORE1_MAILBOX_SLOTS];
+        const int result = cmd.fn(cmd.arg);
+
+        const uint32_t wr = s_done_wr;
+        s_done[wr % CORE1_MAILBOX_SLOTS] = result;
+        __dmb(); /* the result must be in memory before core0 may read it */
+        s_done_wr = wr + 1u;
+        s_cmd_rd = rd + 1u;
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ */
+
+#ifndef CORE1_MAILBOX_H
+#define CORE1_MAILBOX_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*core1_call_fn_t)(void *arg);
+
+/**
+ * Run fn(arg) on core1 and return its result. From core0 the call is posted to the mailbox and waited
+ * for, so arg may point to the caller's stack; on core1 it is called directly.
+ * core0 spins without a timeout until core1 has run it, so it must never be called from core0 with a
+ * critical section held that core1 takes in its main loop (the APG one: apg_stream_service,
+ * apg_trigger_service); fn should be short, as it holds up that loop.
+ */
+int core1_call(core1_call_fn_t fn, void *arg);
+
+/* Run the calls posted by core0 (core1 main loop) */
+void core1_mailbox_service(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CORE1_MAILBOX_H */
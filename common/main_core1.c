@@ -8,12 +8,15 @@
  */
 
 #include "pico.h"
+#include "pico/flash.h"
 
 #include "apg/apg.h"
 #include "pwm/pwm.h"
 
+#include "core1_mailbox.h"
 #include "main_core1.h"
 #include "output.h"
+#include "state_store.h"
 #include "trigger.h"
 
 void init_all() {
@@ -23,23 +26,48 @@ void init_all() {
     apg_init_module();
 }
 
-void abort_all(void) {
+static int abort_all_core1(void *arg) {
+    (void)arg;
     trigger_abort();
     pwm_abort();
     apg_abort();
+    return 0;
 }
 
-void reset_to_defaults_all(void) {
+void abort_all(void) {
+    (void)core1_call(abort_all_core1, NULL);
+}
+
+static int reset_to_defaults_all_core1(void *arg) {
+    (void)arg;
     g_output_state.enabled = false;
     output_apply_state();
     abort_all();
-    init_all();
+    pwm_init_module(); /* installs its IRQ handler on this core */
+    return 0;
+}
+
+/*
+ * Everything is stopped on core1 first; the rest hands its hardware parts over itself, so clearing the APG
+ * pattern memory and lookup tables (after the engines were reset on core1) does not hold up its main loop.
+ */
+void reset_to_defaults_all(void) {
+    (void)core1_call(reset_to_defaults_all_core1, NULL);
+    output_init();
+    trigger_init();
+    apg_init_module();
 }
 
 void main_core1_entry(void) {
+    flash_safe_execute_core_init(); /* let core0 pause this core for flash writes and clock changes */
     init_all();
+    state_recall_power_on();
 
     while (true) {
+        apg_stream_service(); /* keep the APG stream DMA fed */
+        apg_trigger_service(); /* re-arm the APG for the external trigger */
+        trigger_service();     /* external trigger for PWM */
+        core1_mailbox_service(); /* calls handed over by the SCPI handlers on core0 */
         tight_loop_contents();
     }
 }
@@ -12,6 +12,7 @@
 extern "C" {
 #endif
 
+/* Both run on core1 (see core1_call) */
 void abort_all(void);
 
 void reset_to_defaults_all(void);
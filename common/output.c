@@ -9,6 +9,7 @@
 
 #include "hardware/gpio.h"
 
+#include "core1_mailbox.h"
 #include "output.h"
 #include "pwm/pwm_gpio.h"
 #include "apg/apg.h"
@@ -20,10 +21,18 @@ void output_init(void) {
     output_apply_state();
 }
 
-void output_apply_state(void) {
+static int output_apply_state_core1(void *arg) {
+    (void)arg;
     /* Centralize the output state control */
     pwm_outputs_update();
     apg_outputs_update();
+    return 0;
+}
+
+/* On core1, so the pins do not change under a PWM or APG start; the APG patterns are mapped before, on this core */
+void output_apply_state(void) {
+    apg_outputs_prepare();
+    (void)core1_call(output_apply_state_core1, NULL);
 }
 
 void output_detach(int gpio) {
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ *
+ * Instrument state slots in flash (*SAV and *RCL)
+ *
+ * The state is a list of SRAM regions (trigger and PWM settings, per APG engine its settings, upload
+ * side and uploaded pattern, see apg_state_regions). A slot holds a header page followed by the
+ * regions, so recalling is a memcpy from XIP per region plus the fixups a SCPI setter would do. The
+ * system clock is part of the state, as the saved ticks are counted in it.
+ * Pointers within the regions (APG loop tables) stay valid because the header carries a fingerprint
+ * of the region addresses and sizes: a firmware that moves or resizes them treats the slots as empty.
+ *
+ * Flash layout from the end: the power-on sector, then slot 0, 1, ... of equal size.
+ * The flash is written page by page through flash_safe_execute(), which pauses the other core (see
+ * main_core1_entry) and keeps interrupts off only for one sector erase or page program at a time.
+ * The header is programmed last, so an interrupted save leaves the slot empty.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hardware/clocks.h"
+#include "hardware/flash.h"
+#include "pico/flash.h"
+
+#include "apg/apg.h"
+#include "pwm/pwm.h"
+
+#include "main_core1.h"
+#include "state_store.h"
+#include "sysclock.h"
+#include "trigger.h"
+
+#define STATE_MAGIC 0x53415633u     /* "SAV3"; bump when the meaning of saved fields changes */
+#define STATE_PON_MAGIC 0x504f4e31u /* "PON1" */
+#define STATE_MAX_REGIONS (2u + APG_ENGINES * APG_STATE_REGIONS)
+#define STATE_FLASH_TIMEOUT_MS 100u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t fingerprint;
+    uint32_t clock_hz; /* System clock the saved ticks are counted in */
+    uint32_t size[STATE_MAX_REGIONS];
+} state_header_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t slot;
+} state_power_on_t;
+
+static_assert(sizeof(state_header_t) <= FLASH_PAGE_SIZE, "state header must fit a flash page");
+
+extern char __flash_binary_end;
+
+/* Page being programmed and its flash offset (flash_safe_execute passes a single pointer) */
+static uint8_t s_page[FLASH_PAGE_SIZE];
+static uint32_t s_flash_offset;
+
+static size_t state_regions(state_region_t *regions) {
+    size_t n = 0;
+
+    /* Settings up to the runtime members */
+    const size_t trigger_size = offsetof(trigger_config_t, alarm_pool);
+    regions[n++] = (state_region_t){&g_trigger_config, trigger_size, trigger_size};
+    const size_t pwm_size = offsetof(pwm_config_t, pwm_enable_mask) - offsetof(pwm_config_t, op_mode);
+    regions[n++] = (state_region_t){&g_pwm_config.op_mode, pwm_size, pwm_size};
+
+    for (unsigned int engine = 0; engine < APG_ENGINES; engine++) {
+        n += apg_state_regions(engine, &regions[n]);
+    }
+    return n;
+}
+
+static inline size_t state_align(size_t size) {
+    return (size + 3u) & ~(size_t)3u;
+}
+
+/* FNV-1a over the region layout */
+static uint32_t state_fingerprint(const state_region_t *regions, size_t count) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t words[2] = {(uint32_t)(uintptr_t)regions[i].addr, (uint32_t)regions[i].max_size};
+        const uint8_t *bytes = (const uint8_t *)words;
+        for (size_t b = 0; b < sizeof(words); b++) {
+            hash = (hash ^ bytes[b]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/* Flash offset of a slot, or 0 if the slots would overlap the firmware */
+static uint32_t state_slot_offset(const state_region_t *regions, size_t count, unsigned int slot) {
+    size_t size = FLASH_PAGE_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        size += state_align(regions[i].max_size);
+    }
+    size = (size + FLASH_SECTOR_SIZE - 1u) & ~(size_t)(FLASH_SECTOR_SIZE - 1u);
+
+    const size_t reserved = FLASH_SECTOR_SIZE + STATE_SAVE_SLOTS * size;
+    const size_t binary_end = (size_t)((uintptr_t)&__flash_binary_end - XIP_BASE);
+    if (reserved > PICO_FLASH_SIZE_BYTES - binary_end) {
+        return 0;
+    }
+    return (uint32_t)(PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE - (slot + 1u) * size);
+}
+
+static void state_erase_sector_unsafe(void *param) {
+    (void)param;
+    flash_range_erase(s_flash_offset, FLASH_SECTOR_SIZE);
+}
+
+static void state_program_page_unsafe(void *param) {
+    (void)param;
+    flash_range_program(s_flash_offset, s_page, FLASH_PAGE_SIZE);
+}
+
+static int state_erase_sector(uint32_t offset) {
+    s_flash_offset = offset;
+    return (flash_safe_execute(state_erase_sector_unsafe, NULL, STATE_FLASH_TIMEOUT_MS) == PICO_OK) ? 0 : -2;
+}
+
+static int state_program_page(uint32_t offset) {
+    s_flash_offset = offset;
+    return (flash_safe_execute(state_program_page_unsafe, NULL, STATE_FLASH_TIMEOUT_MS) == PICO_OK) ? 0 : -2;
+}
+
+/* Sequential writer through s_page */
+typedef struct {
+    uint32_t offset; /* Flash offset of s_page */
+    size_t fill;
+} state_writer_t;
+
+static int state_write(state_writer_t *w, const void *src, size_t len) {
+    const uint8_t *p = src;
+    while (len > 0) {
+        const size_t chunk = (len < FLASH_PAGE_SIZE - w->fill) ? len : FLASH_PAGE_SIZE - w->fill;
+        memcpy(&s_page[w->fill], p, chunk);
+        w->fill += chunk;
+        p += chunk;
+        len -= chunk;
+        if (w->fill == FLASH_PAGE_SIZE) {
+            if (state_program_page(w->offset) != 0) {
+                return -2;
+            }
+            w->offset += FLASH_PAGE_SIZE;
+            w->fill = 0;
+        }
+    }
+    return 0;
+}
+
+int state_save(unsigned int slot) {
+    state_region_t regions[STATE_MAX_REGIONS];
+    const size_t count = state_regions(regions);
+    if (slot >= STATE_SAVE_SLOTS) {
+        return -1;
+    }
+    const uint32_t offset = state_slot_offset(regions, count, slot);
+    if (offset == 0) {
+        return -2;
+    }
+
+    state_header_t header = {.magic = STATE_MAGIC, .fingerprint = state_fingerprint(regions, count), .clock_hz = clock_get_hz(clk_sys)};
+    size_t size = FLASH_PAGE_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        header.size[i] = (uint32_t)regions[i].size;
+        size += state_align(regions[i].size);
+    }
+
+    /* Erase the used sectors; the header sector first, so the slot reads as empty from now on */
+    for (uint32_t sector = 0; sector < size; sector += FLASH_SECTOR_SIZE) {
+        if (state_erase_sector(offset + sector) != 0) {
+            return -2;
+        }
+    }
+
+    state_writer_t w = {.offset = offset + FLASH_PAGE_SIZE, .fill = 0};
+    static const uint8_t pad[3] = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (state_write(&w, regions[i].addr, regions[i].size) != 0 ||
+            state_write(&w, pad, state_align(regions[i].size) - regions[i].size) != 0) {
+            return -2;
+        }
+    }
+    if (w.fill > 0) {
+        memset(&s_page[w.fill], 0xff, FLASH_PAGE_SIZE - w.fill);
+        if (state_program_page(w.offset) != 0) {
+            return -2;
+        }
+    }
+
+    memset(s_page, 0xff, sizeof(s_page));
+    memcpy(s_page, &header, sizeof(header));
+    return state_program_page(offset);
+}
+
+int state_recall(unsigned int slot) {
+    state_region_t regions[STATE_MAX_REGIONS];
+    const size_t count = state_regions(regions);
+    if (slot >= STATE_SAVE_SLOTS) {
+        return -1;
+    }
+    const uint32_t offset = state_slot_offset(regions, count, slot);
+    if (offset == 0) {
+        return -2;
+    }
+
+    const state_header_t *header = (const state_header_t *)(XIP_BASE + offset);
+    if (header->magic != STATE_MAGIC || header->fingerprint != state_fingerprint(regions, count)) {
+        return -2;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (header->size[i] > regions[i].max_size) {
+            return -2;
+        }
+    }
+
+    /* Start from a clean, stopped instrument at the saved clock (nothing to re-derive yet), then copy the settings back */
+    reset_to_defaults_all();
+    if (sysclock_set_hz(header->clock_hz) != 0) {
+        return -2;
+    }
+    const uint8_t *src = (const uint8_t *)header + FLASH_PAGE_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(regions[i].addr, src, header->size[i]);
+        src += state_align(header->size[i]);
+    }
+
+    /* Derived state, as the setters would update it */
+    trigger_update_config();
+    g_pwm_config.reload_runtime_param = true;
+    pwm_update_config();
+    for (unsigned int engine = 0; engine < APG_ENGINES; engine++) {
+        apg_state_recalled(engine);
+    }
+    abort_all(); /* restarts generation if the trigger source is Immediate */
+    return 0;
+}
+
+int state_get_power_on_slot(void) {
+    const state_power_on_t *pon = (const state_power_on_t *)(XIP_BASE + PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE);
+    if (pon->magic != STATE_PON_MAGIC || pon->slot < 0 || pon->slot >= (int32_t)STATE_SAVE_SLOTS) {
+        return -1;
+    }
+    return (int)pon->slot;
+}
+
+int state_set_power_on_slot(int slot) {
+    if (slot < -1 || slot >= (int)STATE_SAVE_SLOTS) {
+        return -1;
+    }
+    const uint32_t offset = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
+    if (state_erase_sector(offset) != 0) {
+        return -2;
+    }
+    if (slot < 0) {
+        return 0; /* erased: none */
+    }
+
+    const state_power_on_t pon = {.magic = STATE_PON_MAGIC, .slot = slot};
+    memset(s_page, 0xff, sizeof(s_page));
+    memcpy(s_page, &pon, sizeof(pon));
+    return state_program_page(offset);
+}
+
+/* Recall the power-on slot, if any; an empty or stale slot keeps the defaults */
+void state_recall_power_on(void) {
+    const int slot = state_get_power_on_slot();
+    if (slot >= 0) {
+        (void)state_recall((unsigned int)slot);
+    }
+}
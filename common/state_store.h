@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ */
+
+#ifndef STATE_STORE_H
+#define STATE_STORE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef STATE_SAVE_SLOTS
+#define STATE_SAVE_SLOTS 4u /* Set by the build (STATE_SAVE_SLOTS cache variable); *SAV and *RCL slots in flash */
+#endif
+
+/* A block of SRAM holding saved state: size bytes are saved, up to max_size are recalled */
+typedef struct {
+    void *addr;
+    size_t size;
+    size_t max_size;
+} state_region_t;
+
+/**
+ * Instrument state slots (*SAV and *RCL) in the last flash sectors, see state_store.c.
+ * Saving requires the outputs to be off. Recalling resets the instrument (like *RST, outputs off)
+ * and copies the saved state back straight from flash.
+ * Return codes: 0 ok, -1 slot out of range, -2 flash error or no room (save) / slot empty or stale (recall).
+ */
+int state_save(unsigned int slot);
+int state_recall(unsigned int slot);
+
+/* Slot recalled at power-on (state_recall_power_on), -1: none */
+int state_get_power_on_slot(void);
+int state_set_power_on_slot(int slot);
+void state_recall_power_on(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATE_STORE_H */
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ *
+ * System clock control
+ *
+ * Changes clk_sys at runtime. Everything counted in system clock cycles is re-derived afterwards from
+ * the durations it stands for: APG pattern ticks and sample divider (apg_clock_changed), PWM divider,
+ * wrap and deadtime (pwm_update_config), trigger delay and INT period of the APG (trigger_update_config).
+ * The software trigger delays, intervals and burst durations run on the microsecond timer, which is
+ * clocked from clk_ref and not affected.
+ *
+ * The core voltage is raised before and lowered after the switch. The flash clock divider is adjusted
+ * so the flash never runs faster than at boot. Both the switch and the flash timing change run with
+ * the other core paused (flash_safe_execute), as it executes from flash as well.
+ */
+
+#include "hardware/clocks.h"
+#include "hardware/structs/qmi.h"
+#include "hardware/vreg.h"
+#include "pico/flash.h"
+#include "pico/time.h"
+
+#include "apg/apg.h"
+#include "pwm/pwm.h"
+
+#include "main_core1.h"
+#include "sysclock.h"
+#include "trigger.h"
+
+#define SYSCLOCK_SWITCH_TIMEOUT_MS 100u
+#define SYSCLOCK_VREG_SETTLE_MS 10u
+
+/* Flash timing at boot, captured before the first switch */
+static uint32_t s_boot_hz;
+static uint32_t s_boot_clkdiv;
+static uint32_t s_boot_rxdelay;
+
+static uint32_t s_target_khz; /* flash_safe_execute passes a single pointer */
+
+/* Core voltage for a system clock */
+static enum vreg_voltage sysclock_voltage(uint32_t hz) {
+    if (hz > 250000000u) {
+        return VREG_VOLTAGE_1_30;
+    }
+    if (hz > 200000000u) {
+        return VREG_VOLTAGE_1_20;
+    }
+    if (hz > 150000000u) {
+        return VREG_VOLTAGE_1_15;
+    }
+    return VREG_VOLTAGE_DEFAULT;
+}
+
+/**
+ * Set the flash timing for a system clock: the divider keeps the flash clock at or below the one at boot
+ * (never below the boot divider), the RX delay scales with it, so it samples at the same point of the
+ * flash clock cycle. Runs from RAM, as it changes the timing of the flash being executed from.
+ */
+static void __not_in_flash_func(sysclock_set_flash_timing)(uint32_t hz) {
+    const uint64_t scaled = (uint64_t)s_boot_clkdiv * hz;
+    uint32_t clkdiv = (uint32_t)((scaled + s_boot_hz - 1u) / s_boot_hz);
+    if (clkdiv < s_boot_clkdiv) {
+        clkdiv = s_boot_clkdiv;
+    }
+    if (clkdiv > (QMI_M0_TIMING_CLKDIV_BITS >> QMI_M0_TIMING_CLKDIV_LSB)) {
+        clkdiv = QMI_M0_TIMING_CLKDIV_BITS >> QMI_M0_TIMING_CLKDIV_LSB;
+    }
+    uint32_t rxdelay = (s_boot_rxdelay * clkdiv + s_boot_clkdiv - 1u) / s_boot_clkdiv;
+    if (rxdelay > (QMI_M0_TIMING_RXDELAY_BITS >> QMI_M0_TIMING_RXDELAY_LSB)) {
+        rxdelay = QMI_M0_TIMING_RXDELAY_BITS >> QMI_M0_TIMING_RXDELAY_LSB;
+    }
+
+    hw_write_masked(&qmi_hw->m[0].timing,
+                    (clkdiv << QMI_M0_TIMING_CLKDIV_LSB) | (rxdelay << QMI_M0_TIMING_RXDELAY_LSB),
+                    QMI_M0_TIMING_CLKDIV_BITS | QMI_M0_TIMING_RXDELAY_BITS);
+}
+
+/* Runs with the other core paused and interrupts off; the flash is slowed down before the clock goes up */
+static void sysclock_switch_unsafe(void *param) {
+    (void)param;
+    const uint32_t hz = s_target_khz * 1000u;
+
+    if (hz > clock_get_hz(clk_sys)) {
+        sysclock_set_flash_timing(hz);
+        set_sys_clock_khz(s_target_khz, true);
+    } else {
+        set_sys_clock_khz(s_target_khz, true);
+        sysclock_set_flash_timing(hz);
+    }
+}
+
+int sysclock_set_hz(uint32_t hz) {
+    uint vco;
+    uint postdiv1;
+    uint postdiv2;
+    if (hz < SYSCLOCK_MIN_HZ || hz > SYSCLOCK_MAX_HZ || hz % 1000u != 0 ||
+        !check_sys_clock_khz(hz / 1000u, &vco, &postdiv1, &postdiv2)) {
+        return -1;
+    }
+
+    const uint32_t old_hz = clock_get_hz(clk_sys);
+    if (hz == old_hz) {
+        return 0;
+    }
+    if (apg_clock_check(old_hz, hz) != 0) {
+        return -2;
+    }
+
+    if (s_boot_hz == 0) {
+        s_boot_hz = old_hz;
+        s_boot_clkdiv = (qmi_hw->m[0].timing & QMI_M0_TIMING_CLKDIV_BITS) >> QMI_M0_TIMING_CLKDIV_LSB;
+        s_boot_rxdelay = (qmi_hw->m[0].timing & QMI_M0_TIMING_RXDELAY_BITS) >> QMI_M0_TIMING_RXDELAY_LSB;
+    }
+
+    /* Nothing may (re)start on the old timing: hold the trigger source at BUS while switching */
+    const TRIGGER_SOURCE_TRG_SOURCE_t source = g_trigger_config.source;
+    g_trigger_config.source = TRG_SOURCE_BUS;
+    trigger_update_config();
+    abort_all();
+
+    const enum vreg_voltage voltage = sysclock_voltage(hz);
+    if (voltage > vreg_get_voltage()) {
+        vreg_set_voltage(voltage);
+        sleep_ms(SYSCLOCK_VREG_SETTLE_MS);
+    }
+
+    s_target_khz = hz / 1000u;
+    const int res = flash_safe_execute(sysclock_switch_unsafe, NULL, SYSCLOCK_SWITCH_TIMEOUT_MS);
+
+    if (res == PICO_OK && voltage < vreg_get_voltage()) {
+        vreg_set_voltage(voltage);
+    }
+
+    /* Re-derive from the durations (no-op if the switch did not happen) */
+    const uint32_t new_hz = clock_get_hz(clk_sys);
+    if (new_hz != old_hz) {
+        pwm_update_config();
+        apg_clock_changed(old_hz, new_hz);
+    }
+
+    g_trigger_config.source = source;
+    trigger_update_config();
+    abort_all(); /* restarts generation if the trigger source is Immediate */
+    return (res == PICO_OK) ? 0 : -3;
+}
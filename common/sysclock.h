@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 honsma235
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * See the repository LICENSE file for the full text.
+ */
+
+#ifndef SYSCLOCK_H
+#define SYSCLOCK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SYSCLOCK_MIN_HZ 48000000u
+#define SYSCLOCK_MAX_HZ 300000000u
+
+/**
+ * Change the system clock (:SYSTem:CLOCk), re-deriving everything counted in system clock cycles.
+ * Generation is stopped for the switch and restarted afterwards (Immediate/Internal trigger).
+ * Returns 0 on success, -1 if the frequency cannot be set exactly (whole kHz, PLL), -2 if an uploaded
+ * APG pattern does not fit at the new clock, -3 if the other core could not be paused.
+ */
+int sysclock_set_hz(uint32_t hz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SYSCLOCK_H */
@@ -5,12 +5,27 @@
  * See the repository LICENSE file for the full text.
  *
  * Central trigger manager
+ *
+ * Latency statistics (:SYSTem:TRIGger:STATistics): each software dispatch that starts PWM or an engine is
+ * timestamped on the shared 64-bit microsecond timer once they have been started, against the trigger event
+ * (BUS: *TRG handled, INT: the timer period due, EXT: the edge, timestamped by the GPIO interrupt on core1; a
+ * level held since: the retrigger due) plus the delay. The APG engines armed in PIO (EXT and INT) start a
+ * fixed number of cycles after the event; apg_trigger_service() records that latency when it sees them start.
  */
 
+#include <math.h>
+#include <string.h>
+
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "pico/sync.h"
 #include "pico/time.h"
 
 #include "pwm/pwm.h"
+#include "pwm/pwm_gpio.h"
 #include "apg/apg.h"
+#include "core1_mailbox.h"
 #include "trigger.h"
 
 trigger_config_t g_trigger_config;
@@ -18,15 +33,30 @@ trigger_config_t g_trigger_config;
 static repeating_timer_t s_int_timer;
 static bool s_int_timer_active = false;
 static alarm_id_t s_delay_alarm = -1;
+static uint64_t s_event_us;       /* Event the delay alarm is pending for */
+static uint64_t s_int_due_us;     /* Last INT period the software timer was due */
+static uint64_t s_int_interval_us;
+static uint32_t s_int_sw_skipped;       /* INT periods skipped by the software timer per period it runs */
+static volatile uint32_t s_int_missed;  /* INT periods PWM or the software-started engines missed */
+static uint64_t s_level_next_us;  /* EXT HIGH/LOW: next retrigger while the level holds */
+static int s_ext_irq_gpio = -1;           /* EXT input the edge interrupt is enabled for (core1) */
+static volatile uint32_t s_ext_events;    /* Edges seen by the interrupt, taken by trigger_service() */
+static volatile uint64_t s_ext_edge_us;   /* When the first active edge among them arrived */
+
+static critical_section_t s_stats_crit_sec; /* Recorded on core1, read by the SCPI handlers on core0 */
+static bool s_stats_enabled = false;
+static trigger_stats_t s_stats[TRG_SOURCE_EXT + 1];
 
 
 void trigger_init(void) {
     g_trigger_config.source = TRG_SOURCE_BUS;
     g_trigger_config.burst_type = BURST_MODE_CONTINUOUS;
     g_trigger_config.delay_sec = 0.0f;
-    g_trigger_config.interval_sec = 1.0f;
+    g_trigger_config.interval_ps = 1000000000000ull; /* 1 s */
     g_trigger_config.burst_ncycles = 1;
     g_trigger_config.burst_duration_sec = 0.01f;
+    g_trigger_config.ext_gpio = -1;
+    g_trigger_config.ext_condition = EXT_CONDITION_RISING;
     if (g_trigger_config.alarm_pool == NULL) {
         g_trigger_config.alarm_pool = alarm_pool_create_with_unused_hardware_alarm(16);
     }
@@ -34,47 +64,182 @@ void trigger_init(void) {
     s_int_timer_active = false;
     s_delay_alarm = -1;
 
+    if (!critical_section_is_initialized(&s_stats_crit_sec)) {
+        critical_section_init(&s_stats_crit_sec);
+    }
+    trigger_stats_enable(false);
+
     trigger_update_config();
 }
 
-/* Call every subsystem that should react to a trigger. This will be hardcoded. */
-static void trigger_dispatch_all(void) {
-    /* Hardcoded dispatch for now; add APG or others when available. */
-    pwm_trigger_start();
-    apg_trigger_start();
+static void trigger_stats_add(TRIGGER_SOURCE_TRG_SOURCE_t source, uint32_t latency) {
+    uint bin = (latency == 0) ? 0 : 32u - (uint)__builtin_clz(latency);
+    if (bin >= TRIGGER_STATS_BINS) {
+        bin = TRIGGER_STATS_BINS - 1u;
+    }
+
+    critical_section_enter_blocking(&s_stats_crit_sec);
+    trigger_stats_t *stats = &s_stats[source];
+    if (stats->count == 0 || latency < stats->min_us) {
+        stats->min_us = latency;
+    }
+    if (latency > stats->max_us) {
+        stats->max_us = latency;
+    }
+    stats->count++;
+    stats->sum_us += latency;
+    stats->bins[bin]++;
+    critical_section_exit(&s_stats_crit_sec);
+}
+
+static void trigger_stats_record(TRIGGER_SOURCE_TRG_SOURCE_t source, uint64_t event_us) {
+    const uint64_t due_us = event_us + g_trigger_config.delay_us;
+    const uint64_t now_us = time_us_64();
+    const uint64_t late_us = (now_us > due_us) ? now_us - due_us : 0;
+    trigger_stats_add(source, (late_us < UINT32_MAX) ? (uint32_t)late_us : UINT32_MAX);
+}
+
+void __not_in_flash_func(trigger_stats_record_fixed)(TRIGGER_SOURCE_TRG_SOURCE_t source, uint32_t latency_us) {
+    if (s_stats_enabled) {
+        trigger_stats_add(source, latency_us);
+    }
+}
+
+/*
+ * Call every subsystem that should react to a trigger. This will be hardcoded.
+ * Both are prepared first; the PWM slices and the APG state machines are then enabled by two consecutive
+ * stores with interrupts off (apg_trigger_start), so PWM leads the APG by 1 to 3 cycles. Engines armed in PIO
+ * (EXT, INT) have started by themselves already; PWM is not synchronized with them.
+ */
+static void __not_in_flash_func(trigger_dispatch_all)(uint64_t event_us) {
+    const uint32_t pwm_slices = pwm_trigger_arm();
+    if (g_trigger_config.source == TRG_SOURCE_INT && g_pwm_config.op_mode != PWM_MODE_OFF && pwm_slices == 0) {
+        s_int_missed++; /* PWM still playing its burst */
+    }
+    const bool apg_started = apg_trigger_start(pwm_slices);
+    if (pwm_slices != 0) {
+        pwm_trigger_started();
+    }
+    /* Only what was started here; the engines armed in PIO record their own start (apg_trigger_service) */
+    if (s_stats_enabled && (pwm_slices != 0 || apg_started)) {
+        trigger_stats_record(g_trigger_config.source, event_us);
+    }
 }
 
 static int64_t trigger_alarm_cb(alarm_id_t id, void *user_data) {
     (void)id;
     (void)user_data;
+    const uint64_t event_us = s_event_us; /* before the alarm is free for the next event */
     s_delay_alarm = -1;
-    trigger_dispatch_all();
+    trigger_dispatch_all(event_us);
     return 0; /* one-shot */
 }
 
-static void schedule_with_delay(void) {
+static void schedule_with_delay(uint64_t event_us) {
     if (s_delay_alarm != -1) {
         /* ignore trigger during delay (already scheduled) */
         return;
     }
-    s_delay_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.delay_sec * 1e6f, trigger_alarm_cb, NULL, true);
+    s_event_us = event_us;
+    s_delay_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.delay_us, trigger_alarm_cb, NULL, true);
 }
 
 static bool int_timer_cb(repeating_timer_t *rt) {
     (void)rt;
-    schedule_with_delay();
+    /* The timer keeps its period from the previous due time, so the event is when it was due, not when it ran */
+    s_int_due_us += s_int_interval_us;
+    if (g_pwm_config.op_mode != PWM_MODE_OFF || apg_int_software()) {
+        /* Periods shorter than the software timer can run, and a period during the delay of the last one */
+        s_int_missed += s_int_sw_skipped + ((s_delay_alarm != -1) ? 1u : 0u);
+    }
+    schedule_with_delay(s_int_due_us);
     return true; /* continue */
 }
 
-void trigger_update_config(void) {
+/* Edge of the EXT input that triggers, or enters the triggering level */
+static __force_inline uint32_t trigger_ext_active_edge(void) {
+    const TRIGGER_EXTERNAL_CONDITION_EXT_CONDITION_t cond = g_trigger_config.ext_condition;
+    return (cond == EXT_CONDITION_RISING || cond == EXT_CONDITION_HIGH) ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+}
+
+/* GPIO interrupt on core1: timestamp the edge where it happens, trigger_service() dispatches it */
+static void __not_in_flash_func(trigger_ext_irq)(void) {
+    const uint gpio = (uint)s_ext_irq_gpio;
+    const uint32_t events = (io_bank0_hw->intr[gpio / 8u] >> (4u * (gpio % 8u))) & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+    if (events == 0) {
+        return;
+    }
+    gpio_acknowledge_irq(gpio, events);
+    const uint32_t active = trigger_ext_active_edge();
+    if ((events & active) != 0 && (s_ext_events & active) == 0) {
+        s_ext_edge_us = time_us_64();
+    }
+    s_ext_events |= events;
+}
+
+/*
+ * Make the EXT input readable, unless PWM or the APG drive it (loopback), drop edges seen before and
+ * enable its edge interrupt on this core (core1); the interrupt of the previous input is disabled
+ */
+static void trigger_ext_setup(void) {
+    if (s_ext_irq_gpio >= 0) {
+        gpio_set_irq_enabled((uint)s_ext_irq_gpio, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, false);
+        gpio_remove_raw_irq_handler((uint)s_ext_irq_gpio, trigger_ext_irq);
+        s_ext_irq_gpio = -1;
+    }
+    s_ext_events = 0;
+
+    const int gpio = g_trigger_config.ext_gpio;
+    if (g_trigger_config.source != TRG_SOURCE_EXT || gpio < 0) {
+        return;
+    }
+    if (!apg_gpio_in_use(-1, -1, gpio) && !pwm_gpio_in_use(gpio)) {
+        gpio_init((uint)gpio);
+    }
+    gpio_acknowledge_irq((uint)gpio, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+    s_ext_irq_gpio = gpio;
+    gpio_add_raw_irq_handler((uint)gpio, trigger_ext_irq);
+    gpio_set_irq_enabled((uint)gpio, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+static int trigger_update_config_core1(void *arg) {
+    (void)arg;
+    /* Rounded once here (in double, so long delays keep their resolution), not per trigger */
+    g_trigger_config.delay_us = (uint64_t)llround((double)g_trigger_config.delay_sec * 1e6);
+    g_trigger_config.delay_cycles = (uint64_t)llround((double)g_trigger_config.delay_sec * (double)clock_get_hz(clk_sys));
+    g_trigger_config.burst_duration_us = (uint64_t)llround((double)g_trigger_config.burst_duration_sec * 1e6);
+    g_trigger_config.burst_duration_cycles = (uint64_t)llround((double)g_trigger_config.burst_duration_sec * (double)clock_get_hz(clk_sys));
+
     if (s_int_timer_active) {
         cancel_repeating_timer(&s_int_timer);
         s_int_timer_active = false;
     }
+    s_int_missed = 0;
+    trigger_ext_setup();
+    apg_int_timer_update(); /* the APG counts INT periods in hardware */
     if (g_trigger_config.source != TRG_SOURCE_INT) {
-        return;
+        return 0;
     }
-    s_int_timer_active = alarm_pool_add_repeating_timer_us(g_trigger_config.alarm_pool, -(g_trigger_config.interval_sec * 1e6f), int_timer_cb, NULL, &s_int_timer);
+    /*
+     * Still needed for PWM (never set up with a shorter interval than this timer runs) and an engine that got
+     * no hardware timer; not faster than the alarm pool can keep up with, so a shorter interval is run every
+     * n-th period and the others are counted as missed
+     */
+    const double period_us = (double)g_trigger_config.interval_ps / 1e6;
+    const double every = (period_us < TRIGGER_SW_MIN_INTERVAL_US) ? ceil(TRIGGER_SW_MIN_INTERVAL_US / period_us - 1e-6) : 1.0;
+    const int64_t interval_us = llround(period_us * every);
+    s_int_sw_skipped = (uint32_t)every - 1u;
+    s_int_interval_us = (uint64_t)interval_us;
+    s_int_due_us = time_us_64();
+    s_int_timer_active = alarm_pool_add_repeating_timer_us(g_trigger_config.alarm_pool, -interval_us, int_timer_cb, NULL, &s_int_timer);
+    return 0;
+}
+
+/* On core1, which runs the alarm pool */
+void trigger_update_config(void) {
+    (void)core1_call(trigger_update_config_core1, NULL);
+    apg_duration_update(); /* walks the patterns, so outside the core1 call */
 }
 
 void trigger_abort(void) {
@@ -88,10 +253,84 @@ void trigger_abort(void) {
     }
 }
 
-void trigger_fire(TRIGGER_SOURCE_TRG_SOURCE_t source) {
+typedef struct {
+    TRIGGER_SOURCE_TRG_SOURCE_t source;
+    uint64_t event_us;
+} trigger_fire_args_t;
+
+static int trigger_fire_core1(void *arg) {
+    const trigger_fire_args_t *fire = arg;
     /* Respect configured source. */
-    if (g_trigger_config.source != source) {
+    if (g_trigger_config.source != fire->source) {
+        return 0;
+    }
+    schedule_with_delay(fire->event_us);
+    return 0;
+}
+
+void trigger_fire(TRIGGER_SOURCE_TRG_SOURCE_t source) {
+    trigger_fire_args_t fire = {source, time_us_64()}; /* the event is when it was handled, before the handover */
+    (void)core1_call(trigger_fire_core1, &fire);
+}
+
+/*
+ * The edges are latched and timestamped by the GPIO interrupt (trigger_ext_irq), so a pulse shorter than a
+ * pass of the main loop is not missed and the event is the edge, not when this pass sees it.
+ * HIGH/LOW trigger on the edge into the level, and again every TRIGGER_SW_MIN_INTERVAL_US while it holds
+ * (not on every pass), which starts what has finished its burst meanwhile.
+ */
+void __not_in_flash_func(trigger_service)(void) {
+    if (g_trigger_config.source != TRG_SOURCE_EXT || g_trigger_config.ext_gpio < 0) {
         return;
     }
-    schedule_with_delay();
-}
\ No newline at end of file
+
+    const uint gpio = (uint)g_trigger_config.ext_gpio;
+    const uint32_t save = save_and_disable_interrupts();
+    const uint32_t events = s_ext_events;
+    const uint64_t edge_us = s_ext_edge_us;
+    s_ext_events = 0;
+    restore_interrupts(save);
+    const uint64_t now_us = time_us_64();
+
+    bool held = false;
+    switch (g_trigger_config.ext_condition) {
+    case EXT_CONDITION_HIGH:
+        held = gpio_get(gpio);
+        break;
+    case EXT_CONDITION_LOW:
+        held = !gpio_get(gpio);
+        break;
+    default:
+        break;
+    }
+    if ((events & trigger_ext_active_edge()) != 0) {
+        s_level_next_us = edge_us + TRIGGER_SW_MIN_INTERVAL_US;
+        schedule_with_delay(edge_us);
+    } else if (held && now_us >= s_level_next_us) {
+        s_level_next_us = now_us + TRIGGER_SW_MIN_INTERVAL_US;
+        schedule_with_delay(now_us);
+    }
+}
+
+void trigger_stats_enable(bool enable) {
+    critical_section_enter_blocking(&s_stats_crit_sec);
+    if (enable) {
+        memset(s_stats, 0, sizeof(s_stats));
+    }
+    s_stats_enabled = enable;
+    critical_section_exit(&s_stats_crit_sec);
+}
+
+uint32_t trigger_int_missed(void) {
+    return s_int_missed + apg_int_missed();
+}
+
+bool trigger_stats_enabled(void) {
+    return s_stats_enabled;
+}
+
+void trigger_stats_get(TRIGGER_SOURCE_TRG_SOURCE_t source, trigger_stats_t *stats) {
+    critical_section_enter_blocking(&s_stats_crit_sec);
+    *stats = s_stats[source];
+    critical_section_exit(&s_stats_crit_sec);
+}
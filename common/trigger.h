@@ -15,28 +15,62 @@
 
 #include "scpi_server/scpi_enums_gen.h"
 
+#define TRIGGER_SW_MIN_INTERVAL_US 10 /* Shortest software INT period; the APG engines count shorter ones in hardware */
 
 typedef struct {
-    TRIGGER_SOURCE_TRG_SOURCE_t source;        /* IMM/INT/BUS (expanded via YAML) */
+    TRIGGER_SOURCE_TRG_SOURCE_t source;        /* IMM/INT/BUS/EXT (expanded via YAML) */
     SOURCE_BURST_TYPE_BURST_MODE_t burst_type; /* CONTINUOUS/NCYCLES/DURATION */
     float delay_sec;                           /* Delay applied before dispatching a trigger event */
-    float interval_sec;                        /* Internal trigger interval */
+    uint64_t interval_ps;                      /* Internal trigger interval in picoseconds, exact as given */
     uint32_t burst_ncycles;                    /* Number of cycles to generate in NCYCLES mode */
     float burst_duration_sec;                  /* Duration of burst in DURATION mode */
+    int ext_gpio;                              /* EXT source input, -1 for none */
+    TRIGGER_EXTERNAL_CONDITION_EXT_CONDITION_t ext_condition; /* EXT source edge or level */
     alarm_pool_t *alarm_pool;               /* Alarm pool for trigger related timers */
+    uint64_t delay_us;                      /* delay_sec for the alarm (software-started subsystems) */
+    uint64_t delay_cycles;                  /* delay_sec in system clock cycles (APG hardware triggers) */
+    uint64_t burst_duration_us;             /* burst_duration_sec for the alarm (bursts not ended in hardware) */
+    uint64_t burst_duration_cycles;         /* burst_duration_sec in system clock cycles (ended in hardware) */
 } trigger_config_t;
 
 extern trigger_config_t g_trigger_config;
 
+#define TRIGGER_STATS_BINS 16 /* log2 latency bins: 0 us, 1 us, 2..3 us, ..., 2^14 us and more */
+
+/* Trigger latency statistics of one source, in microseconds past the event plus the delay */
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t bins[TRIGGER_STATS_BINS]; /* bin n > 0 counts latencies of 2^(n-1) up to 2^n - 1 us */
+} trigger_stats_t;
+
 void trigger_init(void);
 
 /* Dispatch a trigger event for the given source; applies delay via pico/time alarm. */
 void trigger_fire(TRIGGER_SOURCE_TRG_SOURCE_t source);
 
-/* Update trigger based on current config (INT source). */
+/* Update trigger based on current config (INT source, EXT input, delay and burst duration). */
 void trigger_update_config(void);
 
 /* Cancel any pending delay or internal timers. */
 void trigger_abort(void);
 
+/* Dispatch the EXT edges timestamped by the GPIO interrupt and held levels (core1 main loop); the APG waits for it in PIO. */
+void trigger_service(void);
+
+/* INT periods that started nothing in PWM or an enabled APG engine, still busy with a burst or not that fast */
+uint32_t trigger_int_missed(void);
+
+/* Start (cleared) or stop recording the latency of every trigger that starts PWM or the APG (off after trigger_init). */
+void trigger_stats_enable(bool enable);
+bool trigger_stats_enabled(void);
+
+/* Record a start with a latency known in advance (APG engines armed in PIO), if recording. */
+void trigger_stats_record_fixed(TRIGGER_SOURCE_TRG_SOURCE_t source, uint32_t latency_us);
+
+/* Consistent copy of the latency statistics of a source; safe from either core. */
+void trigger_stats_get(TRIGGER_SOURCE_TRG_SOURCE_t source, trigger_stats_t *stats);
+
 #endif /* TRIGGER_H */
\ No newline at end of file
@@ -5,6 +5,7 @@
  * See the repository LICENSE file for the full text.
  */
 
+#include <pico/flash.h>
 #include <pico/multicore.h>
 #include <pico/stdlib.h>
 #include <stdio.h>
@@ -21,6 +22,9 @@ int main() {
     mg_mgr_init(&mgr); // Initialize Mongoose manager
     usb_network_init(&mgr);
 
+    // Let core1 pause this core for flash writes and clock changes (see flash_safe_execute)
+    flash_safe_execute_core_init();
+
     // Launch Core1
     multicore_launch_core1(main_core1_entry);
 
@@ -12,8 +12,8 @@
 #include "hardware/clocks.h"
 #include "hardware/irq.h"
 #include "hardware/pwm.h"
-#include "pico/time.h"
 
+#include "common/core1_mailbox.h"
 #include "common/trigger.h"
 #include "pwm.h"
 #include "pwm_gpio.h"
@@ -23,9 +23,6 @@
 /* Global PWM configuration instance */
 pwm_config_t g_pwm_config;
 
-/* Alarm ID for burst duration */
-static alarm_id_t burst_duration_alarm = -1;
-
 static void apply_config_defaults(void) {
     g_pwm_config.reload_runtime_param = true;
 
@@ -63,8 +60,6 @@ static void apply_config_defaults(void) {
     g_pwm_config.max_counter = 0;
     g_pwm_config.deadtime_counts_ls = 0;
     g_pwm_config.deadtime_counts_hs = 0;
-
-    burst_duration_alarm = -1;
 }
 
 void pwm_init_module(void) {
@@ -101,9 +96,10 @@ static inline void pwm_set_channel_polarity(uint slice_num, uint chan, bool inve
                     chan ? PWM_CH0_CSR_B_INV_BITS : PWM_CH0_CSR_A_INV_BITS);
 }
 
-void pwm_update_config(void) {
+static int pwm_update_config_core1(void *arg) {
+    (void)arg;
     if (g_pwm_config.state == PWM_STATE_RUNNING) {
-        return;
+        return 0;
     }
 
     float clock_hz = clock_get_hz(clk_sys); /* system clock */
@@ -116,6 +112,7 @@ void pwm_update_config(void) {
         clkdiv = 255; /* max divider is 255 */
     /* Calculate max_counter (= max level = wrap + 1) based on frequency and clkdiv */
     g_pwm_config.max_counter = (uint16_t)roundf(clock_hz / (g_pwm_config.frequency_hz * 2.0f * (float)clkdiv));
+    g_pwm_config.period_cycles = 2u * g_pwm_config.max_counter * clkdiv;
 
     /* Initialize each phase's GPIO pins and PWM slices and calculate enable mask */
     uint32_t mask = 0;
@@ -185,49 +182,66 @@ void pwm_update_config(void) {
 
     /* Re-initialize PWM IRQ handler */
     pwm_irq_setup(pwm_irq_slice);
+    return 0;
 }
 
-static int64_t burst_duration_alarm_cb(alarm_id_t id, void *user_data) {
-    (void)id;
-    (void)user_data;
-    burst_duration_alarm = -1;
-    pwm_abort();
-    return 0; /* one-shot */
+/* On core1, which takes the wrap IRQ */
+void pwm_update_config(void) {
+    (void)core1_call(pwm_update_config_core1, NULL);
 }
 
-void pwm_trigger_start(void) {
+/* Set by pwm_trigger_arm for pwm_trigger_started */
+static bool s_single_period;
+
+/**
+ * Prepare a start: compare levels of the first period and the burst length primed, wrap IRQ enabled.
+ * Returns the slices to enable, 0 if PWM does not start (off or already running). The slices are
+ * enabled by the caller (apg_trigger_start), which must call pwm_trigger_started() right after.
+ */
+uint32_t pwm_trigger_arm(void) {
     if (g_pwm_config.op_mode == PWM_MODE_OFF) {
-        return;
+        return 0;
     }
     if (g_pwm_config.state == PWM_STATE_RUNNING) {
-        return;
+        return 0;
     }
 
-    if (g_trigger_config.burst_type == BURST_MODE_DURATION) {
-        if (burst_duration_alarm != -1 && g_pwm_config.state == PWM_STATE_RUNNING) {
-            /* already running with a burst duration, ignore retrigger */
-            return;
-        } else if (burst_duration_alarm != -1) {
-            /* shouldn't happen that we have an active burst duration alarm when not running, but cancel just in case */
-            alarm_pool_cancel_alarm(g_trigger_config.alarm_pool, burst_duration_alarm);
-        }
-        burst_duration_alarm = alarm_pool_add_alarm_in_us(g_trigger_config.alarm_pool, g_trigger_config.burst_duration_sec * 1e6f + 7, burst_duration_alarm_cb, NULL, false);
+    /* Bursts are counted in PWM periods by the wrap IRQ, a DURATION rounded down to whole periods (so it never overruns), at least one */
+    uint32_t burst_periods = 0;
+    if (g_trigger_config.burst_type == BURST_MODE_NCYCLES) {
+        burst_periods = g_trigger_config.burst_ncycles;
+    } else if (g_trigger_config.burst_type == BURST_MODE_DURATION && g_pwm_config.period_cycles > 0) {
+        const uint64_t periods = g_trigger_config.burst_duration_cycles / g_pwm_config.period_cycles;
+        burst_periods = (periods == 0) ? 1u : (periods > UINT32_MAX) ? UINT32_MAX : (uint32_t)periods;
     }
 
     g_pwm_config.state = PWM_STATE_RUNNING;
 
     g_pwm_config.reload_runtime_param = true; /* Force reload on prime */
-    pwm_irq_prime();
+    pwm_irq_prime(burst_periods);
     pwm_clear_irq(g_pwm_config.pwm_irq_slice);
     irq_set_enabled(PWM_IRQ_WRAP_0, true);
-    pwm_set_mask_enabled(g_pwm_config.pwm_enable_mask);
+    s_single_period = (burst_periods == 1u);
+    return g_pwm_config.pwm_enable_mask;
 }
 
-/**
- * Transition from RUNNING to IDLE state
- * Disables PWM hardware and applies idle states to all outputs
- */
-void __no_inline_not_in_flash_func(pwm_abort)(void) {
+/* Within the first period after the slices were enabled */
+void __not_in_flash_func(pwm_trigger_started)(void) {
+    if (s_single_period) {
+        pwm_set_idle_levels(); /* no IRQ before the only wrap: idle from it on */
+    }
+}
+
+void pwm_trigger_start(void) {
+    const uint32_t slices = pwm_trigger_arm();
+    if (slices != 0) {
+        pwm_set_mask_enabled(slices);
+        pwm_trigger_started();
+    }
+}
+
+static int __no_inline_not_in_flash_func(pwm_abort_core1)(void *arg) {
+    (void)arg;
     /* Disable all slices immediately */
     irq_set_enabled(PWM_IRQ_WRAP_0, false); // takes quite long to execute :/
     pwm_set_mask_enabled(0);
@@ -237,14 +251,17 @@ void __no_inline_not_in_flash_func(pwm_abort)(void) {
     /* Reset runtime state */
     g_pwm_config.state = PWM_STATE_IDLE;
 
-    /* Cancel burst duration alarm if active */
-    if (burst_duration_alarm != -1) {
-        alarm_pool_cancel_alarm(g_trigger_config.alarm_pool, burst_duration_alarm);
-        burst_duration_alarm = -1;
-    }
-
     /* retrigger if Immediate mode */
     if (g_trigger_config.source == TRG_SOURCE_IMM) {
         pwm_trigger_start();
     }
+    return 0;
+}
+
+/**
+ * Transition from RUNNING to IDLE state
+ * Disables PWM hardware and applies idle states to all outputs; on core1, where the wrap IRQ is enabled
+ */
+void __no_inline_not_in_flash_func(pwm_abort)(void) {
+    (void)core1_call(pwm_abort_core1, NULL);
 }
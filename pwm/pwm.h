@@ -69,6 +69,7 @@ typedef struct {
     uint32_t pwm_enable_mask;     /* Bitmask of active PWM slices for current op_mode */
     float min_duty_with_deadtime; /* Minimum duty cycle plus half deadtime as fraction of period, for clipping */
     uint16_t max_counter;         /* Calculated PWM max_counter value based on frequency */
+    uint32_t period_cycles;       /* PWM period in system clock cycles (phase-correct: 2 * max_counter * clkdiv) */
     uint16_t deadtime_counts_ls;  /* Pre-calculated deadtime in level counts */
     uint16_t deadtime_counts_hs;  /* Pre-calculated deadtime in level counts */
 
@@ -85,6 +86,10 @@ void pwm_update_config(void);
 
 void pwm_trigger_start(void);
 
+/* pwm_trigger_start split for a start together with the APG, see pwm.c */
+uint32_t pwm_trigger_arm(void);
+void pwm_trigger_started(void);
+
 /* Immediate abort: stop slices and apply idle levels without waiting for wrap IRQ. */
 void pwm_abort(void);
 
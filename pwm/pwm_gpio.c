@@ -14,22 +14,32 @@
 #include "common/output.h"
 #include "pwm_gpio.h"
 
-void __no_inline_not_in_flash_func(pwm_set_idle_state)(void) {
+void __no_inline_not_in_flash_func(pwm_set_idle_levels)(void) {
     for (uint8_t phase = 0; phase < g_pwm_config.op_mode; phase++) {
         pwm_phase_config_t *phase_cfg = &g_pwm_config.phase[phase];
         if (phase_cfg->gpio_ls >= 0) {
-            /* reset counters */
-            pwm_set_counter(phase_cfg->ls_slice, 0);
             /* Update idle levels, set CC to idle values */
             pwm_set_chan_level(phase_cfg->ls_slice, phase_cfg->ls_channel, phase_cfg->ls_idle ? g_pwm_config.max_counter : 0);
         }
         if (phase_cfg->gpio_hs >= 0) {
-            /* reset counters */
-            pwm_set_counter(phase_cfg->hs_slice, 0);
             /* Update idle levels, set CC to idle values, inverted for high-side */
             pwm_set_chan_level(phase_cfg->hs_slice, phase_cfg->hs_channel, phase_cfg->hs_idle ? 0 : g_pwm_config.max_counter);
         }
     }
+}
+
+void __no_inline_not_in_flash_func(pwm_set_idle_state)(void) {
+    for (uint8_t phase = 0; phase < g_pwm_config.op_mode; phase++) {
+        pwm_phase_config_t *phase_cfg = &g_pwm_config.phase[phase];
+        /* reset counters */
+        if (phase_cfg->gpio_ls >= 0) {
+            pwm_set_counter(phase_cfg->ls_slice, 0);
+        }
+        if (phase_cfg->gpio_hs >= 0) {
+            pwm_set_counter(phase_cfg->hs_slice, 0);
+        }
+    }
+    pwm_set_idle_levels();
 
     irq_set_enabled(PWM_IRQ_WRAP_0, false);
     /* Start/Stop PWM to reload double buffered registers to apply idle levels */
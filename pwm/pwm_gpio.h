@@ -31,6 +31,9 @@ extern "C" {
  * */
 void pwm_init_hardware(void);
 
+/* Compare levels of the idle state only; double buffered, so the running slices output them from the next wrap on */
+void pwm_set_idle_levels(void);
+
 void pwm_set_idle_state(void);
 
 /* Attach/Detach PWM GPIOs to/from PWM function (enable/disable output drive). */
@@ -178,16 +178,14 @@ static __force_inline void set_duties(void) {
 
 /**
  * Check if waveform generation should terminate based on burst type
- * Returns true if NCYCLES limit reached
+ * Returns true if the burst (NCYCLES or DURATION, counted in PWM periods) is done
  */
 static __force_inline bool is_burst_termination_required(void) {
-    if (g_trigger_config.burst_type == BURST_MODE_NCYCLES) {
-        /* NCYCLES mode: stop after configured number of cycles */
-        g_burst_ncycle_counter++;
-        return (g_burst_ncycle_counter >= g_burst_ncycle_snapshot);
+    if (g_burst_ncycle_snapshot == 0) {
+        return false; /* continuous */
     }
-    /* Other burst modes not handled here */
-    return false;
+    g_burst_ncycle_counter++;
+    return (g_burst_ncycle_counter >= g_burst_ncycle_snapshot);
 }
 
 /* Shared body for IRQ and pre-prime call; prime_run runs even if not yet running. */
@@ -201,6 +199,13 @@ static void __no_inline_not_in_flash_func(pwm_irq_run)(bool prime_run) {
         return;
     }
 
+    if (!prime_run && g_burst_ncycle_counter + 1u == g_burst_ncycle_snapshot) {
+        /* Last period of the burst: the idle levels take effect at its wrap, not an IRQ latency later */
+        pwm_set_idle_levels();
+        PWM_IRQ_DEBUG_SET(false);
+        return;
+    }
+
     calculate_duties();
     clip_duties();
     set_duties();
@@ -221,14 +226,14 @@ void __isr __not_in_flash_func(pwm_wrap_irq_handler)(void) {
 }
 
 /* Prime PWM compare levels once before enabling the slice to avoid a cold first IRQ. */
-void __no_inline_not_in_flash_func(pwm_irq_prime)(void) {
+void __no_inline_not_in_flash_func(pwm_irq_prime)(uint32_t burst_periods) {
     /**
      * Initialize PWM IRQ handler
      */
     pwm_irq_run(true);
     g_phase_acc = 0;                                          /* Reset phase accumulator to start with 0° on first real IRQ */
     g_burst_ncycle_counter = 0;                               /* Reset burst cycle counter on prime */
-    g_burst_ncycle_snapshot = g_trigger_config.burst_ncycles; /* Snapshot NCYCLES count at start of burst */
+    g_burst_ncycle_snapshot = burst_periods;                  /* Snapshot burst length at start of burst */
 }
 
 void pwm_irq_init(void) {
@@ -19,7 +19,8 @@ extern "C" {
  * Intended to be called from Core1 just before enabling the slice to
  * avoid a long first IRQ entry.
  */
-void pwm_irq_prime(void);
+/* burst_periods: PWM periods until the burst ends (NCYCLES, DURATION), 0 to run continuously */
+void pwm_irq_prime(uint32_t burst_periods);
 
 void pwm_irq_init(void);
 
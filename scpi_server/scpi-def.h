@@ -34,7 +34,7 @@ extern "C" {
 
 #include "scpi/scpi.h"
 
-#define SCPI_INPUT_BUFFER_LENGTH 256
+#define SCPI_INPUT_BUFFER_LENGTH (256 + 8192) /* Command header plus a full 1024 point binary APG block */
 #define SCPI_ERROR_QUEUE_SIZE 17
 #define SCPI_IDN1 "PRIVATE"
 #define SCPI_IDN2 "PICO-APG"
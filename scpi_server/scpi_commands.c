@@ -36,19 +36,25 @@
  *     command. Each value is already range-checked by the parser.
  */
 
+#include <malloc.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hardware/clocks.h"
+
 #include "apg/apg.h"
 #include "common/main_core1.h"
 #include "common/output.h"
+#include "common/state_store.h"
+#include "common/sysclock.h"
 #include "common/trigger.h"
 #include "pwm/pwm.h"
 #include "pwm/pwm_gpio.h"
 #include "scpi_commands_gen.h"
+#include "scpi_server.h"
 
 /* Helper macros for common checks */
 #define REQUIRE_OUTPUTS_DISABLED()               \
@@ -65,6 +71,17 @@
         }                                              \
     } while (0)
 
+/* Internal trigger interval limits: 1 us .. 60 s */
+#define TRIGGER_MIN_INTERVAL_PS 1000000ull
+#define TRIGGER_MAX_INTERVAL_PS (60ull * APG_PS_PER_SEC)
+
+static bool parse_duration_ps(const char *ptr, size_t len, uint64_t *out_ps);
+
+/* PWM is started by the software INT timer, which does not run faster than every TRIGGER_SW_MIN_INTERVAL_US */
+static bool pwm_interval_conflict(SOURCE_PWM_MODE_PWM_MODE_t mode, uint64_t interval_ps) {
+    return mode != PWM_MODE_OFF && interval_ps < TRIGGER_SW_MIN_INTERVAL_US * 1000000ull;
+}
+
 int custom_OUTPUT_STATE(bool state) {
     g_output_state.enabled = state;
     output_apply_state();
@@ -82,8 +99,14 @@ int custom_ABORT(void) {
 }
 
 int custom_TRIGGER_SOURCE(TRIGGER_SOURCE_TRG_SOURCE_t source) {
+    /* The APG engines are armed for the hardware triggers */
+    const bool hw = (source == TRG_SOURCE_EXT || source == TRG_SOURCE_INT ||
+                     g_trigger_config.source == TRG_SOURCE_EXT || g_trigger_config.source == TRG_SOURCE_INT);
     g_trigger_config.source = source;
     trigger_update_config();
+    if (hw) {
+        abort_all(); /* arm or disarm the APG engines */
+    }
     return SCPI_ERROR_NO_ERROR;
 }
 
@@ -94,6 +117,8 @@ int custom_TRIGGER_SOURCE_QUERY(TRIGGER_SOURCE_TRG_SOURCE_t *source) {
 
 int custom_TRIGGER_DELAY(float delay) {
     g_trigger_config.delay_sec = delay;
+    trigger_update_config();
+    apg_trigger_rearm(); /* a running burst is left alone */
     return SCPI_ERROR_NO_ERROR;
 }
 
@@ -102,6 +127,34 @@ int custom_TRIGGER_DELAY_QUERY(float *delay) {
     return SCPI_ERROR_NO_ERROR;
 }
 
+int custom_TRIGGER_EXTERNAL_GPIO(int gpio) {
+    g_trigger_config.ext_gpio = gpio;
+    if (g_trigger_config.source == TRG_SOURCE_EXT) {
+        trigger_update_config();
+        abort_all(); /* arm again on the new input */
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_TRIGGER_EXTERNAL_GPIO_QUERY(int *gpio) {
+    *gpio = g_trigger_config.ext_gpio;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_TRIGGER_EXTERNAL_CONDITION(TRIGGER_EXTERNAL_CONDITION_EXT_CONDITION_t condition) {
+    g_trigger_config.ext_condition = condition;
+    if (g_trigger_config.source == TRG_SOURCE_EXT) {
+        trigger_update_config();
+        abort_all(); /* arm again with the new condition */
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_TRIGGER_EXTERNAL_CONDITION_QUERY(TRIGGER_EXTERNAL_CONDITION_EXT_CONDITION_t *condition) {
+    *condition = g_trigger_config.ext_condition;
+    return SCPI_ERROR_NO_ERROR;
+}
+
 int custom_TRG(void) {
     trigger_fire(TRG_SOURCE_BUS);
     return SCPI_ERROR_NO_ERROR;
@@ -130,6 +183,7 @@ int custom_SOURCE_BURST_NCYCLES_QUERY(unsigned int *ncycles) {
 
 int custom_SOURCE_BURST_DURATION(float duration) {
     g_trigger_config.burst_duration_sec = duration;
+    trigger_update_config();
     return SCPI_ERROR_NO_ERROR;
 }
 
@@ -138,34 +192,65 @@ int custom_SOURCE_BURST_DURATION_QUERY(float *duration) {
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_BURST_INTERVAL(float interval) {
-    g_trigger_config.interval_sec = interval;
+/* Parsed straight to integer picoseconds like the APG durations, so the timer period is exact in cycles */
+scpi_result_t custom_SOURCE_BURST_INTERVAL(scpi_t *context) {
+    scpi_parameter_t param;
+    uint64_t interval_ps = 0;
+
+    if (!SCPI_Parameter(context, &param, TRUE)) {
+        return SCPI_RES_ERR;
+    }
+    if (param.type != SCPI_TOKEN_DECIMAL_NUMERIC_PROGRAM_DATA || !parse_duration_ps(param.ptr, param.len, &interval_ps)) {
+        SCPI_ErrorPush(context, SCPI_ERROR_DATA_TYPE_ERROR);
+        return SCPI_RES_ERR;
+    }
+    if (interval_ps < TRIGGER_MIN_INTERVAL_PS || interval_ps > TRIGGER_MAX_INTERVAL_PS) {
+        SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+        return SCPI_RES_ERR;
+    }
+    if (pwm_interval_conflict(g_pwm_config.op_mode, interval_ps)) {
+        SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    }
+    g_trigger_config.interval_ps = interval_ps;
     trigger_update_config();
-    return SCPI_ERROR_NO_ERROR;
+    return SCPI_RES_OK;
 }
 
-int custom_SOURCE_BURST_INTERVAL_QUERY(float *interval) {
-    *interval = g_trigger_config.interval_sec;
-    return SCPI_ERROR_NO_ERROR;
+scpi_result_t custom_SOURCE_BURST_INTERVAL_QUERY(scpi_t *context) {
+    SCPI_ResultDouble(context, (double)g_trigger_config.interval_ps / (double)APG_PS_PER_SEC);
+    return SCPI_RES_OK;
 }
 
 int custom_SOURCE_BURST_FREQUENCY(float frequency) {
-    g_trigger_config.interval_sec = 1.0f / frequency;
+    const uint64_t interval_ps = (uint64_t)llround((double)APG_PS_PER_SEC / (double)frequency);
+    if (pwm_interval_conflict(g_pwm_config.op_mode, interval_ps)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    g_trigger_config.interval_ps = interval_ps;
     trigger_update_config();
     return SCPI_ERROR_NO_ERROR;
 }
 
 int custom_SOURCE_BURST_FREQUENCY_QUERY(float *frequency) {
-    *frequency = 1.0f / g_trigger_config.interval_sec;
+    *frequency = (float)((double)APG_PS_PER_SEC / (double)g_trigger_config.interval_ps);
     return SCPI_ERROR_NO_ERROR;
 }
 
+scpi_result_t custom_SOURCE_BURST_MISSED(scpi_t *context) {
+    SCPI_ResultUInt32(context, trigger_int_missed());
+    return SCPI_RES_OK;
+}
+
 int custom_SOURCE_PWM_MODE(SOURCE_PWM_MODE_PWM_MODE_t mode) {
     REQUIRE_OUTPUTS_DISABLED();
     if (mode == PWM_MODE_ONEPH && g_pwm_config.control_mode != PWM_CONTROL_DUTY) {
         // Only DUTY control is valid in ONEPH mode
         return SCPI_ERROR_SETTINGS_CONFLICT;
     }
+    if (pwm_interval_conflict(mode, g_trigger_config.interval_ps)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
     pwm_abort(); /* Ensure PWM is stopped before changing mode */
     g_pwm_config.op_mode = mode;
     pwm_update_config();
@@ -289,7 +374,7 @@ int custom_SOURCE_PWM_SPEED_QUERY(float *speed) {
 int custom_SOURCE_PWM_PHASEN_LS_GPIO(const unsigned int indices[1], int gpio) {
     REQUIRE_OUTPUTS_DISABLED();
     unsigned int phase = indices[0];
-    if (apg_gpio_in_use(-1, gpio)) {
+    if (apg_gpio_in_use(-1, -1, gpio)) {
         return SCPI_ERROR_SETTINGS_CONFLICT; // GPIO is in use by APG
     }
     if (pwm_gpio_in_use(gpio)) {
@@ -314,7 +399,7 @@ int custom_SOURCE_PWM_PHASEN_LS_GPIO_QUERY(const unsigned int indices[1], int *g
 int custom_SOURCE_PWM_PHASEN_HS_GPIO(const unsigned int indices[1], int gpio) {
     REQUIRE_OUTPUTS_DISABLED();
     unsigned int phase = indices[0];
-    if (apg_gpio_in_use(-1, gpio)) {
+    if (apg_gpio_in_use(-1, -1, gpio)) {
         return SCPI_ERROR_SETTINGS_CONFLICT; // GPIO is in use by APG
     }
     if (pwm_gpio_in_use(gpio)) {
@@ -396,20 +481,259 @@ int custom_SOURCE_PWM_PHASEN_HS_IDLE_QUERY(const unsigned int indices[1], bool *
     return SCPI_ERROR_NO_ERROR;
 }
 
+/**
+ * Instrument state command implementations
+ */
+
+int custom_SAV(int slot) {
+    REQUIRE_OUTPUTS_DISABLED(); /* writing the flash pauses core1 */
+    switch (state_save((unsigned int)slot)) {
+    case 0:
+        return SCPI_ERROR_NO_ERROR;
+    case -1:
+        return SCPI_ERROR_DATA_OUT_OF_RANGE;
+    default:
+        return SCPI_ERROR_MASS_STORAGE_ERROR;
+    }
+}
+
+int custom_RCL(int slot) {
+    switch (state_recall((unsigned int)slot)) {
+    case 0:
+        return SCPI_ERROR_NO_ERROR;
+    case -1:
+        return SCPI_ERROR_DATA_OUT_OF_RANGE;
+    default:
+        return SCPI_ERROR_DATA_CORRUPT;
+    }
+}
+
+int custom_MEMORY_STATE_RECALL_AUTO(int slot) {
+    REQUIRE_OUTPUTS_DISABLED();
+    switch (state_set_power_on_slot(slot)) {
+    case 0:
+        return SCPI_ERROR_NO_ERROR;
+    case -1:
+        return SCPI_ERROR_DATA_OUT_OF_RANGE;
+    default:
+        return SCPI_ERROR_MASS_STORAGE_ERROR;
+    }
+}
+
+int custom_MEMORY_STATE_RECALL_AUTO_QUERY(int *slot) {
+    *slot = state_get_power_on_slot();
+    return SCPI_ERROR_NO_ERROR;
+}
+
+/**
+ * System command implementations
+ */
+
+int custom_SYSTEM_CLOCK(unsigned int frequency) {
+    REQUIRE_OUTPUTS_DISABLED();
+    switch (sysclock_set_hz(frequency)) {
+    case 0:
+        return SCPI_ERROR_NO_ERROR;
+    case -1:
+        return SCPI_ERROR_DATA_OUT_OF_RANGE;
+    case -2:
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    default:
+        return SCPI_ERROR_HARDWARE_ERROR;
+    }
+}
+
+int custom_SYSTEM_CLOCK_QUERY(unsigned int *frequency) {
+    *frequency = clock_get_hz(clk_sys);
+    return SCPI_ERROR_NO_ERROR;
+}
+
+/* Heap bounds from the linker script; the heap grows from __end__ up to the stack (see _sbrk) */
+extern char __end__;
+extern char __StackLimit;
+
+scpi_result_t custom_SYSTEM_MEMORY(scpi_t *context) {
+    const struct mallinfo mi = mallinfo();
+    const size_t heap_total = (size_t)(&__StackLimit - &__end__);
+    const size_t heap_free = heap_total - (size_t)mi.uordblks;
+
+    size_t apg_capacity = 0;
+    size_t apg_points = 0;
+    for (unsigned int engine = 0; engine < APG_ENGINES; engine++) {
+        apg_capacity += apg_data_capacity(engine);
+        apg_points += g_apg_config[engine].data_count;
+    }
+
+    SCPI_ResultUInt32(context, (uint32_t)apg_capacity);
+    SCPI_ResultUInt32(context, (uint32_t)apg_points);
+    SCPI_ResultUInt32(context, (uint32_t)heap_free);
+    SCPI_ResultUInt32(context, (uint32_t)scpi_server_buffer_usage());
+    return SCPI_RES_OK;
+}
+
+int custom_SYSTEM_TRIGGER_STATISTICS_STATE(bool state) {
+    trigger_stats_enable(state);
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SYSTEM_TRIGGER_STATISTICS_STATE_QUERY(bool *state) {
+    *state = trigger_stats_enabled();
+    return SCPI_ERROR_NO_ERROR;
+}
+
+scpi_result_t custom_SYSTEM_TRIGGER_STATISTICS(scpi_t *context) {
+    trigger_stats_t stats;
+    trigger_stats_get(g_trigger_config.source, &stats);
+
+    SCPI_ResultUInt32(context, stats.count);
+    SCPI_ResultUInt32(context, stats.min_us);
+    SCPI_ResultDouble(context, (stats.count > 0) ? (double)stats.sum_us / stats.count : 0.0);
+    SCPI_ResultUInt32(context, stats.max_us);
+    for (unsigned int bin = 0; bin < TRIGGER_STATS_BINS; bin++) {
+        SCPI_ResultUInt32(context, stats.bins[bin]);
+    }
+    return SCPI_RES_OK;
+}
+
 /**
  * APG command implementations
+ * The APG<n> suffix selects the engine, suffixes beyond the engines built in (APG_ENGINES) are rejected.
  */
 
-int custom_SOURCE_APG_STATE(bool state) {
-    apg_set_state(state);
+#define APG_ENGINE(indices) ((indices)[0] - 1u)
+
+#define REQUIRE_APG_ENGINE(indices)           \
+    do {                                      \
+        if ((indices)[0] > APG_ENGINES) {     \
+            return SCPI_ERROR_INVALID_SUFFIX; \
+        }                                     \
+    } while (0)
+
+/* Same for handlers returning scpi_result_t */
+#define REQUIRE_APG_ENGINE_CONTEXT(context, indices)              \
+    do {                                                          \
+        if ((indices)[0] > APG_ENGINES) {                         \
+            SCPI_ErrorPush((context), SCPI_ERROR_INVALID_SUFFIX); \
+            return SCPI_RES_ERR;                                  \
+        }                                                         \
+    } while (0)
+
+int custom_SOURCE_APGN_STATE(const unsigned int indices[1], bool state) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_set_state(APG_ENGINE(indices), state);
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_STATE_QUERY(bool *state) {
-    *state = g_apg_is_enabled;
+int custom_SOURCE_APGN_STATE_QUERY(const unsigned int indices[1], bool *state) {
+    REQUIRE_APG_ENGINE(indices);
+    *state = g_apg_config[APG_ENGINE(indices)].is_enabled;
     return SCPI_ERROR_NO_ERROR;
 }
 
+/* APG point duration limits: 20 ns .. 60 s */
+#define APG_MIN_DURATION_PS 20000ull
+#define APG_MAX_DURATION_PS (60ull * APG_PS_PER_SEC)
+
+static inline bool is_ws(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Parse a decimal number of seconds into picoseconds without floating point.
+ * The mantissa digits are collected as an integer and scaled by the exponent (rounded to 1 ps,
+ * saturating at UINT64_MAX). Negative numbers yield 0. Returns false if the text is not a decimal number.
+ */
+static bool parse_duration_ps(const char *ptr, size_t len, uint64_t *out_ps) {
+    size_t i = 0;
+    uint64_t mantissa = 0;
+    int exponent = 12; /* seconds -> ps */
+    bool negative = false;
+    bool digits = false;
+    bool point = false;
+
+    if (i < len && (ptr[i] == '+' || ptr[i] == '-')) {
+        negative = (ptr[i] == '-');
+        i++;
+    }
+    for (; i < len; i++) {
+        const char c = ptr[i];
+        if (c == '.' && !point) {
+            point = true;
+            continue;
+        }
+        if (c < '0' || c > '9') {
+            break;
+        }
+        digits = true;
+        if (mantissa < 100000000000000000ull) {
+            mantissa = mantissa * 10u + (uint64_t)(c - '0');
+            if (point) {
+                exponent--;
+            }
+        } else if (!point) {
+            exponent++; /* digit beyond the mantissa precision */
+        }
+    }
+    if (!digits) {
+        return false;
+    }
+
+    while (i < len && is_ws(ptr[i])) {
+        i++;
+    }
+    if (i < len && (ptr[i] == 'e' || ptr[i] == 'E')) {
+        i++;
+        while (i < len && is_ws(ptr[i])) {
+            i++;
+        }
+        bool exp_negative = false;
+        if (i < len && (ptr[i] == '+' || ptr[i] == '-')) {
+            exp_negative = (ptr[i] == '-');
+            i++;
+        }
+        int exp = 0;
+        bool exp_digits = false;
+        for (; i < len && ptr[i] >= '0' && ptr[i] <= '9'; i++) {
+            exp_digits = true;
+            if (exp < 1000) {
+                exp = exp * 10 + (ptr[i] - '0');
+            }
+        }
+        if (!exp_digits) {
+            return false;
+        }
+        exponent += exp_negative ? -exp : exp;
+    }
+    if (i != len) {
+        return false;
+    }
+
+    if (negative || mantissa == 0) {
+        *out_ps = 0;
+    } else if (exponent < 0) {
+        /* mantissa < 1e18, so any divisor beyond 1e19 rounds to 0 */
+        if (exponent < -19) {
+            *out_ps = 0;
+        } else {
+            uint64_t divisor = 1;
+            for (int e = exponent; e < 0; e++) {
+                divisor *= 10u;
+            }
+            *out_ps = mantissa / divisor + (((mantissa % divisor) * 2u >= divisor) ? 1u : 0u);
+        }
+    } else {
+        for (; exponent > 0; exponent--) {
+            if (mantissa > UINT64_MAX / 10u) {
+                mantissa = UINT64_MAX;
+                break;
+            }
+            mantissa *= 10u;
+        }
+        *out_ps = mantissa;
+    }
+    return true;
+}
+
 static scpi_result_t parse_apg_pairs(scpi_t *context, apg_value_duration_t **out_pairs, size_t *out_count) {
     if (out_pairs == NULL || out_count == NULL) {
         return SCPI_RES_ERR;
@@ -442,12 +766,16 @@ static scpi_result_t parse_apg_pairs(scpi_t *context, apg_value_duration_t **out
             return SCPI_RES_ERR;
         }
 
-        double duration = 0.0;
-        if (!SCPI_ParamDouble(context, &duration, TRUE)) {
+        /* Duration is parsed straight to integer picoseconds, so the tick conversion is exact */
+        uint64_t duration_ps = 0;
+        if (!SCPI_Parameter(context, &param, TRUE)) {
+            return SCPI_RES_ERR;
+        }
+        if (param.type != SCPI_TOKEN_DECIMAL_NUMERIC_PROGRAM_DATA || !parse_duration_ps(param.ptr, param.len, &duration_ps)) {
+            SCPI_ErrorPush(context, SCPI_ERROR_DATA_TYPE_ERROR);
             return SCPI_RES_ERR;
         }
-        // Minimum duration is 20 ns, maximum is 60 s
-        if (duration < 20.0e-9 || duration > 60.0) {
+        if (duration_ps < APG_MIN_DURATION_PS || duration_ps > APG_MAX_DURATION_PS) {
             SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
             return SCPI_RES_ERR;
         }
@@ -464,7 +792,7 @@ static scpi_result_t parse_apg_pairs(scpi_t *context, apg_value_duration_t **out
         }
 
         (*out_pairs)[count].value = value;
-        (*out_pairs)[count].duration_sec = duration;
+        (*out_pairs)[count].duration_ps = duration_ps;
         count++;
     }
 
@@ -472,112 +800,537 @@ static scpi_result_t parse_apg_pairs(scpi_t *context, apg_value_duration_t **out
     return SCPI_RES_OK;
 }
 
-scpi_result_t custom_SOURCE_APG_DATA(scpi_t *context) {
+/* While the pattern is not playing there is nothing to keep gapless, so uploads take effect immediately */
+static bool apg_commits_now(unsigned int engine) {
+    return !g_output_state.enabled || !g_apg_config[engine].is_enabled;
+}
+
+/* Returns -1 if the segment sequence does not compile */
+static int apg_auto_commit(unsigned int engine) {
+    if (apg_commits_now(engine)) {
+        return apg_commit_data(engine);
+    }
+    return 0;
+}
+
+/* Before an upload: keep the pattern if the commit right after it may fail (see apg_upload_commit) */
+static bool apg_upload_begin(unsigned int engine) {
+    const bool save = apg_commits_now(engine) && g_apg_config[engine].sequence_enabled;
+    if (save) {
+        apg_upload_save(engine);
+    }
+    return save;
+}
+
+/* After an upload: commit it like apg_auto_commit(); if the sequence does not compile with it, it is undone */
+static int apg_upload_commit(unsigned int engine, bool saved) {
+    if (apg_auto_commit(engine) != 0) {
+        if (saved) {
+            apg_upload_restore(engine);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Write APG data from either ASCII value/duration pairs or a definite-length binary block. */
+static scpi_result_t write_apg_data(scpi_t *context, const unsigned int indices[1], bool append) {
     apg_value_duration_t *pairs = NULL;
     size_t count = 0;
 
-    if (g_output_state.enabled) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    const unsigned int engine = APG_ENGINE(indices);
+
+    /* The shadow bank is only writable once the previous commit has been picked up */
+    if (!apg_shadow_ready(engine)) {
         SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
         return SCPI_RES_ERR;
     }
 
-    if (parse_apg_pairs(context, &pairs, &count) != SCPI_RES_OK) {
-        free(pairs);
+    /* Peek at the first parameter to select the format, rewind for the ASCII parser */
+    scpi_param_list_t saved_params = context->param_list;
+    int_fast16_t saved_input_count = context->input_count;
+    scpi_parameter_t first;
+    if (!SCPI_Parameter(context, &first, TRUE)) {
         return SCPI_RES_ERR;
     }
 
-    if (apg_write_data(pairs, count, false) != 0) {
+    if (first.type == SCPI_TOKEN_ARBITRARY_BLOCK_PROGRAM_DATA) {
+        /* Binary block is converted straight from the input buffer into pattern memory */
+        const bool saved = apg_upload_begin(engine);
+        switch (apg_write_block(engine, (const uint8_t *)first.ptr, first.len, append)) {
+        case 0:
+            if (apg_upload_commit(engine, saved) != 0) {
+                SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+                return SCPI_RES_ERR;
+            }
+            return SCPI_RES_OK;
+        case -1:
+            SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
+            return SCPI_RES_ERR;
+        default:
+            SCPI_ErrorPush(context, SCPI_ERROR_INVALID_BLOCK_DATA);
+            return SCPI_RES_ERR;
+        }
+    }
+
+    context->param_list = saved_params;
+    context->input_count = saved_input_count;
+
+    if (parse_apg_pairs(context, &pairs, &count) != SCPI_RES_OK) {
         free(pairs);
-        SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
         return SCPI_RES_ERR;
     }
 
+    const bool saved = apg_upload_begin(engine);
+    const int res = apg_write_data(engine, pairs, count, append);
     free(pairs);
+    if (res != 0) {
+        SCPI_ErrorPush(context, (res == -1) ? SCPI_ERROR_TOO_MUCH_DATA
+                                : (res == -3) ? SCPI_ERROR_DATA_OUT_OF_RANGE
+                                              : SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    }
+
+    if (apg_upload_commit(engine, saved) != 0) {
+        SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    }
     return SCPI_RES_OK;
 }
 
-scpi_result_t custom_SOURCE_APG_DATA_QUERY(scpi_t *context) {
-    apg_value_duration_t *pairs = NULL;
-    size_t count = 0;
-    if (apg_read_data(&pairs, &count) != 0) {
-        free(pairs);
-        SCPI_ErrorPush(context, SCPI_ERROR_OUT_OF_MEMORY);
+scpi_result_t custom_SOURCE_APGN_DATA(scpi_t *context, const unsigned int indices[1]) {
+    return write_apg_data(context, indices, false);
+}
+
+/* DATA? readback position; the pairs after the first are produced as the connection drains */
+static apg_read_iter_t s_apg_read_iter;
+
+static bool produce_apg_data(char *buf, size_t size, size_t *len) {
+    *len = 0;
+    for (;;) {
+        apg_read_iter_t next = s_apg_read_iter;
+        apg_value_duration_t pair;
+        if (!apg_read_next(&next, &pair)) {
+            return false;
+        }
+
+        /* Same formatting as SCPI_ResultUInt32/SCPI_ResultDouble */
+        char item[64];
+        size_t n = 0;
+        item[n++] = ',';
+        n += SCPI_UInt32ToStrBase(pair.value, item + n, sizeof(item) - n, 10);
+        item[n++] = ',';
+        n += SCPI_DoubleToStr((double)pair.duration_ps / (double)APG_PS_PER_SEC, item + n, sizeof(item) - n);
+        if (n > size - *len) {
+            return true; /* next time */
+        }
+
+        memcpy(buf + *len, item, n);
+        *len += n;
+        s_apg_read_iter = next;
+    }
+}
+
+scpi_result_t custom_SOURCE_APGN_DATA_QUERY(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    if (!scpi_server_defer_ready()) {
+        SCPI_ErrorPush(context, SCPI_ERROR_QUERY_INTERRUPTED);
         return SCPI_RES_ERR;
     }
 
-    for (size_t i = 0; i < count; i++) {
-        SCPI_ResultUInt32(context, pairs[i].value);
-        SCPI_ResultDouble(context, pairs[i].duration_sec);
+    apg_value_duration_t pair;
+    apg_read_begin(APG_ENGINE(indices), &s_apg_read_iter);
+    if (!apg_read_next(&s_apg_read_iter, &pair)) {
+        return SCPI_RES_OK; /* no data */
     }
 
-    free(pairs);
+    SCPI_ResultUInt32(context, pair.value);
+    SCPI_ResultDouble(context, (double)pair.duration_ps / (double)APG_PS_PER_SEC);
+    scpi_server_defer(produce_apg_data);
     return SCPI_RES_OK;
 }
 
-scpi_result_t custom_SOURCE_APG_DATA_APPEND(scpi_t *context) {
-    apg_value_duration_t *pairs = NULL;
-    size_t count = 0;
+scpi_result_t custom_SOURCE_APGN_DATA_APPEND(scpi_t *context, const unsigned int indices[1]) {
+    return write_apg_data(context, indices, true);
+}
 
-    if (g_output_state.enabled) {
+int custom_SOURCE_APGN_DATA_COMMIT(const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE(indices);
+    if (!apg_shadow_ready(APG_ENGINE(indices))) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    if (apg_commit_data(APG_ENGINE(indices)) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+scpi_result_t custom_SOURCE_APGN_DATA_POINTS(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    SCPI_ResultUInt32(context, (uint32_t)g_apg_config[APG_ENGINE(indices)].data_count);
+    return SCPI_RES_OK;
+}
+
+int custom_SOURCE_APGN_DATA_FORMAT(const unsigned int indices[1], SOURCE_APGN_DATA_FORMAT_FORMAT_t format) {
+    REQUIRE_APG_ENGINE(indices);
+    const unsigned int engine = APG_ENGINE(indices);
+    if (!apg_shadow_ready(engine)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    /* The packed program drives GPIO 0..15 only: the mapped bits and the marker GPIO (see MARKer:GPIO) */
+    const int marker_gpio = g_apg_config[engine].marker_gpio;
+    if (format == FORMAT_PACKED && ((apg_gpio_mask(engine) & ~APG_PACKED_GPIO_MASK) != 0 ||
+                                    (marker_gpio >= 0 && ((1u << marker_gpio) & ~APG_PACKED_GPIO_MASK) != 0))) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+
+    const bool saved = apg_upload_begin(engine);
+    apg_set_format(engine, format);
+    if (apg_upload_commit(engine, saved) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_DATA_FORMAT_QUERY(const unsigned int indices[1], SOURCE_APGN_DATA_FORMAT_FORMAT_t *format) {
+    REQUIRE_APG_ENGINE(indices);
+    *format = g_apg_config[APG_ENGINE(indices)].data_format;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_DATA_SRATE(const unsigned int indices[1], float rate) {
+    REQUIRE_APG_ENGINE(indices);
+    if (apg_set_sample_rate(APG_ENGINE(indices), rate) != 0) {
+        return SCPI_ERROR_DATA_OUT_OF_RANGE;
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_DATA_SRATE_QUERY(const unsigned int indices[1], float *rate) {
+    REQUIRE_APG_ENGINE(indices);
+    *rate = apg_get_sample_rate(APG_ENGINE(indices));
+    return SCPI_ERROR_NO_ERROR;
+}
+
+/* Apply changed generator settings; a generated pattern is written to the shadow bank like an upload */
+static int set_apg_generator(unsigned int engine, const apg_gen_config_t *gen) {
+    const bool pattern = !g_apg_config[engine].stream_enabled;
+    if (pattern && !apg_shadow_ready(engine)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    const bool saved = pattern && apg_upload_begin(engine);
+    if (apg_set_generator(engine, gen) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    if (pattern && gen->type != GEN_TYPE_NONE && apg_upload_commit(engine, saved) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_GENERATE_TYPE(const unsigned int indices[1], SOURCE_APGN_GENERATE_TYPE_GEN_TYPE_t gen_type) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_gen_config_t gen = g_apg_config[APG_ENGINE(indices)].gen;
+    gen.type = gen_type;
+    return set_apg_generator(APG_ENGINE(indices), &gen);
+}
+
+int custom_SOURCE_APGN_GENERATE_TYPE_QUERY(const unsigned int indices[1], SOURCE_APGN_GENERATE_TYPE_GEN_TYPE_t *gen_type) {
+    REQUIRE_APG_ENGINE(indices);
+    *gen_type = g_apg_config[APG_ENGINE(indices)].gen.type;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_GENERATE_WIDTH(const unsigned int indices[1], unsigned int width) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_gen_config_t gen = g_apg_config[APG_ENGINE(indices)].gen;
+    gen.width = width;
+    return set_apg_generator(APG_ENGINE(indices), &gen);
+}
+
+int custom_SOURCE_APGN_GENERATE_WIDTH_QUERY(const unsigned int indices[1], unsigned int *width) {
+    REQUIRE_APG_ENGINE(indices);
+    *width = g_apg_config[APG_ENGINE(indices)].gen.width;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_GENERATE_SEED(const unsigned int indices[1], unsigned int seed) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_gen_config_t gen = g_apg_config[APG_ENGINE(indices)].gen;
+    gen.seed = seed;
+    return set_apg_generator(APG_ENGINE(indices), &gen);
+}
+
+int custom_SOURCE_APGN_GENERATE_SEED_QUERY(const unsigned int indices[1], unsigned int *seed) {
+    REQUIRE_APG_ENGINE(indices);
+    *seed = g_apg_config[APG_ENGINE(indices)].gen.seed;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_GAPLESS(const unsigned int indices[1], bool state) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_set_gapless(APG_ENGINE(indices), state);
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_GAPLESS_QUERY(const unsigned int indices[1], bool *state) {
+    REQUIRE_APG_ENGINE(indices);
+    *state = g_apg_config[APG_ENGINE(indices)].gapless;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_SEQUENCE_STATE(const unsigned int indices[1], bool state) {
+    REQUIRE_APG_ENGINE(indices);
+    const unsigned int engine = APG_ENGINE(indices);
+    if (!apg_shadow_ready(engine)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+
+    const bool previous = g_apg_config[engine].sequence_enabled;
+    g_apg_config[engine].sequence_enabled = state;
+    if (apg_auto_commit(engine) != 0) {
+        g_apg_config[engine].sequence_enabled = previous;
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_SEQUENCE_STATE_QUERY(const unsigned int indices[1], bool *state) {
+    REQUIRE_APG_ENGINE(indices);
+    *state = g_apg_config[APG_ENGINE(indices)].sequence_enabled;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+scpi_result_t custom_SOURCE_APGN_SEQUENCE_SEGMENTK_DEFINE(scpi_t *context, const unsigned int indices[2]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    const unsigned int engine = APG_ENGINE(indices);
+    const unsigned int segment = indices[1];
+
+    apg_segment_t seg = {.repeat = 1, .next = segment + 1u, .wait = false};
+    scpi_bool_t wait = FALSE;
+    if (!SCPI_ParamUInt32(context, &seg.start, TRUE) || !SCPI_ParamUInt32(context, &seg.points, TRUE)) {
+        return SCPI_RES_ERR;
+    }
+    if ((!SCPI_ParamUInt32(context, &seg.repeat, FALSE) && SCPI_ParamErrorOccurred(context)) ||
+        (!SCPI_ParamUInt32(context, &seg.next, FALSE) && SCPI_ParamErrorOccurred(context)) ||
+        (!SCPI_ParamBool(context, &wait, FALSE) && SCPI_ParamErrorOccurred(context))) {
+        return SCPI_RES_ERR;
+    }
+    seg.wait = wait;
+    if (segment < 1 || segment > APG_MAX_SEGMENTS || seg.repeat < 1 || seg.next > APG_MAX_SEGMENTS) {
+        SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return SCPI_RES_ERR;
+    }
+
+    /* Only a sequence in use is committed right away */
+    if (!g_apg_config[engine].sequence_enabled) {
+        apg_set_segment(engine, segment, &seg);
+        return SCPI_RES_OK;
+    }
+    if (!apg_shadow_ready(engine)) {
+        SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    }
+    apg_segment_t previous;
+    apg_get_segment(engine, segment, &previous);
+    apg_set_segment(engine, segment, &seg);
+    if (apg_auto_commit(engine) != 0) {
+        apg_set_segment(engine, segment, &previous);
         SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
         return SCPI_RES_ERR;
     }
+    return SCPI_RES_OK;
+}
 
-    if (parse_apg_pairs(context, &pairs, &count) != SCPI_RES_OK) {
-        free(pairs);
+scpi_result_t custom_SOURCE_APGN_SEQUENCE_SEGMENTK_DEFINE_QUERY(scpi_t *context, const unsigned int indices[2]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    if (indices[1] < 1 || indices[1] > APG_MAX_SEGMENTS) {
+        SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);
         return SCPI_RES_ERR;
     }
 
-    if (apg_write_data(pairs, count, true) != 0) {
-        free(pairs);
+    apg_segment_t seg;
+    apg_get_segment(APG_ENGINE(indices), indices[1], &seg);
+    SCPI_ResultUInt32(context, seg.start);
+    SCPI_ResultUInt32(context, seg.points);
+    SCPI_ResultUInt32(context, seg.repeat);
+    SCPI_ResultUInt32(context, seg.next);
+    SCPI_ResultBool(context, seg.wait);
+    return SCPI_RES_OK;
+}
+
+int custom_SOURCE_APGN_STREAM_STATE(const unsigned int indices[1], bool state) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_stream_set_state(APG_ENGINE(indices), state);
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_STREAM_STATE_QUERY(const unsigned int indices[1], bool *state) {
+    REQUIRE_APG_ENGINE(indices);
+    *state = g_apg_config[APG_ENGINE(indices)].stream_enabled;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+scpi_result_t custom_SOURCE_APGN_STREAM_DATA(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    const char *block = NULL;
+    size_t len = 0;
+    if (!SCPI_ParamArbitraryBlock(context, &block, &len, TRUE)) {
+        return SCPI_RES_ERR;
+    }
+
+    switch (apg_stream_write_block(APG_ENGINE(indices), (const uint8_t *)block, len)) {
+    case 0:
+        return SCPI_RES_OK;
+    case -1:
         SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
         return SCPI_RES_ERR;
+    case -3:
+        SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    default:
+        SCPI_ErrorPush(context, SCPI_ERROR_INVALID_BLOCK_DATA);
+        return SCPI_RES_ERR;
     }
+}
 
-    free(pairs);
+scpi_result_t custom_SOURCE_APGN_STREAM_FREE(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    SCPI_ResultUInt32(context, (uint32_t)apg_stream_free(APG_ENGINE(indices)));
     return SCPI_RES_OK;
 }
 
-scpi_result_t custom_SOURCE_APG_DATA_POINTS(scpi_t *context) {
-    SCPI_ResultUInt32(context, (uint32_t)g_apg_data_count);
+scpi_result_t custom_SOURCE_APGN_STREAM_UNDERRUNS(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+    SCPI_ResultUInt32(context, apg_stream_underruns(APG_ENGINE(indices)));
     return SCPI_RES_OK;
 }
 
-int custom_SOURCE_APG_IDLE_MODE(SOURCE_APG_IDLE_MODE_IDLE_MODE_t idle_mode) {
-    g_apg_idle_mode = idle_mode;
-    apg_update_idle();
+int custom_SOURCE_APGN_IDLE_MODE(const unsigned int indices[1], SOURCE_APGN_IDLE_MODE_IDLE_MODE_t idle_mode) {
+    REQUIRE_APG_ENGINE(indices);
+    g_apg_config[APG_ENGINE(indices)].idle_mode = idle_mode;
+    apg_update_idle(APG_ENGINE(indices));
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_IDLE_MODE_QUERY(const unsigned int indices[1], SOURCE_APGN_IDLE_MODE_IDLE_MODE_t *idle_mode) {
+    REQUIRE_APG_ENGINE(indices);
+    *idle_mode = g_apg_config[APG_ENGINE(indices)].idle_mode;
+    return SCPI_ERROR_NO_ERROR;
+}
+
+int custom_SOURCE_APGN_IDLE_VALUE(const unsigned int indices[1], unsigned int idle_value) {
+    REQUIRE_APG_ENGINE(indices);
+    g_apg_config[APG_ENGINE(indices)].idle_value = idle_value;
+    apg_update_idle(APG_ENGINE(indices));
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_IDLE_MODE_QUERY(SOURCE_APG_IDLE_MODE_IDLE_MODE_t *idle_mode) {
-    *idle_mode = g_apg_idle_mode;
+int custom_SOURCE_APGN_IDLE_VALUE_QUERY(const unsigned int indices[1], unsigned int *idle_value) {
+    REQUIRE_APG_ENGINE(indices);
+    *idle_value = g_apg_config[APG_ENGINE(indices)].idle_value;
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_IDLE_VALUE(unsigned int idle_value) {
-    g_apg_idle_value = idle_value;
-    apg_update_idle();
+int custom_SOURCE_APGN_MAP_BITM_GPIO(const unsigned int indices[2], int gpio) {
+    REQUIRE_OUTPUTS_DISABLED();
+    REQUIRE_APG_ENGINE(indices);
+    const unsigned int engine = APG_ENGINE(indices);
+    const unsigned int bit = indices[1];
+
+    /* A GPIO can only be driven by one engine */
+    if (pwm_gpio_in_use(gpio) || apg_gpio_in_use((int)engine, (int)bit, gpio)) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    if (g_apg_config[engine].data_format == FORMAT_PACKED && gpio >= 0 && ((1u << gpio) & ~APG_PACKED_GPIO_MASK) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+
+    apg_set_mapping(engine, bit, gpio);
+
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_IDLE_VALUE_QUERY(unsigned int *idle_value) {
-    *idle_value = g_apg_idle_value;
+int custom_SOURCE_APGN_MAP_BITM_GPIO_QUERY(const unsigned int indices[2], int *gpio) {
+    REQUIRE_APG_ENGINE(indices);
+    apg_get_mapping(APG_ENGINE(indices), indices[1], gpio);
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_MAP_BITN_GPIO(const unsigned int indices[1], int gpio) {
+int custom_SOURCE_APGN_MARKER_GPIO(const unsigned int indices[1], int gpio) {
     REQUIRE_OUTPUTS_DISABLED();
+    REQUIRE_APG_ENGINE(indices);
+    const unsigned int engine = APG_ENGINE(indices);
+
+    /* Driven by this engine only, like a mapped bit */
+    if (gpio >= 0 && gpio != g_apg_config[engine].marker_gpio && (pwm_gpio_in_use(gpio) || apg_gpio_in_use(-1, -1, gpio))) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
+    if (g_apg_config[engine].data_format == FORMAT_PACKED && gpio >= 0 && ((1u << gpio) & ~APG_PACKED_GPIO_MASK) != 0) {
+        return SCPI_ERROR_SETTINGS_CONFLICT;
+    }
 
-    if (pwm_gpio_in_use(gpio) || apg_gpio_in_use(indices[0], gpio)) {
+    if (apg_set_marker(engine, gpio, g_apg_config[engine].marker_flag) != 0) {
         return SCPI_ERROR_SETTINGS_CONFLICT;
     }
+    return SCPI_ERROR_NO_ERROR;
+}
 
-    apg_set_mapping(indices[0], gpio);
+int custom_SOURCE_APGN_MARKER_GPIO_QUERY(const unsigned int indices[1], int *gpio) {
+    REQUIRE_APG_ENGINE(indices);
+    *gpio = g_apg_config[APG_ENGINE(indices)].marker_gpio;
+    return SCPI_ERROR_NO_ERROR;
+}
 
+int custom_SOURCE_APGN_MARKER_FLAG(const unsigned int indices[1], int bit) {
+    REQUIRE_OUTPUTS_DISABLED();
+    REQUIRE_APG_ENGINE(indices);
+    const unsigned int engine = APG_ENGINE(indices);
+    (void)apg_set_marker(engine, g_apg_config[engine].marker_gpio, bit); /* the start is marked already */
     return SCPI_ERROR_NO_ERROR;
 }
 
-int custom_SOURCE_APG_MAP_BITN_GPIO_QUERY(const unsigned int indices[1], int *gpio) {
-    apg_get_mapping(indices[0], gpio);
+int custom_SOURCE_APGN_MARKER_FLAG_QUERY(const unsigned int indices[1], int *bit) {
+    REQUIRE_APG_ENGINE(indices);
+    *bit = g_apg_config[APG_ENGINE(indices)].marker_flag;
     return SCPI_ERROR_NO_ERROR;
 }
+
+scpi_result_t custom_SOURCE_APGN_JITTER(scpi_t *context, const unsigned int indices[1]) {
+    REQUIRE_APG_ENGINE_CONTEXT(context, indices);
+
+    int32_t gpio = 0;
+    uint32_t periods = APG_PROBE_MAX_PERIODS;
+    if (!SCPI_ParamInt32(context, &gpio, TRUE)) {
+        return SCPI_RES_ERR;
+    }
+    if (!SCPI_ParamUInt32(context, &periods, FALSE) && SCPI_ParamErrorOccurred(context)) {
+        return SCPI_RES_ERR;
+    }
+    if (gpio < 0 || gpio > 22 || periods < 1 || periods > APG_PROBE_MAX_PERIODS) {
+        SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return SCPI_RES_ERR;
+    }
+
+    apg_probe_result_t result;
+    switch (apg_probe_periods(APG_ENGINE(indices), (unsigned int)gpio, periods, &result)) {
+    case 0:
+        break;
+    case -1:
+        SCPI_ErrorPush(context, SCPI_ERROR_HARDWARE_ERROR);
+        return SCPI_RES_ERR;
+    case -3:
+        SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+        return SCPI_RES_ERR;
+    default:
+        SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+        return SCPI_RES_ERR;
+    }
+
+    SCPI_ResultUInt32(context, result.max_cycles - result.min_cycles);
+    SCPI_ResultUInt32(context, result.min_cycles);
+    SCPI_ResultUInt32(context, result.max_cycles);
+    SCPI_ResultUInt32(context, result.periods);
+    return SCPI_RES_OK;
+}
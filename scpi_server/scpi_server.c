@@ -34,12 +34,24 @@ enum scpi_target_kind { SCPI_TARGET_TCP = 0,
 struct scpi_target {
     enum scpi_target_kind kind;
     struct mg_connection *c; /* connection for both TCP and HTTP */
+    bool http_started;       /* HTTP: response line sent, data goes out as chunks */
 };
 
+/* Deferred query response (see scpi_server_defer) */
+#define SCPI_DEFER_HIGH_WATER 1024 /* Refill the send buffer while it holds less than this */
+#define SCPI_DEFER_CHUNK 128       /* Producer buffer size */
+#define SCPI_DEFER_TAIL 256        /* Output held back behind the producer (line ending, later commands) */
+#define SCPI_DEFER_RECV_MAX SCPI_INPUT_BUFFER_LENGTH /* TCP input kept meanwhile: one more command, binary block included */
+
 static struct mg_connection *tcp_listener_conn = NULL;
 static struct mg_connection *http_listener_conn = NULL;
 /* active_target holds the current TCP or HTTP session */
 static struct scpi_target active_conn;
+static scpi_server_producer_t defer_producer = NULL;
+static char defer_tail[SCPI_DEFER_TAIL];
+static size_t defer_tail_len = 0;
+static bool defer_recv_skip = false; /* Input was dropped mid-line, the rest of that line is skipped */
+static size_t defer_recv_kept = 0;   /* Received bytes kept before the skipped ones */
 
 /* event handler */
 static void tcp_ev_handler(struct mg_connection *c, int ev, void *ev_data);
@@ -47,6 +59,11 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data);
 
 /* forward declarations */
 static void close_connection(struct mg_connection *c);
+static void tcp_input(struct mg_connection *c);
+static void defer_pump(struct mg_connection *c);
+static void defer_cancel(void);
+static void defer_recv_skip_line(struct mg_connection *c);
+static void defer_recv_limit(struct mg_connection *c);
 
 /* SCPI interface functions referenced by scpi-def.c */
 size_t SCPI_Write(scpi_t *context, const char *data, size_t len);
@@ -102,18 +119,25 @@ static void tcp_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
         active_conn.c = c;
         break;
 
-    case MG_EV_READ: {
-        /* feed received bytes into SCPI parser */
-        size_t n = c->recv.len;
-        if (n > 0) {
-            SCPI_Input(&scpi_context, (char *)c->recv.buf, (int)n);
-            c->recv.len = 0; // Tell Mongoose we've consumed data
+    case MG_EV_READ:
+        /* Keep further commands in the receive buffer while a deferred response is being sent */
+        if (defer_producer == NULL) {
+            tcp_input(c);
+        } else {
+            defer_recv_limit(c);
         }
-    } break;
+        break;
+
+    case MG_EV_POLL:
+    case MG_EV_WRITE:
+        defer_pump(c);
+        break;
 
     case MG_EV_CLOSE:
-        if (active_conn.c == c)
+        if (active_conn.c == c) {
+            defer_cancel();
             active_conn.c = NULL;
+        }
         break;
 
     default:
@@ -133,6 +157,7 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
         /* store connection */
         active_conn.kind = SCPI_TARGET_HTTP;
         active_conn.c = c;
+        active_conn.http_started = false;
         scpi_context.user_context = &active_conn;
 
         struct mg_http_message *hm = (struct mg_http_message *)ev_data;
@@ -145,8 +170,9 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
             SCPI_Input(&scpi_context, hm->body.buf, (int)hm->body.len);
         } else if (hm->query.len > 0) {
             /* Use query param 'cmd'. Reject if missing or would overflow buffer. */
-            // todo: if we increase buffer size in future, we may need to allocate this dynamically instead of on stack
-            char query_buf[SCPI_INPUT_BUFFER_LENGTH] = "";
+            /* Static, as the input buffer is sized for binary blocks and too large for the stack */
+            static char query_buf[SCPI_INPUT_BUFFER_LENGTH];
+            query_buf[0] = '\0';
             int l = mg_http_get_var(&hm->query, "cmd", query_buf, sizeof(query_buf));
             if (l < 0) {
                 mg_http_reply(c, 400, "Content-Type: text/plain\r\n", "Missing or invalid 'cmd' parameter\r\n");
@@ -163,10 +189,13 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
         int32_t err_count = SCPI_ErrorCount(&scpi_context);
         if (err_count > 0) {
             /* Return 400 with error info for any command or execution error */
+            defer_cancel();
             mg_http_reply(c, 400, "Content-Type: plain/text\r\n", "");
+        } else if (defer_producer != NULL) {
+            /* Response is completed by defer_pump() */
         } else {
-            /* Check if there is data in your output buffer to decide between 200 and 204 */
-            if (c->send.len > 0) {
+            /* Check if a response was started to decide between 200 and 204 */
+            if (active_conn.http_started) {
                 mg_http_write_chunk(c, "", 0); /* Final empty chunk */
             } else {
                 mg_http_reply(c, 204, "", ""); /* No Content */
@@ -174,10 +203,17 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
         }
     } break;
 
+    case MG_EV_POLL:
+    case MG_EV_WRITE:
+        defer_pump(c);
+        break;
+
     case MG_EV_CLOSE:
         /* Final notification: triggered whenever a connection is closed */
-        if (active_conn.c == c)
+        if (active_conn.c == c) {
+            defer_cancel();
             active_conn.c = NULL;
+        }
         break;
 
     default:
@@ -185,6 +221,17 @@ static void http_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
     }
 }
 
+size_t scpi_server_buffer_usage(void) {
+    const struct mg_connection *listener = tcp_listener_conn ? tcp_listener_conn : http_listener_conn;
+    if (!listener)
+        return 0;
+    size_t total = 0;
+    for (const struct mg_connection *c = listener->mgr->conns; c != NULL; c = c->next) {
+        total += c->recv.size + c->send.size;
+    }
+    return total;
+}
+
 static void http_start_chunk(struct mg_connection *c, int code, const char *code_str, const char *headers) {
     mg_printf(c, "HTTP/1.1 %d %s\r\n%sTransfer-Encoding: chunked\r\n\r\n", code,
               code_str, headers == NULL ? "" : headers);
@@ -193,11 +240,118 @@ static void http_start_chunk(struct mg_connection *c, int code, const char *code
 static void close_connection(struct mg_connection *c) {
     if (!c)
         return;
-    /* Flush parser state and mark previous connection draining */
+    /* Drop a pending deferred response, flush parser state and mark previous connection draining */
+    defer_cancel();
     SCPI_Input(&scpi_context, NULL, 0);
     c->is_draining = 1;
 }
 
+static void tcp_input(struct mg_connection *c) {
+    defer_recv_skip_line(c);
+
+    /* feed received bytes into SCPI parser */
+    size_t n = c->recv.len;
+    if (n > 0) {
+        SCPI_Input(&scpi_context, (char *)c->recv.buf, (int)n);
+        c->recv.len = 0; // Tell Mongoose we've consumed data
+    }
+    defer_recv_kept = 0;
+}
+
+/* Send response data to the target as is (HTTP: as a chunk, after the response line) */
+static void target_send(struct scpi_target *t, const char *data, size_t len) {
+    if (t->kind == SCPI_TARGET_TCP) {
+        mg_send(t->c, data, len);
+    } else {
+        if (!t->http_started) {
+            http_start_chunk(t->c, 200, "OK", "Content-Type: text/plain\r\n");
+            t->http_started = true;
+        }
+        mg_http_write_chunk(t->c, data, len);
+    }
+}
+
+/* ---------------------- Deferred query responses ----------------------- */
+
+bool scpi_server_defer_ready(void) {
+    return active_conn.c != NULL && defer_producer == NULL;
+}
+
+void scpi_server_defer(scpi_server_producer_t producer) {
+    defer_producer = producer;
+    defer_tail_len = 0;
+}
+
+static void defer_cancel(void) {
+    defer_producer = NULL;
+    defer_tail_len = 0;
+    defer_recv_skip = false;
+    defer_recv_kept = 0;
+}
+
+/* Drop the received rest of a line cut by defer_recv_limit(), up to its end */
+static void defer_recv_skip_line(struct mg_connection *c) {
+    if (!defer_recv_skip) {
+        return;
+    }
+    const size_t from = defer_recv_kept;
+    const char *end = memchr(&c->recv.buf[from], '\n', c->recv.len - from);
+    const size_t len = (end != NULL) ? (size_t)(end - (const char *)&c->recv.buf[from]) + 1u : c->recv.len - from;
+    mg_iobuf_del(&c->recv, from, len);
+    defer_recv_skip = (end == NULL);
+}
+
+/*
+ * Input received behind a deferred response stays in the receive buffer, which the TCP stack keeps
+ * growing. Beyond SCPI_DEFER_RECV_MAX, only the complete lines that fit are kept, the rest is dropped
+ * (and a line cut that way skipped up to its end) with an input buffer overrun reported.
+ */
+static void defer_recv_limit(struct mg_connection *c) {
+    defer_recv_skip_line(c);
+    if (c->recv.len > SCPI_DEFER_RECV_MAX) {
+        size_t keep = SCPI_DEFER_RECV_MAX;
+        while (keep > 0 && c->recv.buf[keep - 1u] != '\n') {
+            keep--;
+        }
+        SCPI_ErrorPush(&scpi_context, SCPI_ERROR_INPUT_BUFFER_OVERRUN);
+        defer_recv_skip = c->recv.buf[c->recv.len - 1u] != '\n';
+        c->recv.len = keep;
+    }
+    defer_recv_kept = c->recv.len;
+}
+
+/* Refill the send buffer from the producer; when done, send the held back output and resume input */
+static void defer_pump(struct mg_connection *c) {
+    if (defer_producer == NULL || active_conn.c != c) {
+        return;
+    }
+
+    char buf[SCPI_DEFER_CHUNK];
+    while (c->send.len < SCPI_DEFER_HIGH_WATER) {
+        size_t len = 0;
+        const bool more = defer_producer(buf, sizeof(buf), &len);
+        if (len > 0) {
+            target_send(&active_conn, buf, len);
+        }
+        if (!more) {
+            break;
+        }
+    }
+    if (c->send.len < SCPI_DEFER_HIGH_WATER) {
+        /* Producer done (the loop only ends early when it is) */
+        defer_producer = NULL;
+        if (defer_tail_len > 0) {
+            target_send(&active_conn, defer_tail, defer_tail_len);
+            defer_tail_len = 0;
+        }
+        if (active_conn.kind == SCPI_TARGET_HTTP) {
+            mg_http_write_chunk(c, "", 0); /* Final empty chunk */
+        } else {
+            tcp_input(c); /* commands received meanwhile */
+        }
+    }
+}
+
 /* ---------------------- SCPI interface functions ----------------------- */
 
 size_t SCPI_Write(scpi_t *context, const char *data, size_t len) {
@@ -209,16 +363,24 @@ size_t SCPI_Write(scpi_t *context, const char *data, size_t len) {
     if (!t->c)
         return 0;
 
+    if (defer_producer != NULL) {
+        /* Hold back behind the deferred response */
+        if (len > sizeof(defer_tail) - defer_tail_len) {
+            SCPI_ErrorPush(context, SCPI_ERROR_QUERY_INTERRUPTED);
+            return 0;
+        }
+        memcpy(defer_tail + defer_tail_len, data, len);
+        defer_tail_len += len;
+        return len;
+    }
+
     if (t->kind == SCPI_TARGET_TCP) {
         if (!mg_send(t->c, data, len))
             return 0;
         return len;
     } else {
-        /* HTTP: if buffer still empty, print HTTP response line first */
-        if (t->c->send.len == 0) {
-            http_start_chunk(t->c, 200, "OK", "Content-Type: text/plain\r\n");
-        }
-        mg_http_printf_chunk(t->c, "%.*s", (int)len, data);
+        /* HTTP: print HTTP response line first */
+        target_send(t, data, len);
         return len;
     }
 }
@@ -8,6 +8,9 @@
  #ifndef SCPI_SERVER_H
 #define SCPI_SERVER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #define SCPI_DEFAULT_PORT  5025 // scpi-raw standard port
 
 /* Forward declare mongoose manager to avoid pulling headers into callers */
@@ -30,4 +33,40 @@ void scpi_server_init(struct mg_mgr *mgr);
  */
 void scpi_server_deinit(void);
 
+/**
+ * @brief Bytes currently allocated for network send/receive buffers.
+ */
+size_t scpi_server_buffer_usage(void);
+
+/**
+ * @brief Producer of a deferred query response.
+ *
+ * Called whenever the connection's send buffer has drained, writes the next
+ * part of the response to buf (size is at least 64 bytes).
+ *
+ * @param buf Output buffer
+ * @param size Size of buf
+ * @param len Number of bytes written
+ * @return true if more data follows, false when the response is complete
+ */
+typedef bool (*scpi_server_producer_t)(char *buf, size_t size, size_t *len);
+
+/**
+ * @brief Check if a query may defer the rest of its response.
+ *
+ * @return false if there is no connection or a deferred response is already pending
+ */
+bool scpi_server_defer_ready(void);
+
+/**
+ * @brief Continue the current query response with a producer.
+ *
+ * The producer's output follows whatever the query has written so far. Output
+ * of later commands and the line ending are held back until it is done, and
+ * no further input is processed meanwhile. Only valid if scpi_server_defer_ready().
+ *
+ * @param producer Producer of the remaining response
+ */
+void scpi_server_defer(scpi_server_producer_t producer);
+
 #endif /* _SCPI_SERVER_H_ */
\ No newline at end of file
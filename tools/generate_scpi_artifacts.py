@@ -186,12 +186,15 @@ def generate_index_extraction_code(indices):
     lines.append("    /* Extract and validate indices */")
     idx_mins = []
     idx_maxs = []
+    idx_defaults = []
     for index_info in indices:
         idx_range = index_info.get("range", "1-10")
         idx_min, idx_max = parse_index_range(idx_range)
         idx_mins.append(str(idx_min))
         idx_maxs.append(str(idx_max))
-    lines.append(f"    if (scpi_gen_parse_indices(context, indices, (const unsigned int[]){{{', '.join(idx_mins)}}}, (const unsigned int[]){{{', '.join(idx_maxs)}}}, {len(indices)}) != SCPI_RES_OK) {{")
+        # Suffix used when omitted in the command; -1 (none) makes the suffix mandatory
+        idx_defaults.append(str(index_info.get("default", -1)))
+    lines.append(f"    if (scpi_gen_parse_indices(context, indices, (const unsigned int[]){{{', '.join(idx_mins)}}}, (const unsigned int[]){{{', '.join(idx_maxs)}}}, (const int32_t[]){{{', '.join(idx_defaults)}}}, {len(indices)}) != SCPI_RES_OK) {{")
     lines.append(f"        return SCPI_RES_ERR;")
     lines.append(f"    }}")
     lines.append("")
@@ -375,7 +378,7 @@ def gen_md(docs, out):
         # Build command column with index info on new line if present
         indices = c.get("indices", [])
         if indices:
-            idx_strs = [f"{idx['name']}={idx['range']}" for idx in indices]
+            idx_strs = [f"{idx['name']}={idx['range']}" + (f" (default {idx['default']})" if "default" in idx else "") for idx in indices]
             cmd_display += "<br>" + ', '.join(idx_strs)
 
         
@@ -510,12 +513,15 @@ def gen_c_handlers(docs, c_path):
     lines.append(" * Generated helper functions")
     lines.append(" * ========================================================================== */\n")
 
-    lines.append("static inline scpi_result_t scpi_gen_parse_indices(scpi_t *context, unsigned int *indices, const unsigned int *min_vals, const unsigned int *max_vals, size_t count) {")
+    lines.append("static inline scpi_result_t scpi_gen_parse_indices(scpi_t *context, unsigned int *indices, const unsigned int *min_vals, const unsigned int *max_vals, const int32_t *default_vals, size_t count) {")
     lines.append("    if (!SCPI_CommandNumbers(context, (int32_t*)indices, count, -1)) {")
     lines.append("        SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);")
     lines.append("        return SCPI_RES_ERR;")
     lines.append("    }")
     lines.append("    for (size_t i = 0; i < count; ++i) {")
+    lines.append("        if ((int32_t)indices[i] == -1) {")
+    lines.append("            indices[i] = (unsigned int)default_vals[i]; /* omitted suffix */")
+    lines.append("        }")
     lines.append("        if (indices[i] < min_vals[i] || indices[i] > max_vals[i]) {")
     lines.append("            SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);")
     lines.append("            return SCPI_RES_ERR;")